@@ -0,0 +1,660 @@
+#pragma once
+
+#include "greylock/database.hpp"
+#include "greylock/error.hpp"
+#include "greylock/types.hpp"
+#include "greylock/utils.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Accumulates multiple documents and writes them using single write batch per database.
+//
+// Posting list updates for the same token key are pre-aggregated into one @disk_index merge operand,
+// token shard list updates are pre-aggregated into one @disk_token operand (with per-shard document counters)
+// per token shard key, thus the number of merge operands does not depend on the number of documents.
+//
+// Every document also gets forward index entry (indexed ID -> token keys), which is used to remove
+// document postings when document is deleted or replaced. Stored versions of removed documents are looked up
+// when batch is written (see @resolve()), thus batches which are still waiting to be written are taken into account. Removed IDs are written as @disk_tombstone
+// operands before posting list additions, thus document deleted and inserted again stays in the index.
+class index_batch {
+public:
+	index_batch(database &db_docs, database &db_indexes) : m_db_docs(db_docs), m_db_indexes(db_indexes) {}
+
+	// generates token keys for the document and serializes it,
+	// batch is not modified, thus multiple documents can be prepared concurrently
+	//
+	// large content is not serialized, it is written into bodies column by @insert()
+	static std::string prepare(const greylock::options &options, document &doc) {
+		doc.generate_token_keys(options);
+
+		if (options.external_body_size == 0 || doc.ctx.content.size() < options.external_body_size) {
+			doc.flags &= ~document::flag_external_body;
+			return serialize(doc);
+		}
+
+		doc.flags |= document::flag_external_body;
+
+		std::string body;
+		body.swap(doc.ctx.content);
+		std::string ret = serialize(doc);
+		body.swap(doc.ctx.content);
+
+		return ret;
+	}
+
+	// generates token keys for the document and puts it into the batch
+	void insert(document &doc) {
+		insert(doc, prepare(m_db_indexes.options(), doc));
+	}
+
+	// puts document and its serialized representation returned by @prepare() into the batch
+	void insert(const document &doc, std::string &&doc_serialized) {
+		m_docs_size += doc_serialized.size();
+
+		std::string dkey = doc.indexed_id.to_string();
+		m_docs[dkey] = std::move(doc_serialized);
+		m_deleted_docs.erase(dkey);
+
+		if (doc.flags & document::flag_external_body) {
+			m_bodies[dkey] = doc.ctx.content;
+			m_docs_size += doc.ctx.content.size();
+		} else {
+			m_bodies.erase(dkey);
+		}
+
+		m_doc_ids[doc.id] = serialize(doc.indexed_id);
+		m_deleted_doc_ids.erase(doc.id);
+
+		document_for_index did;
+		did.indexed_id = doc.indexed_id;
+
+		auto &forward = m_forward[dkey];
+		forward.clear();
+
+		for (const auto &attr: doc.idx.attributes) {
+			for (const auto &t: attr.tokens) {
+				m_indexes[t.key].ids.push_back(did);
+				forward.push_back(t.key);
+
+				auto &shards = m_shards[t.shard_key];
+				for (size_t shard: t.shards) {
+					shards[shard]++;
+				}
+
+				m_tokens++;
+			}
+		}
+
+		m_documents++;
+	}
+
+	// Removes document with given ID.
+	//
+	// Document inserted into this batch is dropped immediately, the version stored in the database
+	// (or in batches which are still waiting to be written) is looked up by @resolve() in the writer,
+	// after all preceding batches have been merged. @write() resolves removals which have not been resolved yet.
+	greylock::error_info remove(const std::string &id) {
+		auto it = m_doc_ids.find(id);
+		if (it != m_doc_ids.end()) {
+			id_t indexed_id;
+			auto err = deserialize(indexed_id, it->second.data(), it->second.size());
+			if (err)
+				return err;
+
+			std::string dkey = indexed_id.to_string();
+			drop_postings(dkey, indexed_id);
+
+			m_docs.erase(dkey);
+			m_bodies.erase(dkey);
+			m_doc_ids.erase(it);
+
+			m_removed_documents++;
+		}
+
+		m_unresolved.insert(id);
+		return greylock::error_info();
+	}
+
+	// Looks up previous versions of the documents removed by @other in this batch and in the database,
+	// and removes them. This batch must contain all batches prepared before @other, @other has to be merged
+	// into this batch right after this call. Removed and missing documents are accounted in @other.
+	greylock::error_info resolve(index_batch &other) {
+		for (const auto &id: other.m_unresolved) {
+			auto err = remove_stored(id);
+			if (err) {
+				if (err.code() != -ENOENT)
+					return err;
+
+				other.m_missing_documents++;
+				continue;
+			}
+
+			other.m_removed_documents++;
+		}
+
+		other.m_unresolved.clear();
+		return greylock::error_info();
+	}
+
+	// moves all documents and index updates from @other into this batch,
+	// @other must have been prepared after this batch, it is used to group commit multiple batches
+	void merge(index_batch &other) {
+		// removals made by @other apply to documents inserted into this batch
+		for (auto &p: other.m_removed) {
+			auto &ids = m_indexes[p.first].ids;
+			for (const auto &did: p.second.ids) {
+				ids.erase(std::remove_if(ids.begin(), ids.end(),
+						[&] (const document_for_index &d) {
+							return d.indexed_id == did.indexed_id;
+						}), ids.end());
+			}
+
+			auto &removed = m_removed[p.first].ids;
+			removed.insert(removed.end(), p.second.ids.begin(), p.second.ids.end());
+		}
+
+		// @other could not find forward index entry of the documents which have been inserted into this batch
+		for (const auto &indexed_id: other.m_deleted_ids) {
+			auto fit = m_forward.find(indexed_id.to_string());
+			if (fit == m_forward.end()) {
+				m_deleted_ids.push_back(indexed_id);
+				continue;
+			}
+
+			for (const auto &key: fit->second) {
+				auto &ids = m_indexes[key].ids;
+				ids.erase(std::remove_if(ids.begin(), ids.end(),
+						[&] (const document_for_index &d) {
+							return d.indexed_id == indexed_id;
+						}), ids.end());
+			}
+		}
+
+		m_stored_bodies.insert(other.m_stored_bodies.begin(), other.m_stored_bodies.end());
+
+		for (const auto &dkey: other.m_deleted_docs) {
+			m_docs.erase(dkey);
+			m_bodies.erase(dkey);
+			m_forward.erase(dkey);
+			m_deleted_docs.insert(dkey);
+		}
+		for (const auto &id: other.m_deleted_doc_ids) {
+			m_doc_ids.erase(id);
+			m_deleted_doc_ids.insert(id);
+		}
+
+		// body of this batch's document is replaced even if the newer document is inline
+		for (auto &p: other.m_docs) {
+			m_docs[p.first] = std::move(p.second);
+			m_bodies.erase(p.first);
+			m_deleted_docs.erase(p.first);
+		}
+		drop_reinserted_ids();
+		for (auto &p: other.m_bodies) {
+			m_bodies[p.first] = std::move(p.second);
+		}
+		for (auto &p: other.m_doc_ids) {
+			m_doc_ids[p.first] = std::move(p.second);
+			m_deleted_doc_ids.erase(p.first);
+		}
+		for (auto &p: other.m_forward) {
+			m_forward[p.first] = std::move(p.second);
+		}
+
+		for (auto &p: other.m_indexes) {
+			auto &ids = m_indexes[p.first].ids;
+			ids.insert(ids.end(), p.second.ids.begin(), p.second.ids.end());
+		}
+
+		for (const auto &p: other.m_shards) {
+			auto &shards = m_shards[p.first];
+			for (const auto &sh: p.second) {
+				shards[sh.first] += sh.second;
+			}
+		}
+
+		m_unresolved.insert(other.m_unresolved.begin(), other.m_unresolved.end());
+
+		m_documents += other.m_documents;
+		m_removed_documents += other.m_removed_documents;
+		m_missing_documents += other.m_missing_documents;
+		m_tokens += other.m_tokens;
+		m_docs_size += other.m_docs_size;
+
+		other.clear();
+	}
+
+	void clear() {
+		m_docs.clear();
+		m_bodies.clear();
+		m_doc_ids.clear();
+		m_forward.clear();
+		m_indexes.clear();
+		m_shards.clear();
+
+		m_deleted_docs.clear();
+		m_stored_bodies.clear();
+		m_deleted_doc_ids.clear();
+		m_deleted_ids.clear();
+		m_removed.clear();
+		m_unresolved.clear();
+
+		m_documents = 0;
+		m_removed_documents = 0;
+		m_missing_documents = 0;
+		m_tokens = 0;
+		m_docs_size = 0;
+	}
+
+	// number of documents inserted into the batch
+	size_t documents() const {
+		return m_documents;
+	}
+
+	// number of documents removed by the batch
+	size_t removed_documents() const {
+		return m_removed_documents;
+	}
+
+	// number of removed IDs which do not have stored document, it is known after removals have been resolved
+	size_t missing_documents() const {
+		return m_missing_documents;
+	}
+
+	// number of (document, token) pairs in the batch
+	size_t tokens() const {
+		return m_tokens;
+	}
+
+	// number of distinct posting lists updated by the batch
+	size_t keys() const {
+		return m_indexes.size();
+	}
+
+	// total size of serialized documents
+	size_t docs_size() const {
+		return m_docs_size;
+	}
+
+	// writes documents first, so that posting lists never reference missing document,
+	// if @sync is set, write-ahead logs of both databases are synced to disk before return
+	greylock::error_info write(bool sync = false) {
+		// batch has not been merged by the writer, its removals are resolved against the database only
+		if (!m_unresolved.empty()) {
+			index_batch stored(m_db_docs, m_db_indexes);
+			auto err = stored.resolve(*this);
+			if (err)
+				return err;
+
+			stored.merge(*this);
+			merge(stored);
+		}
+
+		if (m_documents == 0 && m_removed_documents == 0) {
+			return greylock::error_info();
+		}
+
+		drop_reinserted_ids();
+
+		rocksdb::WriteBatch docs_batch;
+		auto docs_handle = m_db_docs.cfhandle(options::documents_column);
+		auto ids_handle = m_db_docs.cfhandle(options::document_ids_column);
+		auto bodies_handle = m_db_docs.cfhandle(options::bodies_column);
+
+		for (const auto &dkey: m_deleted_docs) {
+			docs_batch.Delete(docs_handle, rocksdb::Slice(dkey));
+		}
+		for (const auto &id: m_deleted_doc_ids) {
+			docs_batch.Delete(ids_handle, rocksdb::Slice(id));
+		}
+
+		for_each(options::documents_column, [&] (const std::string &key, const std::string &value) {
+				docs_batch.Put(docs_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+			});
+		for_each(options::document_ids_column, [&] (const std::string &key, const std::string &value) {
+				docs_batch.Put(ids_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+			});
+		for_each(options::bodies_column, [&] (const std::string &key, const std::string &value) {
+				docs_batch.Put(bodies_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+			});
+		// body of the removed stored document is deleted unless it is replaced by the new external body
+		for (const auto &dkey: m_stored_bodies) {
+			if (m_bodies.find(dkey) == m_bodies.end()) {
+				docs_batch.Delete(bodies_handle, rocksdb::Slice(dkey));
+			}
+		}
+
+		auto err = m_db_docs.write(&docs_batch, sync);
+		if (err) {
+			return greylock::create_error(err.code(), "could not write docs batch, documents: %ld, error: %s",
+					m_documents, err.message().c_str());
+		}
+
+		rocksdb::WriteBatch indexes_batch;
+		auto indexes_handle = m_db_indexes.cfhandle(options::indexes_column);
+		auto shards_handle = m_db_indexes.cfhandle(options::token_shards_column);
+		auto forward_handle = m_db_indexes.cfhandle(options::forward_column);
+		auto meta_handle = m_db_indexes.cfhandle(options::meta_column);
+
+		// posting lists of frozen shards may be served from segments, updated ones are registered
+		// before write, thus their stale segment copies are not used anymore
+		std::vector<std::string> frozen_updated;
+		size_t current_shard = m_db_indexes.current_shard();
+		auto check_frozen = [&] (const std::string &key) {
+			size_t shard;
+			if (!document::parse_index_key_shard_number(key, &shard) || shard >= current_shard)
+				return;
+			if (m_db_indexes.frozen_updated(key))
+				return;
+
+			std::string fkey = database::frozen_updated_key(m_db_indexes.options(), key);
+			indexes_batch.Put(meta_handle, rocksdb::Slice(fkey), rocksdb::Slice());
+			frozen_updated.push_back(key);
+		};
+
+		// tombstones go first, postings of the documents inserted again are added after them
+		std::string sts;
+		for (const auto &p: m_removed) {
+			serialize(p.second, &sts);
+			indexes_batch.Merge(indexes_handle, rocksdb::Slice(p.first), rocksdb::Slice(sts));
+			check_frozen(p.first);
+		}
+		for (const auto &dkey: m_deleted_docs) {
+			indexes_batch.Delete(forward_handle, rocksdb::Slice(dkey));
+		}
+		for (const auto &indexed_id: m_deleted_ids) {
+			std::string key = database::deleted_key(m_db_indexes.options(), indexed_id);
+			indexes_batch.Put(meta_handle, rocksdb::Slice(key), rocksdb::Slice());
+		}
+
+		// document deleted by previous writes is inserted again with the same indexed ID,
+		// it is unregistered before its postings are written, so that compaction does not remove them
+		std::set<id_t> undeleted;
+		auto deleted = m_db_indexes.deleted_ids();
+		if (!deleted->empty()) {
+			for (const auto &p: m_docs) {
+				id_t indexed_id(p.first.c_str());
+				if (deleted->count(indexed_id)) {
+					std::string key = database::deleted_key(m_db_indexes.options(), indexed_id);
+					indexes_batch.Delete(meta_handle, rocksdb::Slice(key));
+					undeleted.insert(indexed_id);
+				}
+			}
+		}
+		m_db_indexes.erase_deleted(undeleted);
+
+		for_each(options::indexes_column, [&] (const std::string &key, const std::string &value) {
+				indexes_batch.Merge(indexes_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+				check_frozen(key);
+			});
+		for_each(options::token_shards_column, [&] (const std::string &key, const std::string &value) {
+				indexes_batch.Merge(shards_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+			});
+		for_each(options::forward_column, [&] (const std::string &key, const std::string &value) {
+				indexes_batch.Put(forward_handle, rocksdb::Slice(key), rocksdb::Slice(value));
+			});
+
+		m_db_indexes.insert_frozen_updated(frozen_updated);
+
+		err = m_db_indexes.write(&indexes_batch, sync);
+		if (err) {
+			return greylock::create_error(err.code(), "could not write indexes batch, documents: %ld, keys: %ld, error: %s",
+					m_documents, m_indexes.size(), err.message().c_str());
+		}
+
+		m_db_indexes.insert_deleted(m_deleted_ids);
+		return greylock::error_info();
+	}
+
+	// calls @func(key, value) for every inserted entry of @column in key order,
+	// values are serialized the same way they are written into the database
+	void for_each(int column, const std::function<void (const std::string &, const std::string &)> &func) {
+		// serialization buffer is reused for every entry
+		std::string value;
+
+		switch (column) {
+		case options::documents_column:
+			for (const auto &p: m_docs) {
+				func(p.first, p.second);
+			}
+			break;
+		case options::document_ids_column:
+			for (const auto &p: m_doc_ids) {
+				func(p.first, p.second);
+			}
+			break;
+		case options::bodies_column:
+			for (const auto &p: m_bodies) {
+				func(p.first, p.second);
+			}
+			break;
+		case options::forward_column:
+			for (const auto &p: m_forward) {
+				serialize(p.second, &value);
+				func(p.first, value);
+			}
+			break;
+		case options::indexes_column:
+			for (auto &p: m_indexes) {
+				auto &ids = p.second.ids;
+				if (ids.empty())
+					continue;
+
+				std::sort(ids.begin(), ids.end());
+				ids.erase(std::unique(ids.begin(), ids.end(),
+							[] (const document_for_index &a, const document_for_index &b) {
+								return a.indexed_id == b.indexed_id;
+							}), ids.end());
+
+				serialize(p.second, &value);
+				func(p.first, value);
+			}
+			break;
+		case options::token_shards_column:
+			for (const auto &p: m_shards) {
+				disk_token dt;
+				dt.shards.reserve(p.second.size());
+				dt.counts.reserve(p.second.size());
+				for (const auto &sh: p.second) {
+					dt.shards.push_back(sh.first);
+					dt.counts.push_back(sh.second);
+				}
+
+				serialize(dt, &value);
+				func(p.first, value);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+private:
+	// Removes stored document with given ID: document, its ID mapping and forward index entry are deleted,
+	// postings are removed using forward index. Returns -ENOENT if there is no such document.
+	//
+	// Documents indexed before forward index existed are registered as deleted,
+	// their postings are removed by the next full compaction of the indexes database.
+	// Document replaced by the version with the same indexed ID is not registered (see @drop_reinserted_ids()),
+	// postings of its old tokens which are not present in the new version stay in the index.
+	greylock::error_info remove_stored(const std::string &id) {
+		id_t indexed_id;
+
+		auto it = m_doc_ids.find(id);
+		if (it == m_doc_ids.end() && m_deleted_doc_ids.count(id)) {
+			return greylock::create_error(-ENOENT, "document with id %s has already been removed", id.c_str());
+		}
+
+		if (it != m_doc_ids.end()) {
+			auto err = deserialize(indexed_id, it->second.data(), it->second.size());
+			if (err)
+				return err;
+		} else {
+			std::string sid;
+			auto err = m_db_docs.read(options::document_ids_column, id, &sid);
+			if (err) {
+				if (err.code() == -rocksdb::Status::kNotFound) {
+					return greylock::create_error(-ENOENT, "there is no document with id %s", id.c_str());
+				}
+
+				return err;
+			}
+
+			err = deserialize(indexed_id, sid.data(), sid.size());
+			if (err)
+				return err;
+
+			// document has been expired, only its ID mapping is left
+			size_t expired = m_db_docs.expired_shard();
+			if (expired && indexed_id < m_db_docs.shard_start_id(expired)) {
+				m_deleted_doc_ids.insert(id);
+				return greylock::create_error(-ENOENT, "document with id %s has been expired", id.c_str());
+			}
+		}
+
+		document_for_index did;
+		did.indexed_id = indexed_id;
+		std::string dkey = indexed_id.to_string();
+
+		// document has been inserted into this batch, its postings have not been written yet
+		bool pending = drop_postings(dkey, indexed_id);
+
+		// only documents with external body have to delete it, the rest do not write tombstones into bodies column
+		if (!m_stored_bodies.count(dkey)) {
+			bool external;
+			auto err = stored_external_body(dkey, &external);
+			if (err)
+				return err;
+			if (external)
+				m_stored_bodies.insert(dkey);
+		}
+
+		// token keys of the document already written into the database
+		std::string sfwd;
+		auto err = m_db_indexes.read(options::forward_column, dkey, &sfwd);
+		if (!err) {
+			std::vector<std::string> stored;
+			err = deserialize(stored, sfwd.data(), sfwd.size());
+			if (err)
+				return err;
+
+			for (const auto &key: stored) {
+				m_removed[key].ids.push_back(did);
+			}
+		} else if (err.code() == -rocksdb::Status::kNotFound) {
+			if (!pending) {
+				m_deleted_ids.push_back(indexed_id);
+			}
+		} else {
+			return err;
+		}
+
+		m_docs.erase(dkey);
+		m_bodies.erase(dkey);
+		m_deleted_docs.insert(dkey);
+
+		m_doc_ids.erase(id);
+		m_deleted_doc_ids.insert(id);
+
+		return greylock::error_info();
+	}
+
+	// checks whether document stored in the database has its content in bodies column
+	greylock::error_info stored_external_body(const std::string &dkey, bool *external) {
+		*external = false;
+
+		std::string data;
+		auto err = m_db_docs.read(options::documents_column, dkey, &data);
+		if (err) {
+			if (err.code() == -rocksdb::Status::kNotFound)
+				return greylock::error_info();
+
+			return err;
+		}
+
+		document doc;
+		try {
+			doc.unpack(unpack_object(data.data(), data.size()).get(), document::projection_meta);
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EINVAL, "could not unpack document %s, size: %ld, error: %s",
+					dkey.c_str(), data.size(), e.what());
+		}
+
+		*external = (doc.flags & document::flag_external_body) != 0;
+		return greylock::error_info();
+	}
+
+	// indexed ID is derived from document ID and timestamp, document replaced with unchanged timestamp
+	// is inserted under the same ID, such IDs must not be registered as deleted
+	void drop_reinserted_ids() {
+		m_deleted_ids.erase(std::remove_if(m_deleted_ids.begin(), m_deleted_ids.end(),
+				[&] (const id_t &indexed_id) {
+					return m_docs.count(indexed_id.to_string()) != 0;
+				}), m_deleted_ids.end());
+	}
+
+	// removes postings of the document inserted into this batch, returns false if there is no such document
+	bool drop_postings(const std::string &dkey, const id_t &indexed_id) {
+		auto fit = m_forward.find(dkey);
+		if (fit == m_forward.end())
+			return false;
+
+		for (const auto &key: fit->second) {
+			auto &ids = m_indexes[key].ids;
+			ids.erase(std::remove_if(ids.begin(), ids.end(),
+					[&] (const document_for_index &d) {
+						return d.indexed_id == indexed_id;
+					}), ids.end());
+		}
+
+		m_forward.erase(fit);
+		return true;
+	}
+
+	database &m_db_docs;
+	database &m_db_indexes;
+
+	// document key -> serialized document
+	std::map<std::string, std::string> m_docs;
+	// document key -> content of the document with external body
+	std::map<std::string, std::string> m_bodies;
+	// document id -> serialized indexed id
+	std::map<std::string, std::string> m_doc_ids;
+	// document key -> token keys
+	std::map<std::string, std::vector<std::string>> m_forward;
+
+	// token key -> posting list operand
+	std::map<std::string, disk_index> m_indexes;
+	// token shard key -> shard number -> number of documents
+	std::map<std::string, std::map<size_t, size_t>> m_shards;
+
+	// keys of removed documents and their forward index entries
+	std::set<std::string> m_deleted_docs;
+	// keys of removed stored documents which have external body
+	std::set<std::string> m_stored_bodies;
+	// ids of removed documents
+	std::set<std::string> m_deleted_doc_ids;
+	// removed documents which do not have forward index entry
+	std::vector<id_t> m_deleted_ids;
+	// token key -> removed document IDs
+	std::map<std::string, disk_tombstone> m_removed;
+	// ids of removed documents whose stored versions have not been looked up yet
+	std::set<std::string> m_unresolved;
+
+	size_t m_documents = 0;
+	size_t m_removed_documents = 0;
+	size_t m_missing_documents = 0;
+	size_t m_tokens = 0;
+	size_t m_docs_size = 0;
+};
+
+}} // namespace ioremap::greylock
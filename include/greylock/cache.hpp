@@ -0,0 +1,169 @@
+#pragma once
+
+#include "greylock/database.hpp"
+#include "greylock/error.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Read-through cache on top of the database, it implements the same interface as @database
+// and can be used as @DBT parameter of @intersector and @index_iterator.
+//
+// It is supposed to live for the duration of a single (batch) request, so that multiple queries
+// executed concurrently share token shard lookups, decoded posting lists and documents.
+// Cache is never invalidated, entries written after cache has been created may not be visible.
+// Cache size is limited by @max_size bytes (0 means no limit), when it is full, entries are read
+// from the database without being cached.
+template <typename DBT>
+class read_cache {
+public:
+	read_cache(DBT &db, size_t max_size = 0) : m_db(db), m_max_size(max_size) {}
+
+	// approximate memory used by cached entries
+	size_t size() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_size;
+	}
+
+	const greylock::options &options() const {
+		return m_db.options();
+	}
+
+	disk_token get_disk_token(const std::string &key) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_tokens.find(key);
+			if (it != m_tokens.end())
+				return it->second;
+		}
+
+		disk_token dt = m_db.get_disk_token(key);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (reserve(key.size() + (dt.shards.size() + dt.counts.size()) * sizeof(size_t))) {
+			m_tokens.insert(std::make_pair(key, dt));
+		}
+		return dt;
+	}
+
+	std::vector<size_t> get_shards(const std::string &key) {
+		return get_disk_token(key).shards;
+	}
+
+	// reads all given token shard keys into cache
+	void prefetch_shards(const std::vector<std::string> &keys) {
+		for (const auto &key: keys) {
+			get_disk_token(key);
+		}
+	}
+
+	std::vector<std::string> list_keys(int column, const std::string &prefix, size_t limit) {
+		return m_db.list_keys(column, prefix, limit);
+	}
+
+	std::shared_ptr<const std::set<id_t>> deleted_ids() const {
+		return m_db.deleted_ids();
+	}
+
+	greylock::error_info read(int column, const std::string &key, std::string *ret) {
+		auto ckey = std::make_pair(column, key);
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_data.find(ckey);
+			if (it != m_data.end()) {
+				*ret = it->second;
+				return greylock::error_info();
+			}
+		}
+
+		auto err = m_db.read(column, key, ret);
+		if (err)
+			return err;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (reserve(key.size() + ret->size())) {
+			m_data.insert(std::make_pair(ckey, *ret));
+		}
+		return greylock::error_info();
+	}
+
+	greylock::error_info read_index(const std::string &key, std::shared_ptr<const disk_index> *ret) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_indexes.find(key);
+			if (it != m_indexes.end()) {
+				*ret = it->second;
+				return greylock::error_info();
+			}
+		}
+
+		auto err = m_db.read_index(key, ret);
+		if (err)
+			return err;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!reserve(key.size() + (*ret)->ids.size() * sizeof(document_for_index)))
+			return greylock::error_info();
+
+		auto it = m_indexes.insert(std::make_pair(key, *ret));
+		// another thread could have read the same posting list, use the one stored in cache
+		*ret = it.first->second;
+		return greylock::error_info();
+	}
+
+	greylock::error_info read_postings(const std::string &key, posting_list *ret) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_postings.find(key);
+			if (it != m_postings.end()) {
+				*ret = it->second;
+				return greylock::error_info();
+			}
+		}
+
+		auto err = m_db.read_postings(key, ret);
+		if (err)
+			return err;
+
+		// postings which are not decoded point into mapped segment and do not use memory
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!reserve(key.size() + (ret->decoded ? ret->size * sizeof(document_for_index) : 0)))
+			return greylock::error_info();
+
+		auto it = m_postings.insert(std::make_pair(key, *ret));
+		*ret = it.first->second;
+		return greylock::error_info();
+	}
+
+private:
+	// map node and key overhead accounted to every entry
+	static const size_t entry_overhead = 64;
+
+	DBT &m_db;
+	size_t m_max_size;
+
+	mutable std::mutex m_lock;
+	size_t m_size = 0;
+	std::map<std::string, disk_token> m_tokens;
+	std::map<std::string, std::shared_ptr<const disk_index>> m_indexes;
+	std::map<std::string, posting_list> m_postings;
+	std::map<std::pair<int, std::string>, std::string> m_data;
+
+	// must be called under @m_lock, returns false if entry of @size bytes does not fit into cache
+	bool reserve(size_t size) {
+		size += entry_overhead;
+		if (m_max_size && m_size + size > m_max_size)
+			return false;
+
+		m_size += size;
+		return true;
+	}
+};
+
+}} // namespace ioremap::greylock
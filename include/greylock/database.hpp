@@ -9,21 +9,34 @@
 #pragma GCC diagnostic push 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #include <rocksdb/cache.h>
+#include <rocksdb/compaction_filter.h>
+#include <rocksdb/convenience.h>
 #include <rocksdb/db.h>
 #include <rocksdb/filter_policy.h>
 #include <rocksdb/merge_operator.h>
 #include <rocksdb/options.h>
+#include <rocksdb/rate_limiter.h>
 #include <rocksdb/slice.h>
+#include <rocksdb/sst_file_writer.h>
 #include <rocksdb/status.h>
 #include <rocksdb/statistics.h>
 #include <rocksdb/table.h>
 #include <rocksdb/utilities/transaction_db.h>
+#include <rocksdb/version.h>
 #pragma GCC diagnostic pop
 
 #include <msgpack.hpp>
 
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <set>
 #include <vector>
@@ -48,6 +61,33 @@ struct options {
 	// but heavily increases index size.
 	unsigned int ngram_index_size = 0;
 
+	// drop documents which are not referenced by document ID mapping (replaced or deleted) during compaction,
+	// every document checked by compaction costs one lookup in document_ids column,
+	// bodies whose documents have been dropped are removed by compaction of bodies column the same way
+	bool filter_orphan_documents = true;
+
+	// Size of zstd dictionary used to compress documents column, 0 disables dictionary compression.
+	// Dictionary is trained over data blocks sampled from every SST file written by flush or compaction,
+	// thus it is rebuilt whenever documents are compacted.
+	uint32_t documents_dict_size = 16 * 1024;
+	// maximum size of the samples used to train documents dictionary
+	uint32_t documents_dict_train_size = 100 * 16 * 1024;
+
+	// Document content of at least this size is stored in bodies column, 0 keeps all content inline.
+	// Metadata reads and compactions of documents column do not touch such bodies.
+	size_t external_body_size = 4096;
+	// bodies of at least this size are stored in blob files outside of LSM tree (when rocksdb supports it)
+	uint64_t body_blob_size = 4096;
+
+	// Limit of flush and compaction writes in bytes per second, 0 means no limit.
+	// Limiter is always installed (with practically unlimited rate by default),
+	// thus the limit can be changed at runtime with @database::set_compaction_rate().
+	int64_t compaction_rate_limit = 0;
+	// rate used by limiter when @compaction_rate_limit is 0
+	enum : int64_t { unlimited_compaction_rate = 1024LL * 1024 * 1024 * 1024 };
+	// number of threads a single compaction is split into
+	uint32_t max_subcompactions = 4;
+
 	enum {
 		default_column = 0,
 		documents_column,
@@ -55,13 +95,31 @@ struct options {
 		token_shards_column,
 		indexes_column,
 		meta_column,
+		forward_column,
+		bodies_column,
 		__column_size,
 	};
 
 	std::vector<std::string> column_names;
 	std::string metadata_key;
 
-	options(): metadata_key("greylock.meta.key") {
+	// prefix of the keys in meta column which hold IDs of deleted documents
+	// whose postings have to be removed by compaction
+	std::string deleted_prefix;
+
+	// key in meta column which holds the oldest shard number which has not been expired
+	std::string expired_shard_key;
+
+	// prefix of the keys in meta column which hold posting list keys of frozen shards updated after
+	// the shard has been frozen, segment copies of these posting lists are stale
+	std::string frozen_updated_prefix;
+
+	options():
+		metadata_key("greylock.meta.key"),
+		deleted_prefix("greylock.deleted."),
+		expired_shard_key("greylock.expired.shard"),
+		frozen_updated_prefix("greylock.frozen_updated.")
+	{
 		column_names.resize(__column_size);
 		column_names[default_column] = rocksdb::kDefaultColumnFamilyName;
 		column_names[documents_column] = "documents";
@@ -69,6 +127,8 @@ struct options {
 		column_names[token_shards_column] = "token_shards";
 		column_names[indexes_column] = "indexes";
 		column_names[meta_column] = "meta";
+		column_names[forward_column] = "forward";
+		column_names[bodies_column] = "bodies";
 	}
 
 	std::string column_name(int cnum) const {
@@ -158,8 +218,33 @@ struct document_for_index {
 	}
 };
 
+// Decodes array of document IDs, which is the largest part of every posting list.
+// Document is packed as [[timestamp]], this layout is read directly without per-element conversion dispatch,
+// anything else goes through generic conversion.
+inline void unpack_document_ids(const msgpack::object &o, std::vector<document_for_index> *ids) {
+	if (o.type != msgpack::type::ARRAY) {
+		throw msgpack::type_error();
+	}
+
+	ids->resize(o.via.array.size);
+	for (size_t i = 0; i < o.via.array.size; ++i) {
+		const msgpack::object &d = o.via.array.ptr[i];
+		if (d.type == msgpack::type::ARRAY && d.via.array.size == 1) {
+			const msgpack::object &id = d.via.array.ptr[0];
+			if (id.type == msgpack::type::ARRAY && id.via.array.size == 1 &&
+					id.via.array.ptr[0].type == msgpack::type::POSITIVE_INTEGER) {
+				(*ids)[i].indexed_id.timestamp = id.via.array.ptr[0].via.u64;
+				continue;
+			}
+		}
+
+		d.convert(&(*ids)[i]);
+	}
+}
+
 namespace {
 	static const uint32_t disk_cookie = 0x45589560;
+	static const uint32_t disk_tombstone_cookie = 0x45589561;
 }
 
 struct disk_index {
@@ -169,6 +254,9 @@ struct disk_index {
 
 	std::vector<document_for_index> ids;
 
+	// size of the serialized posting list, it is set when list has been read from the database and is not packed
+	size_t encoded_size = 0;
+
 	template <typename Stream>
 	void msgpack_pack(msgpack::packer<Stream> &o) const {
 		o.pack_array(2);
@@ -196,17 +284,128 @@ struct disk_index {
 			throw std::runtime_error(ss.str());
 		}
 
-		p[1].convert(&ids);
+		unpack_document_ids(p[1], &ids);
+	}
+};
+
+// Sorted document IDs of one posting list shard.
+// IDs either belong to decoded @disk_index or point into mapped segment file (see segment.hpp),
+// @owner keeps that memory alive for as long as the list is referenced.
+struct posting_list {
+	std::shared_ptr<const void> owner;
+	const document_for_index *ids = NULL;
+	size_t size = 0;
+
+	// size of the posting list on disk
+	size_t encoded_size = 0;
+	// false if IDs are used directly from the mapped segment
+	bool decoded = false;
+
+	posting_list() {}
+	posting_list(const std::shared_ptr<const disk_index> &idx) :
+		owner(idx), ids(idx->ids.data()), size(idx->ids.size()), encoded_size(idx->encoded_size), decoded(true) {}
+
+	const document_for_index *begin() const {
+		return ids;
+	}
+	const document_for_index *end() const {
+		return ids + size;
+	}
+	bool empty() const {
+		return size == 0;
+	}
+};
+
+// merge operand which removes document IDs from posting list
+struct disk_tombstone {
+	std::vector<document_for_index> ids;
+
+	template <typename Stream>
+	void msgpack_pack(msgpack::packer<Stream> &o) const {
+		o.pack_array(2);
+		o.pack(disk_tombstone_cookie);
+		o.pack(ids);
 	}
 };
 
 struct disk_token {
 	std::vector<size_t> shards;
-	MSGPACK_DEFINE(shards);
+
+	// counter of the shard which contains documents indexed by older versions, which did not count documents
+	enum : uint64_t {
+		unknown_count = ~0ULL,
+	};
+
+	// number of documents indexed in the appropriate shard, it is an estimation,
+	// since the same document can be indexed multiple times.
+	// Shards written by older versions have @unknown_count counter, it stays unknown after merge.
+	std::vector<size_t> counts;
 
 	disk_token() {}
-	disk_token(const std::set<size_t> &s): shards(s.begin(), s.end()) {}
-	disk_token(const std::vector<size_t> &s): shards(s) {}
+	// every shard in the set corresponds to one indexed document
+	disk_token(const std::set<size_t> &s): shards(s.begin(), s.end()), counts(s.size(), 1) {}
+	disk_token(const std::vector<size_t> &s): shards(s), counts(s.size(), unknown_count) {}
+
+	bool known(size_t i) const {
+		return counts[i] != unknown_count;
+	}
+
+	// removes shards older than @shard, returns true if anything has been removed
+	bool erase_before(size_t shard) {
+		size_t pos = 0;
+
+		for (size_t i = 0; i < shards.size(); ++i) {
+			if (shards[i] < shard)
+				continue;
+
+			shards[pos] = shards[i];
+			counts[pos] = counts[i];
+			pos++;
+		}
+
+		if (pos == shards.size())
+			return false;
+
+		shards.resize(pos);
+		counts.resize(pos);
+		return true;
+	}
+
+	template <typename Stream>
+	void msgpack_pack(msgpack::packer<Stream> &o) const {
+		o.pack_array(2);
+		o.pack(shards);
+		o.pack(counts);
+	}
+
+	void msgpack_unpack(msgpack::object o) {
+		if (o.type != msgpack::type::ARRAY) {
+			std::ostringstream ss;
+			ss << "could not unpack disk token, object type is " << o.type <<
+				", must be array (" << msgpack::type::ARRAY << ")";
+			throw std::runtime_error(ss.str());
+		}
+
+		msgpack::object *p = o.via.array.ptr;
+		switch (o.via.array.size) {
+		case 1:
+			p[0].convert(&shards);
+			counts.assign(shards.size(), unknown_count);
+			break;
+		case 2:
+			p[0].convert(&shards);
+			p[1].convert(&counts);
+			if (counts.size() != shards.size()) {
+				counts.assign(shards.size(), unknown_count);
+			}
+			break;
+		default: {
+			std::ostringstream ss;
+			ss << "could not unpack disk token, invalid array size: " << o.via.array.size;
+			throw std::runtime_error(ss.str());
+		}
+		}
+	}
 };
 
 class indexes_merge_operator : public rocksdb::MergeOperator {
@@ -237,20 +436,32 @@ public:
 			ocount = unique_index.size();
 		}
 
+		// operands are applied in order, tombstone removes IDs added by previous operands
 		for (const auto& value : operand_list) {
-			msgpack::unpacked msg;
-			msgpack::unpack(&msg, value.data(), value.size());
-
 			try {
-				msgpack::object o = msg.get();
+				unpacked_object uo = unpack_object(value.data(), value.size());
+				const msgpack::object &o = uo.get();
 
-				if (o.type != msgpack::type::ARRAY) {
+				// single document operand
+				if (o.type != msgpack::type::ARRAY || o.via.array.size == 1) {
 					document_for_index did;
 					o.convert(&did);
 					unique_index.emplace(did);
 					continue;
 				}
 
+				uint32_t cookie;
+				o.via.array.ptr[0].convert(&cookie);
+				if (cookie == disk_tombstone_cookie) {
+					std::vector<document_for_index> ids;
+					unpack_document_ids(o.via.array.ptr[1], &ids);
+
+					for (const auto &did: ids) {
+						unique_index.erase(did);
+					}
+					continue;
+				}
+
 				disk_index idx;
 				o.convert(&idx);
 
@@ -264,7 +475,7 @@ public:
 
 		index.ids.clear();
 		index.ids.insert(index.ids.end(), unique_index.begin(), unique_index.end());
-		*new_value = serialize(index);
+		serialize(index, new_value);
 
 		if (new_value->size() > 1024 * 1024) {
 			size_t osize = 0;
@@ -324,9 +535,26 @@ public:
 			rocksdb::Logger *logger) const {
 
 		disk_token dt;
-		std::set<size_t> shards;
+		// shard number -> number of documents in given shard
+		std::map<size_t, size_t> shards;
 		greylock::error_info err;
 
+		// shard which has unknown counter in any operand stays unknown
+		auto insert_shards = [&] (const disk_token &t) {
+			for (size_t i = 0; i < t.shards.size(); ++i) {
+				auto res = shards.emplace(t.shards[i], t.counts[i]);
+				if (res.second)
+					continue;
+
+				size_t &count = res.first->second;
+				if (count == disk_token::unknown_count || !t.known(i)) {
+					count = disk_token::unknown_count;
+				} else {
+					count += t.counts[i];
+				}
+			}
+		};
+
 		if (old_value) {
 			err = deserialize(dt, old_value->data(), old_value->size());
 			if (err) {
@@ -335,7 +563,7 @@ public:
 				return false;
 			}
 
-			shards.insert(dt.shards.begin(), dt.shards.end());
+			insert_shards(dt);
 		}
 
 		for (const auto& value : operand_list) {
@@ -347,11 +575,18 @@ public:
 				return false;
 			}
 
-			shards.insert(s.shards.begin(), s.shards.end());
+			insert_shards(s);
 		}
 
-		dt.shards = std::vector<size_t>(shards.begin(), shards.end());
-		*new_value = serialize(dt);
+		dt.shards.clear();
+		dt.counts.clear();
+		dt.shards.reserve(shards.size());
+		dt.counts.reserve(shards.size());
+		for (const auto &p: shards) {
+			dt.shards.push_back(p.first);
+			dt.counts.push_back(p.second);
+		}
+		serialize(dt, new_value);
 
 		if (new_value->size() > 1024 * 1024) {
 			size_t osize = 0;
@@ -401,6 +636,131 @@ public:
 	}
 };
 
+// Merges values of the same @key read from several databases or sorted runs, values are ordered from the oldest one.
+// Posting lists and token shard lists are merged, for other columns the latest value wins.
+inline greylock::error_info merge_column_values(int column, const std::string &key, const std::deque<std::string> &values,
+		std::string *ret) {
+	bool ok = true;
+
+	switch (column) {
+	case greylock::options::indexes_column:
+		ok = indexes_merge_operator().merge_indexes(rocksdb::Slice(key), NULL, values, ret, NULL);
+		break;
+	case greylock::options::token_shards_column:
+		ok = token_shards_merge_operator().merge_token_shards(rocksdb::Slice(key), NULL, values, ret, NULL);
+		break;
+	default:
+		*ret = values.back();
+		break;
+	}
+
+	if (!ok) {
+		return greylock::create_error(-EINVAL, "could not merge key %s, values: %ld", key.c_str(), values.size());
+	}
+
+	return greylock::error_info();
+}
+
+class database;
+
+// Removes IDs of deleted documents (see @database::insert_deleted()) from posting lists,
+// posting list is kept even if it becomes empty, since token shard list still references it.
+class indexes_compaction_filter : public rocksdb::CompactionFilter {
+public:
+	indexes_compaction_filter(database *db) : m_db(db) {}
+
+	virtual const char *Name() const override {
+		return "indexes_compaction_filter";
+	}
+
+	virtual bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+			std::string *new_value, bool *value_changed) const override;
+
+private:
+	database *m_db;
+};
+
+// Removes expired shards (see @database::expire_shards()) from token shard lists,
+// token shard key is dropped when all its shards have been expired.
+class token_shards_compaction_filter : public rocksdb::CompactionFilter {
+public:
+	token_shards_compaction_filter(database *db) : m_db(db) {}
+
+	virtual const char *Name() const override {
+		return "token_shards_compaction_filter";
+	}
+
+	virtual bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+			std::string *new_value, bool *value_changed) const override;
+
+private:
+	database *m_db;
+};
+
+// Drops document ID mappings which point to expired documents.
+class document_ids_compaction_filter : public rocksdb::CompactionFilter {
+public:
+	document_ids_compaction_filter(database *db) : m_db(db) {}
+
+	virtual const char *Name() const override {
+		return "document_ids_compaction_filter";
+	}
+
+	virtual bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+			std::string *new_value, bool *value_changed) const override;
+
+private:
+	database *m_db;
+};
+
+// Drops documents which are not referenced by document ID mapping anymore,
+// i.e. documents which have been replaced by newer version with different indexed ID.
+class documents_compaction_filter : public rocksdb::CompactionFilter {
+public:
+	documents_compaction_filter(database *db) : m_db(db) {}
+
+	virtual const char *Name() const override {
+		return "documents_compaction_filter";
+	}
+
+	virtual bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+			std::string *new_value, bool *value_changed) const override;
+
+private:
+	database *m_db;
+};
+
+// drops bodies whose documents do not exist anymore
+class bodies_compaction_filter : public rocksdb::CompactionFilter {
+public:
+	bodies_compaction_filter(database *db) : m_db(db) {}
+
+	virtual const char *Name() const override {
+		return "bodies_compaction_filter";
+	}
+
+	virtual bool Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+			std::string *new_value, bool *value_changed) const override;
+
+private:
+	database *m_db;
+};
+
+// iterator over column which does not exist in database opened in read-only mode
+class empty_iterator : public rocksdb::Iterator {
+public:
+	bool Valid() const override { return false; }
+	void SeekToFirst() override {}
+	void SeekToLast() override {}
+	void Seek(const rocksdb::Slice &) override {}
+	void SeekForPrev(const rocksdb::Slice &) override {}
+	void Next() override {}
+	void Prev() override {}
+	rocksdb::Slice key() const override { return rocksdb::Slice(); }
+	rocksdb::Slice value() const override { return rocksdb::Slice(); }
+	rocksdb::Status status() const override { return rocksdb::Status(); }
+};
+
 class database {
 public:
 	~database() {
@@ -413,6 +773,16 @@ public:
 	const greylock::options &options() const {
 		return m_opts;
 	}
+
+	// options can only be changed before database has been opened
+	greylock::error_info set_options(const greylock::options &opts) {
+		if (m_db) {
+			return greylock::create_error(-EINVAL, "database is already opened");
+		}
+
+		m_opts = opts;
+		return greylock::error_info();
+	}
 	greylock::metadata &metadata() {
 		return m_meta;
 	}
@@ -421,19 +791,51 @@ public:
 		return m_handles[c];
 	}
 
-	void compact() {
-		if (m_db) {
-			for (auto h: m_handles) {
-				struct rocksdb::CompactRangeOptions opts;
-				opts.change_level = true;
-				opts.target_level = 0;
-				m_db->CompactRange(opts, h, NULL, NULL);
+	std::shared_ptr<rocksdb::Statistics> statistics() const {
+		return m_dbo.statistics;
+	}
+
+	// returns false if database is not opened or property is not supported
+	bool int_property(int column, const std::string &name, uint64_t *value) {
+		if (!m_db || column >= (int)m_handles.size() || !m_handles[column])
+			return false;
+
+		return m_db->GetIntProperty(m_handles[column], name, value);
+	}
+
+	// fully compacts all columns, registry of deleted IDs is cleared only if every column has been compacted
+	greylock::error_info compact() {
+		if (!m_db) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+
+		// full compaction runs compaction filter over all posting lists,
+		// IDs deleted before it has started are not needed anymore
+		auto deleted = deleted_ids();
+
+		for (size_t i = 0; i < m_handles.size(); ++i) {
+			if (!m_handles[i])
+				continue;
+
+			struct rocksdb::CompactRangeOptions opts;
+			opts.change_level = true;
+			opts.target_level = 0;
+			auto s = m_db->CompactRange(opts, m_handles[i], NULL, NULL);
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "could not compact column %s: %s",
+						m_opts.column_name(i).c_str(), s.ToString().c_str());
 			}
 		}
+
+		if (!m_ro && !deleted->empty()) {
+			return clear_deleted(*deleted);
+		}
+
+		return greylock::error_info();
 	}
 
 	void compact(size_t c, const rocksdb::Slice &start, const rocksdb::Slice &end) {
-		if (m_db && c < m_handles.size()) {
+		if (m_db && c < m_handles.size() && m_handles[c]) {
 			const rocksdb::Slice *b = NULL;
 			const rocksdb::Slice *e = NULL;
 
@@ -525,6 +927,11 @@ public:
 			dbo.PrepareForBulkLoad();
 		}
 
+		dbo.max_subcompactions = m_opts.max_subcompactions;
+		m_rate_limiter.reset(rocksdb::NewGenericRateLimiter(m_opts.compaction_rate_limit > 0 ?
+					m_opts.compaction_rate_limit : options::unlimited_compaction_rate));
+		dbo.rate_limiter = m_rate_limiter;
+
 		dbo.statistics = rocksdb::CreateDBStatistics();
 		dbo.stats_dump_period_sec = 60;
 
@@ -552,11 +959,68 @@ public:
 				cfo.merge_operator.reset(new indexes_merge_operator);
 			}
 
+			// documents are small msgpack blobs which share author, content and markup boilerplate,
+			// they compress much better with dictionary trained over other documents
+			cfo.compression_opts = dbo.compression_opts;
+			if (i == greylock::options::documents_column && m_opts.documents_dict_size > 0) {
+				cfo.compression_opts.max_dict_bytes = m_opts.documents_dict_size;
+				cfo.compression_opts.zstd_max_train_bytes = m_opts.documents_dict_train_size;
+			}
+
+#if ROCKSDB_MAJOR > 6 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 18)
+			// large bodies are written into blob files once, compactions only rewrite small references
+			cfo.enable_blob_files = (i == greylock::options::bodies_column);
+			cfo.min_blob_size = m_opts.body_blob_size;
+			cfo.enable_blob_garbage_collection = (i == greylock::options::bodies_column);
+#endif
+
+			cfo.compaction_filter = NULL;
+			if (i == greylock::options::indexes_column) {
+				cfo.compaction_filter = &m_indexes_filter;
+			}
+			if (i == greylock::options::documents_column && m_opts.filter_orphan_documents) {
+				cfo.compaction_filter = &m_documents_filter;
+			}
+			if (i == greylock::options::bodies_column && m_opts.filter_orphan_documents) {
+				cfo.compaction_filter = &m_bodies_filter;
+			}
+			if (i == greylock::options::token_shards_column) {
+				cfo.compaction_filter = &m_token_shards_filter;
+			}
+			if (i == greylock::options::document_ids_column) {
+				cfo.compaction_filter = &m_document_ids_filter;
+			}
+
 			column_families.push_back(rocksdb::ColumnFamilyDescriptor(cname, cfo));
 		}
 
 		if (ro) {
-			s = rocksdb::DB::OpenForReadOnly(dbo, path, column_families, &m_handles, &db);
+			// databases created before some columns have been added do not have them,
+			// read-only open can not create column, missing columns are treated as empty
+			std::vector<std::string> existing;
+			s = rocksdb::DB::ListColumnFamilies(dbo, path, &existing);
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "failed to list column families of rocksdb database: '%s', error: %s",
+						path.c_str(), s.ToString().c_str());
+			}
+
+			std::vector<rocksdb::ColumnFamilyDescriptor> present;
+			std::vector<size_t> columns;
+			for (size_t i = 0; i < column_families.size(); ++i) {
+				if (std::find(existing.begin(), existing.end(), column_families[i].name) != existing.end()) {
+					present.push_back(column_families[i]);
+					columns.push_back(i);
+				}
+			}
+
+			std::vector<rocksdb::ColumnFamilyHandle*> handles;
+			s = rocksdb::DB::OpenForReadOnly(dbo, path, present, &handles, &db);
+			if (s.ok()) {
+				m_handles.assign(column_families.size(), NULL);
+				for (size_t i = 0; i < columns.size(); ++i) {
+					m_handles[columns[i]] = handles[i];
+				}
+			}
 		} else {
 			s = rocksdb::DB::Open(dbo, path, column_families, &m_handles, &db);
 		}
@@ -566,21 +1030,33 @@ public:
 		}
 		m_db.reset(db);
 		m_ro = ro;
+		m_dbo = dbo;
 
 		std::string meta;
-		s = m_db->Get(rocksdb::ReadOptions(), m_handles[options::meta_column], rocksdb::Slice(m_opts.metadata_key), &meta);
-		if (!s.ok() && !s.IsNotFound()) {
-			return greylock::create_error(-s.code(), "could not read key: %s, error: %s",
-					m_opts.metadata_key.c_str(), s.ToString().c_str());
+		auto err = read(options::meta_column, m_opts.metadata_key, &meta);
+		if (err && err.code() != -rocksdb::Status::kNotFound) {
+			return err;
 		}
 
-		if (s.ok()) {
+		if (!err) {
 			auto err = deserialize(m_meta, meta.data(), meta.size());
 			if (err)
 				return greylock::create_error(err.code(), "metadata deserialization failed, key: %s, error: %s",
 					m_opts.metadata_key.c_str(), err.message().c_str());
 		}
 
+		err = load_deleted();
+		if (err)
+			return err;
+
+		err = load_frozen_updated();
+		if (err)
+			return err;
+
+		err = load_expired_shard();
+		if (err)
+			return err;
+
 		if (m_opts.sync_metadata_timeout > 0 && !ro) {
 			sync_metadata_callback();
 		}
@@ -589,24 +1065,55 @@ public:
 	}
 
 	std::vector<size_t> get_shards(const std::string &key) {
+		return get_disk_token(key).shards;
+	}
+
+	// returns shards and per-shard document counters for given token shard key
+	disk_token get_disk_token(const std::string &key) {
 		disk_token dt;
 		if (!m_db) {
-			return dt.shards;
+			return dt;
 		}
 
 		std::string ser_shards;
 		auto err = read(options::token_shards_column, key, &ser_shards);
 		if (err)
-			return dt.shards;
+			return dt;
 
 		err = deserialize(dt, ser_shards.data(), ser_shards.size());
 		if (err)
-			return dt.shards;
+			return disk_token();
 
-		return dt.shards;
+		// expired shards are removed from the stored lists lazily by compaction
+		dt.erase_before(expired_shard());
+		return dt;
+	}
+
+	// returns at most @limit keys from @column which start with @prefix
+	std::vector<std::string> list_keys(int column, const std::string &prefix, size_t limit) {
+		std::vector<std::string> keys;
+		if (!m_db || !m_handles[column]) {
+			return keys;
+		}
+
+		rocksdb::ReadOptions ro;
+		ro.fill_cache = false;
+
+		std::unique_ptr<rocksdb::Iterator> it(m_db->NewIterator(ro, m_handles[column]));
+		for (it->Seek(rocksdb::Slice(prefix)); it->Valid() && keys.size() < limit; it->Next()) {
+			if (!it->key().starts_with(rocksdb::Slice(prefix)))
+				break;
+
+			keys.emplace_back(it->key().ToString());
+		}
+
+		return keys;
 	}
 
 	rocksdb::Iterator *iterator(int column, const rocksdb::ReadOptions &ro) {
+		if (!m_handles[column])
+			return new empty_iterator;
+
 		return m_db->NewIterator(ro, m_handles[column]);
 	}
 
@@ -615,6 +1122,11 @@ public:
 			return greylock::create_error(-EINVAL, "database is not opened");
 		}
 
+		if (!m_handles[column]) {
+			return greylock::create_error(-rocksdb::Status::kNotFound, "could not read key: %s, column %s does not exist",
+					key.c_str(), m_opts.column_name(column).c_str());
+		}
+
 		auto s = m_db->Get(rocksdb::ReadOptions(), m_handles[column], rocksdb::Slice(key), ret);
 		if (!s.ok()) {
 			return greylock::create_error(-s.code(), "could not read key: %s, error: %s", key.c_str(), s.ToString().c_str());
@@ -622,7 +1134,39 @@ public:
 		return greylock::error_info();
 	}
 
+	// reads and decodes posting list stored in indexes column
+	greylock::error_info read_index(const std::string &key, std::shared_ptr<const disk_index> *ret) {
+		std::string data;
+		auto err = read(options::indexes_column, key, &data);
+		if (err)
+			return err;
+
+		std::shared_ptr<disk_index> idx = std::make_shared<disk_index>();
+		err = deserialize(*idx, data.data(), data.size());
+		if (err)
+			return err;
+
+		idx->encoded_size = data.size();
+		*ret = idx;
+		return greylock::error_info();
+	}
+
+	greylock::error_info read_postings(const std::string &key, posting_list *ret) {
+		std::shared_ptr<const disk_index> idx;
+		auto err = read_index(key, &idx);
+		if (err)
+			return err;
+
+		*ret = posting_list(idx);
+		return greylock::error_info();
+	}
+
 	greylock::error_info write(rocksdb::WriteBatch *batch) {
+		return write(batch, false);
+	}
+
+	// when @sync is set, write returns only after write-ahead log has been synced to disk
+	greylock::error_info write(rocksdb::WriteBatch *batch, bool sync) {
 		if (!m_db) {
 			return greylock::create_error(-EINVAL, "database is not opened");
 		}
@@ -632,6 +1176,7 @@ public:
 		}
 
 		auto wo = rocksdb::WriteOptions();
+		wo.sync = sync;
 
 		auto s = m_db->Write(wo, batch);
 		if (!s.ok()) {
@@ -660,8 +1205,338 @@ public:
 		return greylock::error_info();
 	}
 
+	// returns IDs of deleted documents whose postings have not yet been removed by full compaction
+	std::shared_ptr<const std::set<id_t>> deleted_ids() const {
+		return std::atomic_load(&m_deleted);
+	}
+
+	static std::string deleted_key(const greylock::options &options, const id_t &indexed_id) {
+		return options.deleted_prefix + indexed_id.to_string();
+	}
+
+	// registers IDs of deleted documents in memory, appropriate keys (see @deleted_key())
+	// must have been already written into meta column
+	void insert_deleted(const std::vector<id_t> &ids) {
+		if (ids.empty())
+			return;
+
+		std::lock_guard<std::mutex> guard(m_deleted_lock);
+		std::shared_ptr<std::set<id_t>> deleted = std::make_shared<std::set<id_t>>(*m_deleted);
+		deleted->insert(ids.begin(), ids.end());
+		std::atomic_store(&m_deleted, std::shared_ptr<const std::set<id_t>>(deleted));
+	}
+
+	// unregisters IDs of documents which have been inserted again, appropriate keys must be deleted from meta column
+	void erase_deleted(const std::set<id_t> &ids) {
+		if (ids.empty())
+			return;
+
+		std::lock_guard<std::mutex> guard(m_deleted_lock);
+		std::shared_ptr<std::set<id_t>> deleted = std::make_shared<std::set<id_t>>();
+		std::set_difference(m_deleted->begin(), m_deleted->end(), ids.begin(), ids.end(),
+				std::inserter(*deleted, deleted->end()));
+		std::atomic_store(&m_deleted, std::shared_ptr<const std::set<id_t>>(deleted));
+	}
+
+	// shards older than the current one are frozen, they can be written into segments
+	size_t current_shard() const {
+		return time(NULL) / m_opts.tokens_shard_size;
+	}
+
+	static std::string frozen_updated_key(const greylock::options &options, const std::string &key) {
+		return options.frozen_updated_prefix + key;
+	}
+
+	// returns true if posting list @key of frozen shard has been updated after the shard has been frozen
+	bool frozen_updated(const std::string &key) {
+		std::lock_guard<std::mutex> guard(m_frozen_updated_lock);
+		return m_frozen_updated.find(key) != m_frozen_updated.end();
+	}
+
+	// registers updated posting lists of frozen shards in memory, appropriate keys (see @frozen_updated_key())
+	// must be written into meta column together with the update
+	void insert_frozen_updated(const std::vector<std::string> &keys) {
+		if (keys.empty())
+			return;
+
+		std::lock_guard<std::mutex> guard(m_frozen_updated_lock);
+		m_frozen_updated.insert(keys.begin(), keys.end());
+	}
+
+	// returns the oldest shard number which has not been expired
+	size_t expired_shard() const {
+		return m_expired_shard;
+	}
+
+	// returns the smallest indexed ID whose document belongs to shard @shard or newer one
+	id_t shard_start_id(size_t shard) const {
+		id_t id;
+		id.set_timestamp(shard * m_opts.tokens_shard_size, 0);
+		return id;
+	}
+
+	// Drops all documents, posting lists and forward index entries which belong to shards older than @shard.
+	//
+	// Whole SST files which fall into expired key range are deleted first, the rest of the range
+	// is covered by range deletion, thus expiration does not rewrite the data.
+	// Expired shard number is stored before range deletion, token shard lists, which can not be
+	// range-deleted since they are keyed by token, are filtered on read and pruned by compaction.
+	greylock::error_info expire_shards(size_t shard) {
+		if (!m_db) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+
+		if (m_ro) {
+			return greylock::create_error(-EROFS, "read-only database");
+		}
+
+		std::lock_guard<std::mutex> guard(m_expire_lock);
+		if (shard <= m_expired_shard) {
+			return greylock::error_info();
+		}
+
+		std::string sshard = serialize(shard);
+		auto wo = rocksdb::WriteOptions();
+		wo.sync = true;
+
+		auto s = m_db->Put(wo, m_handles[options::meta_column], rocksdb::Slice(m_opts.expired_shard_key), rocksdb::Slice(sshard));
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not write expired shard key: %s, error: %s",
+					m_opts.expired_shard_key.c_str(), s.ToString().c_str());
+		}
+		m_expired_shard = shard;
+
+		// documents and forward index entries are keyed by indexed ID, their keys have fixed size,
+		// the last key of the expired range is included into file deletion
+		id_t start_id = shard_start_id(shard);
+		id_t last_id;
+		last_id.timestamp = start_id.timestamp - 1;
+
+		std::string first_key = id_t().to_string();
+		std::string start_key = start_id.to_string();
+		std::string last_key = last_id.to_string();
+
+		// posting list keys are prefixed with zero-padded shard number, there is no key equal to the bare prefix
+		char ckey[32];
+		size_t csize = snprintf(ckey, sizeof(ckey), "%016lx", shard);
+		std::string index_start_key(ckey, csize);
+
+		struct range {
+			int column;
+			std::string begin, last, end;
+		};
+		std::vector<range> ranges = {
+			{options::documents_column, first_key, last_key, start_key},
+			{options::forward_column, first_key, last_key, start_key},
+			{options::bodies_column, first_key, last_key, start_key},
+			{options::indexes_column, first_key, index_start_key, index_start_key},
+		};
+
+		// registered updates of frozen posting lists are sorted by shard the same way posting list keys are
+		std::string frozen_begin = frozen_updated_key(m_opts, "");
+		std::string frozen_end = frozen_updated_key(m_opts, index_start_key);
+		s = m_db->DeleteRange(rocksdb::WriteOptions(), m_handles[options::meta_column],
+				rocksdb::Slice(frozen_begin), rocksdb::Slice(frozen_end));
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not delete updated frozen posting lists, shard: %ld, error: %s",
+					shard, s.ToString().c_str());
+		}
+		{
+			std::lock_guard<std::mutex> guard(m_frozen_updated_lock);
+			m_frozen_updated.erase(m_frozen_updated.begin(), m_frozen_updated.lower_bound(index_start_key));
+		}
+
+		for (const auto &r: ranges) {
+			auto h = m_handles[r.column];
+			rocksdb::Slice begin(r.begin), last(r.last), end(r.end);
+
+			s = rocksdb::DeleteFilesInRange(m_db.get(), h, &begin, &last);
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "could not delete files in column %s, shard: %ld, error: %s",
+						m_opts.column_name(r.column).c_str(), shard, s.ToString().c_str());
+			}
+
+			s = m_db->DeleteRange(rocksdb::WriteOptions(), h, begin, end);
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "could not delete range in column %s, shard: %ld, error: %s",
+						m_opts.column_name(r.column).c_str(), shard, s.ToString().c_str());
+			}
+		}
+
+		return greylock::error_info();
+	}
+
+	// Splits @column into key ranges of about @chunk_size bytes using SST file metadata.
+	// Ranges are [start, end] including both keys, as used by @compact_range(), empty key means
+	// the beginning or the end of the key space. Range ends at the last key before the next range start,
+	// thus neighbour ranges do not overlap, only one key is read per range boundary.
+	std::vector<std::pair<std::string, std::string>> compaction_ranges(int column, uint64_t chunk_size) {
+		std::vector<std::pair<std::string, uint64_t>> points;
+		for (const auto &f: live_files(column)) {
+			points.emplace_back(f.smallestkey, f.size);
+		}
+		std::sort(points.begin(), points.end());
+
+		rocksdb::ReadOptions ro;
+		ro.fill_cache = false;
+		std::unique_ptr<rocksdb::Iterator> it(iterator(column, ro));
+
+		std::vector<std::pair<std::string, std::string>> ranges;
+		std::string start;
+		uint64_t size = 0;
+		for (const auto &p: points) {
+			if (size >= chunk_size && p.first > start) {
+				it->SeekForPrev(p.first);
+				if (it->Valid() && it->key() == rocksdb::Slice(p.first)) {
+					it->Prev();
+				}
+
+				// there are no keys between @start and the boundary, current range continues
+				if (it->Valid() && (start.empty() || it->key().compare(rocksdb::Slice(start)) >= 0)) {
+					ranges.emplace_back(start, it->key().ToString());
+					start = p.first;
+					size = 0;
+				}
+			}
+
+			size += p.second;
+		}
+		ranges.emplace_back(start, std::string());
+
+		return ranges;
+	}
+
+	// Compacts keys [@start, @end] of @column, empty key means the beginning or the end of the key space.
+	// Unlike @compact() it can run concurrently with other manual and automatic compactions.
+	greylock::error_info compact_range(int column, const std::string &start, const std::string &end) {
+		if (!m_db) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+
+		// column does not exist in read-only database, there is nothing to compact
+		if (!m_handles[column]) {
+			return greylock::error_info();
+		}
+
+		rocksdb::Slice b(start), e(end);
+
+		rocksdb::CompactRangeOptions opts;
+		opts.exclusive_manual_compaction = false;
+		auto s = m_db->CompactRange(opts, m_handles[column], start.empty() ? NULL : &b, end.empty() ? NULL : &e);
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not compact column %s: %s",
+					m_opts.column_name(column).c_str(), s.ToString().c_str());
+		}
+
+		return greylock::error_info();
+	}
+
+	// changes limit set by @options::compaction_rate_limit, 0 removes the limit
+	greylock::error_info set_compaction_rate(int64_t bytes_per_second) {
+		if (!m_rate_limiter) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+		if (bytes_per_second < 0) {
+			return greylock::create_error(-EINVAL, "invalid compaction rate %ld", bytes_per_second);
+		}
+
+		m_rate_limiter->SetBytesPerSecond(bytes_per_second ? bytes_per_second : options::unlimited_compaction_rate);
+		return greylock::error_info();
+	}
+
+	// returns metadata of the live SST files of @column
+	std::vector<rocksdb::LiveFileMetaData> live_files(int column) {
+		std::vector<rocksdb::LiveFileMetaData> files, ret;
+		if (!m_db)
+			return ret;
+
+		m_db->GetLiveFilesMetaData(&files);
+		for (auto &f: files) {
+			if (f.column_family_name == m_opts.column_names[column])
+				ret.emplace_back(std::move(f));
+		}
+
+		return ret;
+	}
+
+	// returns writer of SST files which can be ingested into @column using @ingest()
+	std::unique_ptr<rocksdb::SstFileWriter> sst_file_writer(int column) {
+		return std::unique_ptr<rocksdb::SstFileWriter>(
+				new rocksdb::SstFileWriter(rocksdb::EnvOptions(), m_dbo, m_handles[column]));
+	}
+
+	// ingests externally created SST files into @column, files are moved into database directory,
+	// keys of the ingested files must not overlap
+	greylock::error_info ingest(int column, const std::vector<std::string> &files) {
+		if (!m_db) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+
+		if (m_ro) {
+			return greylock::create_error(-EROFS, "read-only database");
+		}
+
+		rocksdb::IngestExternalFileOptions ifo;
+		ifo.move_files = true;
+
+		auto s = m_db->IngestExternalFile(m_handles[column], files, ifo);
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not ingest %ld files into column %s: %s",
+					files.size(), m_opts.column_names[column].c_str(), s.ToString().c_str());
+		}
+
+		return greylock::error_info();
+	}
+
+	// atomically ingests SST files into several columns, @files maps column to its files,
+	// either all files are ingested or none of them
+	greylock::error_info ingest(const std::map<int, std::vector<std::string>> &files) {
+		if (!m_db) {
+			return greylock::create_error(-EINVAL, "database is not opened");
+		}
+
+		if (m_ro) {
+			return greylock::create_error(-EROFS, "read-only database");
+		}
+
+		std::vector<rocksdb::IngestExternalFileArg> args;
+		for (const auto &p: files) {
+			rocksdb::IngestExternalFileArg arg;
+			arg.column_family = m_handles[p.first];
+			arg.external_files = p.second;
+			arg.options.move_files = true;
+			args.emplace_back(std::move(arg));
+		}
+
+		auto s = m_db->IngestExternalFiles(args);
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not ingest files into %ld columns: %s",
+					files.size(), s.ToString().c_str());
+		}
+
+		return greylock::error_info();
+	}
+
 private:
 	bool m_ro = false;
+	rocksdb::Options m_dbo;
+	std::shared_ptr<rocksdb::RateLimiter> m_rate_limiter;
+
+	indexes_compaction_filter m_indexes_filter{this};
+	documents_compaction_filter m_documents_filter{this};
+	bodies_compaction_filter m_bodies_filter{this};
+	token_shards_compaction_filter m_token_shards_filter{this};
+	document_ids_compaction_filter m_document_ids_filter{this};
+
+	std::mutex m_expire_lock;
+	std::atomic<size_t> m_expired_shard{0};
+
+	std::mutex m_deleted_lock;
+	std::shared_ptr<const std::set<id_t>> m_deleted = std::make_shared<const std::set<id_t>>();
+
+	std::mutex m_frozen_updated_lock;
+	std::set<std::string> m_frozen_updated;
+
 	std::vector<rocksdb::ColumnFamilyHandle*> m_handles;
 	std::unique_ptr<rocksdb::DB> m_db;
 	greylock::options m_opts;
@@ -669,6 +1544,61 @@ private:
 
 	ribosome::expiration m_expiration_timer;
 
+	greylock::error_info load_deleted() {
+		std::shared_ptr<std::set<id_t>> deleted = std::make_shared<std::set<id_t>>();
+
+		for (const auto &key: list_keys(options::meta_column, m_opts.deleted_prefix, ~0UL)) {
+			deleted->insert(id_t(key.substr(m_opts.deleted_prefix.size()).c_str()));
+		}
+
+		std::atomic_store(&m_deleted, std::shared_ptr<const std::set<id_t>>(deleted));
+		return greylock::error_info();
+	}
+
+	greylock::error_info load_frozen_updated() {
+		std::lock_guard<std::mutex> guard(m_frozen_updated_lock);
+		for (const auto &key: list_keys(options::meta_column, m_opts.frozen_updated_prefix, ~0UL)) {
+			m_frozen_updated.insert(key.substr(m_opts.frozen_updated_prefix.size()));
+		}
+
+		return greylock::error_info();
+	}
+
+	greylock::error_info load_expired_shard() {
+		std::string sshard;
+		auto err = read(options::meta_column, m_opts.expired_shard_key, &sshard);
+		if (err) {
+			if (err.code() == -rocksdb::Status::kNotFound)
+				return greylock::error_info();
+
+			return err;
+		}
+
+		size_t shard;
+		err = deserialize(shard, sshard.data(), sshard.size());
+		if (err) {
+			return greylock::create_error(err.code(), "could not deserialize expired shard key: %s, error: %s",
+					m_opts.expired_shard_key.c_str(), err.message().c_str());
+		}
+
+		m_expired_shard = shard;
+		return greylock::error_info();
+	}
+
+	greylock::error_info clear_deleted(const std::set<id_t> &ids) {
+		rocksdb::WriteBatch batch;
+		for (const auto &id: ids) {
+			batch.Delete(m_handles[options::meta_column], rocksdb::Slice(deleted_key(m_opts, id)));
+		}
+
+		auto err = write(&batch);
+		if (err)
+			return err;
+
+		erase_deleted(ids);
+		return greylock::error_info();
+	}
+
 	void sync_metadata_callback() {
 		sync_metadata(NULL);
 
@@ -677,4 +1607,123 @@ private:
 	}
 };
 
+inline bool indexes_compaction_filter::Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+		std::string *new_value, bool *value_changed) const {
+	(void) level;
+	(void) key;
+
+	auto deleted = m_db->deleted_ids();
+	if (deleted->empty())
+		return false;
+
+	disk_index index;
+	auto err = deserialize(index, existing_value.data(), existing_value.size());
+	if (err)
+		return false;
+
+	size_t size = index.ids.size();
+	index.ids.erase(std::remove_if(index.ids.begin(), index.ids.end(),
+				[&] (const document_for_index &did) {
+					return deleted->find(did.indexed_id) != deleted->end();
+				}), index.ids.end());
+
+	if (index.ids.size() != size) {
+		serialize(index, new_value);
+		*value_changed = true;
+	}
+
+	return false;
+}
+
+inline bool documents_compaction_filter::Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+		std::string *new_value, bool *value_changed) const {
+	(void) level;
+	(void) new_value;
+	(void) value_changed;
+
+	std::string id;
+	try {
+		// document is packed as [version, is_comment, author, content, id, indexed_id, ...] array
+		unpacked_object uo = unpack_object(existing_value.data(), existing_value.size());
+		const msgpack::object &o = uo.get();
+		if (o.type != msgpack::type::ARRAY || o.via.array.size < 5)
+			return false;
+
+		o.via.array.ptr[4].convert(&id);
+	} catch (...) {
+		return false;
+	}
+
+	std::string sid;
+	auto err = m_db->read(options::document_ids_column, id, &sid);
+	if (err) {
+		// mapping has been deleted together with the document, document itself is an orphan
+		return err.code() == -rocksdb::Status::kNotFound;
+	}
+
+	id_t indexed_id;
+	err = deserialize(indexed_id, sid.data(), sid.size());
+	if (err)
+		return false;
+
+	return indexed_id.to_string() != key.ToString();
+}
+
+inline bool bodies_compaction_filter::Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+		std::string *new_value, bool *value_changed) const {
+	(void) level;
+	(void) existing_value;
+	(void) new_value;
+	(void) value_changed;
+
+	// body is written together with its document, document is the only reference to it
+	std::string doc;
+	auto err = m_db->read(options::documents_column, key.ToString(), &doc);
+	return err && err.code() == -rocksdb::Status::kNotFound;
+}
+
+inline bool token_shards_compaction_filter::Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+		std::string *new_value, bool *value_changed) const {
+	(void) level;
+	(void) key;
+
+	size_t expired = m_db->expired_shard();
+	if (expired == 0)
+		return false;
+
+	disk_token dt;
+	auto err = deserialize(dt, existing_value.data(), existing_value.size());
+	if (err)
+		return false;
+
+	if (!dt.erase_before(expired))
+		return false;
+
+	if (dt.shards.empty())
+		return true;
+
+	serialize(dt, new_value);
+	*value_changed = true;
+	return false;
+}
+
+inline bool document_ids_compaction_filter::Filter(int level, const rocksdb::Slice &key, const rocksdb::Slice &existing_value,
+		std::string *new_value, bool *value_changed) const {
+	(void) level;
+	(void) key;
+	(void) new_value;
+	(void) value_changed;
+
+	size_t expired = m_db->expired_shard();
+	if (expired == 0)
+		return false;
+
+	id_t indexed_id;
+	auto err = deserialize(indexed_id, existing_value.data(), existing_value.size());
+	if (err)
+		return false;
+
+	return indexed_id < m_db->shard_start_id(expired);
+}
+
 }} // namespace ioremap::greylock
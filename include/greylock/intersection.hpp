@@ -2,6 +2,7 @@
 #define __INDEXES_INTERSECTION_HPP
 
 #include "greylock/iterator.hpp"
+#include "greylock/snippet.hpp"
 #include "greylock/types.hpp"
 
 namespace ioremap { namespace greylock {
@@ -12,6 +13,47 @@ struct single_doc_result {
 	float relevance = 0;
 };
 
+// time spent in every stage of the search, microseconds
+struct search_timings {
+	// reading token shard lists and per-shard counters
+	long shard_lookup = 0;
+	// reading and decoding posting lists
+	long postings = 0;
+	// walking posting lists, negation checks and aggregations
+	long intersection = 0;
+	// reading documents
+	long documents = 0;
+};
+
+// execution counters of one query token
+struct token_explain {
+	std::string mbox, attr, token;
+	bool negation = false;
+
+	// number of shards where posting list of the token has to be read
+	size_t shards_considered = 0;
+
+	iterator_stats stats;
+};
+
+// Execution counters of the query, they are always collected and are cheap compared to posting list reads,
+// client requests them with 'explain' flag, server also logs them for slow queries.
+struct search_explain {
+	std::vector<token_explain> tokens;
+
+	// documents found in all posting lists
+	size_t candidates = 0;
+	// candidates dropped because one of the negation tokens matched
+	size_t negation_rejected = 0;
+	// candidates which have been deleted, but whose postings have not been removed by compaction yet
+	size_t deleted_rejected = 0;
+	// documents read from the database, including those which could not be read
+	size_t documents_read = 0;
+	size_t documents_missing = 0;
+	// documents dropped by result check function (exact phrase match)
+	size_t check_rejected = 0;
+};
+
 struct search_result {
 	bool completed = true;
 
@@ -23,6 +65,25 @@ struct search_result {
 
 	// array of documents which contain all requested indexes
 	std::vector<single_doc_result> docs;
+
+	// number of documents which matched the query, it equals to the size of @docs array
+	// unless only counting has been requested
+	size_t count = 0;
+
+	// set when @count is an estimation made from per-shard document counters
+	bool estimated = false;
+
+	// start of the time interval -> number of matched documents
+	std::map<long, size_t> histogram;
+
+	// attribute name -> array of (token, number of matched documents) pairs sorted by number of documents
+	std::map<std::string, std::vector<std::pair<std::string, size_t>>> facets;
+	// attributes whose facets have been computed over part of their tokens,
+	// returned counters are exact, but more frequent tokens could have been skipped
+	std::set<std::string> truncated_facets;
+
+	search_timings timings;
+	search_explain explain;
 };
 
 // check whether given result matches query, may also set or change some result parameters like relevance field
@@ -65,6 +126,35 @@ struct mailbox_query {
 	}
 };
 
+// Aggregations are computed over all documents matching the query (starting from the paging cookie),
+// not only over those which are returned in the current page.
+struct aggregation_query {
+	// length of the histogram bucket in seconds, 0 disables histogram,
+	// indexed IDs store day number, thus interval is rounded up to the whole number of days
+	long histogram_interval = 0;
+
+	// names of the indexed attributes whose tokens are counted among matched documents
+	std::vector<std::string> facet_attributes;
+	// number of the most frequent tokens returned per attribute
+	size_t facet_size = 10;
+	// maximum number of attribute tokens checked against matched documents,
+	// tokens which have the most documents in the matched shards are selected
+	size_t facet_max_tokens = 1000;
+	// maximum number of attribute tokens whose shard lists are read to select checked tokens
+	size_t facet_scan_tokens = 100000;
+
+	// upper limits of the facet parameters requested by client
+	enum {
+		max_facet_size = 10000,
+		max_facet_max_tokens = 100000,
+		max_facet_scan_tokens = 10000000,
+	};
+
+	bool empty() const {
+		return histogram_interval <= 0 && facet_attributes.empty();
+	}
+};
+
 struct intersection_query {
 	id_t range_start, range_end;
 
@@ -73,6 +163,87 @@ struct intersection_query {
 	id_t next_document_id;
 	size_t max_number = LONG_MAX;
 
+	// part of the document requested by client, see document::projection_* enum
+	int projection = document::projection_full;
+
+	// do not put matched documents into the result, only count them,
+	// @max_number is ignored and intersection runs until completion
+	bool count_only = false;
+
+	aggregation_query aggregation;
+
+	// fragments of content around matched words returned instead of (or together with) the whole content
+	snippet_query snippets;
+
+	// return execution counters and per-stage timings together with the result
+	bool explain = false;
+
+	// Returns part of the document which has to be read to check whether it matches the query,
+	// exact phrase match has to check title or content of every document found in indexes.
+	int check_projection() const {
+		int ret = document::projection_ids;
+
+		for (const auto &ent: se) {
+			for (const auto &attr: ent.idx.exact) {
+				if (attr.name.find("title") != std::string::npos) {
+					ret = std::max(ret, (int)document::projection_meta);
+				} else {
+					return document::projection_full;
+				}
+			}
+		}
+
+		return ret;
+	}
+
+	// Returns part of the document which has to be read from the storage.
+	// It can be larger than requested projection because of the exact phrase match checks.
+	int read_projection() const {
+		if (!snippets.empty())
+			return document::projection_full;
+
+		return std::max(projection, check_projection());
+	}
+
+	// returns names of the query tokens which are highlighted in snippets
+	std::set<std::string> token_names() const {
+		std::set<std::string> names;
+
+		for (const auto &ent: se) {
+			for (const auto &attrs: {&ent.idx.attributes, &ent.idx.exact}) {
+				for (const auto &attr: *attrs) {
+					if (!snippets.attributes.empty() &&
+							std::find(snippets.attributes.begin(), snippets.attributes.end(), attr.name) ==
+								snippets.attributes.end())
+						continue;
+
+					for (const auto &t: attr.tokens) {
+						names.insert(t.name);
+					}
+				}
+			}
+		}
+
+		return names;
+	}
+
+	// returns token shard keys of all query and negation tokens
+	std::vector<std::string> shard_keys(const greylock::options &options) const {
+		std::vector<std::string> keys;
+
+		for (const auto &ent: se) {
+			for (const auto &attrs: {&ent.idx.attributes, &ent.idx.negation}) {
+				for (const auto &attr: *attrs) {
+					for (const auto &t: attr.tokens) {
+						keys.emplace_back(document::generate_shard_key(options, ent.mbox, attr.name, t.name));
+					}
+				}
+			}
+		}
+
+		return keys;
+	}
+
 	std::string to_string() const {
 		std::ostringstream ss;
 
@@ -84,6 +255,450 @@ struct intersection_query {
 
 		return ss.str();
 	}
+
+	// parses search request: {"request": {mailbox: {"query": ..., "exact": ..., "negation": ...}, ...},
+	// "paging": ..., "time": ..., "projection": ..., "snippets": ..., "aggregations": ..., "explain": ...}
+	static greylock::error_info parse(const greylock::options &options, const rapidjson::Value &doc, intersection_query &iq) {
+		const auto &paging = greylock::get_object(doc, "paging");
+		if (paging.IsObject()) {
+			iq.next_document_id = greylock::id_t(greylock::get_string(paging, "next_document_id"));
+			iq.max_number = greylock::get_int64(paging, "max_number", LONG_MAX);
+		}
+
+		long sec_start = 0, sec_end = LONG_MAX;
+		const auto &time = greylock::get_object(doc, "time");
+		if (time.IsObject()) {
+			sec_start = greylock::get_int64(time, "start", sec_start);
+			sec_end = greylock::get_int64(time, "end", sec_end);
+		}
+		iq.range_start.set_timestamp(sec_start, 0);
+		iq.range_end.set_timestamp(sec_end, 0);
+
+		// {"snippets": {"max": 3, "size": 160, "pre": "<b>", "post": "</b>", "attributes": ["content"]}},
+		// only tokens of the listed attributes (all query attributes by default) are highlighted in content
+		const auto &snippets = greylock::get_object(doc, "snippets");
+		if (snippets.IsObject()) {
+			auto &sq = iq.snippets;
+			int64_t max_fragments = greylock::get_int64(snippets, "max", 3);
+			int64_t fragment_size = greylock::get_int64(snippets, "size", sq.fragment_size);
+			if (max_fragments <= 0 || fragment_size <= 0) {
+				return greylock::create_error(-EINVAL,
+						"snippets: 'max' (%ld) and 'size' (%ld) must be positive", max_fragments, fragment_size);
+			}
+
+			sq.max_fragments = max_fragments;
+			sq.fragment_size = fragment_size;
+			sq.pre = greylock::get_string(snippets, "pre", sq.pre.c_str());
+			sq.post = greylock::get_string(snippets, "post", sq.post.c_str());
+
+			const auto &attrs = greylock::get_array(snippets, "attributes");
+			if (attrs.IsArray()) {
+				for (auto it = attrs.Begin(), end = attrs.End(); it != end; ++it) {
+					if (it->IsString())
+						sq.attributes.emplace_back(it->GetString(), it->GetStringLength());
+				}
+			}
+		}
+
+		iq.explain = greylock::get_bool(doc, "explain", false);
+
+		// whole content is not sent by default when snippets have been requested
+		const char *projection = greylock::get_string(doc, "projection", iq.snippets.empty() ? "full" : "meta");
+		iq.projection = greylock::document::projection_from_string(projection);
+		if (iq.projection < 0) {
+			return greylock::create_error(-EINVAL,
+					"invalid projection '%s', must be one of: ids, meta, full", projection);
+		}
+
+		// snippets are sent as part of document content, which is not sent with ids projection,
+		// otherwise every matched document would be read in full for nothing
+		if (!iq.snippets.empty() && iq.projection == greylock::document::projection_ids) {
+			return greylock::create_error(-EINVAL, "snippets can not be requested with 'ids' projection");
+		}
+
+		const auto &aggregations = greylock::get_object(doc, "aggregations");
+		if (aggregations.IsObject()) {
+			auto &aq = iq.aggregation;
+
+			const auto &histogram = greylock::get_object(aggregations, "histogram");
+			if (histogram.IsObject()) {
+				aq.histogram_interval = greylock::get_int64(histogram, "interval", 3600 * 24);
+			}
+
+			const auto &facets = greylock::get_object(aggregations, "facets");
+			if (facets.IsObject()) {
+				const auto &attrs = greylock::get_array(facets, "attributes");
+				if (attrs.IsArray()) {
+					for (auto it = attrs.Begin(), end = attrs.End(); it != end; ++it) {
+						if (it->IsString())
+							aq.facet_attributes.emplace_back(it->GetString(), it->GetStringLength());
+					}
+				}
+
+				int64_t size = greylock::get_int64(facets, "size", aq.facet_size);
+				int64_t max_tokens = greylock::get_int64(facets, "max_tokens", aq.facet_max_tokens);
+				int64_t scan_tokens = greylock::get_int64(facets, "scan_tokens", aq.facet_scan_tokens);
+				if (size <= 0 || max_tokens <= 0 || scan_tokens <= 0) {
+					return greylock::create_error(-EINVAL,
+							"facets: 'size' (%ld), 'max_tokens' (%ld) and 'scan_tokens' (%ld) must be positive",
+							size, max_tokens, scan_tokens);
+				}
+
+				aq.facet_size = std::min<int64_t>(size, aggregation_query::max_facet_size);
+				aq.facet_max_tokens = std::min<int64_t>(max_tokens, aggregation_query::max_facet_max_tokens);
+				aq.facet_scan_tokens = std::min<int64_t>(scan_tokens, aggregation_query::max_facet_scan_tokens);
+			}
+		}
+
+		const auto &request = greylock::get_object(doc, "request");
+		if (!request.IsObject()) {
+			return greylock::create_error(-EINVAL, "document must contain 'request' object");
+		}
+
+		for (auto it = request.MemberBegin(), jse_end = request.MemberEnd(); it != jse_end; ++it) {
+			if (!it->value.IsObject()) {
+				return greylock::create_error(-EINVAL, "mailbox query '%s' must contain object",
+						it->name.GetString());
+			}
+
+			greylock::mailbox_query q(options, it->value);
+			if (q.parse_error) {
+				return greylock::create_error(q.parse_error.code(), "could not parse mailbox query: %s",
+						q.parse_error.message().c_str());
+			}
+
+			q.mbox.assign(it->name.GetString(), it->name.GetStringLength());
+
+			iq.se.emplace_back(std::move(q));
+		}
+
+		return greylock::error_info();
+	}
+};
+
+template <typename DBT>
+class query_planner;
+
+// Computes aggregations over matched documents without reading them:
+// histogram uses timestamp stored in indexed ID, facets check posting lists of the attribute tokens.
+//
+// Facet tokens are ranked by per-shard document counters in the matched shards (see @disk_token),
+// only @aggregation_query::facet_max_tokens most frequent ones are checked, posting lists are read
+// starting from the shard of the first matched document.
+template <typename DBT>
+class aggregator {
+public:
+	aggregator(DBT &db, const intersection_query &iq, const std::vector<size_t> &common_shards) :
+		m_iq(iq),
+		m_interval(0)
+	{
+		const aggregation_query &aq = iq.aggregation;
+
+		if (aq.histogram_interval > 0) {
+			m_interval = (aq.histogram_interval + date_div - 1) / date_div * date_div;
+		}
+
+		struct candidate {
+			std::string token;
+			std::vector<size_t> shards;
+			size_t documents = 0;
+		};
+
+		for (const auto &attr: aq.facet_attributes) {
+			for (const auto &ent: iq.se) {
+				std::string prefix = document::generate_index_base(db.options(), ent.mbox, attr, "");
+				std::vector<std::string> keys = db.list_keys(options::token_shards_column, prefix,
+						aq.facet_scan_tokens + 1);
+
+				bool truncated = keys.size() > aq.facet_scan_tokens;
+				if (truncated) {
+					keys.resize(aq.facet_scan_tokens);
+				}
+
+				std::vector<candidate> candidates;
+				for (const auto &key: keys) {
+					candidate c;
+
+					disk_token dt = db.get_disk_token(key);
+					for (size_t i = 0; i < dt.shards.size(); ++i) {
+						if (!std::binary_search(common_shards.begin(), common_shards.end(), dt.shards[i]))
+							continue;
+
+						c.shards.push_back(dt.shards[i]);
+						c.documents += dt.known(i) ? dt.counts[i] :
+							(size_t)query_planner<DBT>::unknown_shard_cost;
+					}
+					if (c.shards.empty())
+						continue;
+
+					c.token = key.substr(prefix.size());
+					candidates.emplace_back(std::move(c));
+				}
+
+				if (candidates.size() > aq.facet_max_tokens) {
+					std::nth_element(candidates.begin(), candidates.begin() + aq.facet_max_tokens, candidates.end(),
+						[] (const candidate &a, const candidate &b) {
+							return a.documents > b.documents;
+						});
+					candidates.resize(aq.facet_max_tokens);
+					truncated = true;
+				}
+
+				for (auto &c: candidates) {
+					m_facets.emplace_back(db, ent.mbox, attr, c.token, std::move(c.shards));
+				}
+
+				if (truncated) {
+					m_truncated.insert(attr);
+				}
+			}
+		}
+	}
+
+	void insert(const id_t &indexed_id) {
+		if (m_interval > 0) {
+			long tsec, aux;
+			indexed_id.get_timestamp(&tsec, &aux);
+
+			m_histogram[tsec - tsec % m_interval]++;
+		}
+
+		for (auto &f: m_facets) {
+			f.open(indexed_id);
+
+			auto &it = *f.begin;
+			if (it == *f.end)
+				continue;
+
+			if (it->indexed_id < indexed_id) {
+				it.rewind_to_index(indexed_id);
+				if (it == *f.end)
+					continue;
+			}
+
+			if (it->indexed_id == indexed_id) {
+				f.count++;
+			}
+		}
+	}
+
+	void finish(search_result &res) {
+		res.histogram.swap(m_histogram);
+		res.truncated_facets.swap(m_truncated);
+
+		std::map<std::string, std::map<std::string, size_t>> counts;
+		for (const auto &f: m_facets) {
+			if (f.count) {
+				counts[f.attr][f.token] += f.count;
+			}
+		}
+
+		for (const auto &attr: counts) {
+			std::vector<std::pair<std::string, size_t>> tokens(attr.second.begin(), attr.second.end());
+			std::sort(tokens.begin(), tokens.end(),
+				[] (const std::pair<std::string, size_t> &a, const std::pair<std::string, size_t> &b) {
+					return a.second > b.second;
+				});
+
+			if (tokens.size() > m_iq.aggregation.facet_size)
+				tokens.resize(m_iq.aggregation.facet_size);
+
+			res.facets[attr.first].swap(tokens);
+		}
+	}
+
+private:
+	struct facet {
+		DBT &db;
+		std::string mbox;
+		std::string attr;
+		std::string token;
+		std::vector<size_t> shards;
+
+		// iterators are created when the first matched document is checked
+		std::unique_ptr<greylock::index_iterator<DBT>> begin, end;
+		size_t count = 0;
+
+		facet(DBT &db, const std::string &mbox, const std::string &attr, const std::string &token,
+				std::vector<size_t> &&shards) :
+			db(db),
+			mbox(mbox),
+			attr(attr),
+			token(token),
+			shards(std::move(shards))
+		{
+		}
+
+		// shards older than the first matched document are not read
+		void open(const id_t &indexed_id) {
+			if (begin)
+				return;
+
+			size_t shard = document::generate_shard_number(db.options(), indexed_id);
+			shards.erase(shards.begin(), std::lower_bound(shards.begin(), shards.end(), shard));
+
+			begin.reset(new greylock::index_iterator<DBT>(
+						greylock::index_iterator<DBT>::begin(db, mbox, attr, token, shards)));
+			end.reset(new greylock::index_iterator<DBT>(
+						greylock::index_iterator<DBT>::end(db, mbox, attr, token)));
+		}
+	};
+
+	const intersection_query &m_iq;
+	long m_interval;
+	std::map<long, size_t> m_histogram;
+	std::vector<facet> m_facets;
+	std::set<std::string> m_truncated;
+};
+
+// Builds intersection plan using per-shard document counters stored in token shard lists (see @disk_token).
+//
+// Shards which are out of the requested time range (or before the paging cookie) or which do not contain
+// every query token are pruned before any posting list is read. Remaining tokens are ordered by the number
+// of documents they have in the common shards, the rarest token drives intersection and every other
+// posting list is only probed at the driver's documents, thus a rare token combined with a very common one
+// costs about as much as the rare token alone.
+template <typename DBT>
+class query_planner {
+public:
+	// cost of the shard whose document counter is not known (@disk_token::unknown_count)
+	enum {
+		unknown_shard_cost = 1000,
+	};
+
+	struct token {
+		std::string mbox;
+		std::string attr;
+		std::string name;
+
+		// number of documents in common shards
+		size_t cost = 0;
+	};
+
+	struct plan {
+		// sorted shards which may contain matching documents
+		std::vector<size_t> shards;
+
+		// query tokens sorted by cost, the first one is the cheapest and drives intersection
+		std::vector<token> tokens;
+
+		// upper bound of the number of matching documents computed from known counters
+		size_t estimate = 0;
+		// false if there is a common shard where no query token has known counter,
+		// such shards are not included into @estimate
+		bool estimate_known = true;
+
+		bool empty() const {
+			return shards.empty();
+		}
+	};
+
+	query_planner(DBT &db) : m_db(db) {}
+
+	plan build(const intersection_query &iq) const {
+		plan p;
+
+		id_t start = std::max(iq.range_start, iq.next_document_id);
+		size_t shard_start = document::generate_shard_number(m_db.options(), start);
+		size_t shard_end = document::generate_shard_number(m_db.options(), iq.range_end);
+
+		std::vector<stat> stats;
+		for (const auto &ent: iq.se) {
+			for (const auto &attr: ent.idx.attributes) {
+				for (const auto &t: attr.tokens) {
+					std::string shard_key = document::generate_shard_key(m_db.options(), ent.mbox, attr.name, t.name);
+					disk_token dt = m_db.get_disk_token(shard_key);
+
+					stat st;
+					st.tok.mbox = ent.mbox;
+					st.tok.attr = attr.name;
+					st.tok.name = t.name;
+
+					for (size_t i = 0; i < dt.shards.size(); ++i) {
+						size_t shard = dt.shards[i];
+						if (shard < shard_start || shard > shard_end)
+							continue;
+
+						st.counts[shard] = dt.counts[i];
+					}
+
+					// this token has no documents in requested range, intersection is empty
+					if (st.counts.empty()) {
+						return p;
+					}
+
+					stats.emplace_back(std::move(st));
+				}
+			}
+		}
+
+		if (stats.empty()) {
+			return p;
+		}
+
+		// start with the token which has the smallest number of shards, every other token can only remove shards
+		auto smallest = std::min_element(stats.begin(), stats.end(), [] (const stat &a, const stat &b) {
+					return a.counts.size() < b.counts.size();
+				});
+
+		for (const auto &sh: smallest->counts) {
+			size_t shard = sh.first;
+			bool common = true;
+			size_t estimate = ~0UL;
+
+			for (const auto &st: stats) {
+				auto it = st.counts.find(shard);
+				if (it == st.counts.end()) {
+					common = false;
+					break;
+				}
+
+				if (it->second != disk_token::unknown_count) {
+					estimate = std::min(estimate, it->second);
+				}
+			}
+
+			if (!common)
+				continue;
+
+			p.shards.push_back(shard);
+			if (estimate != ~0UL) {
+				p.estimate += estimate;
+			} else {
+				p.estimate_known = false;
+			}
+		}
+
+		if (p.shards.empty()) {
+			return p;
+		}
+
+		for (auto &st: stats) {
+			for (size_t shard: p.shards) {
+				size_t count = st.counts[shard];
+				st.tok.cost += (count == disk_token::unknown_count) ? (size_t)unknown_shard_cost : count;
+			}
+
+			p.tokens.emplace_back(std::move(st.tok));
+		}
+
+		// stable sort keeps query order for tokens of the same cost
+		std::stable_sort(p.tokens.begin(), p.tokens.end(), [] (const token &a, const token &b) {
+					return a.cost < b.cost;
+				});
+
+		return p;
+	}
+
+private:
+	DBT &m_db;
+
+	struct stat {
+		token tok;
+
+		// shard number -> number of documents or @disk_token::unknown_count
+		std::map<size_t, size_t> counts;
+	};
 };
 
 template <typename DBT>
@@ -110,6 +725,7 @@ public:
 	// @search_result.completed will be set to true in this case.
 	search_result intersect(const intersection_query &iq, check_result_function_t check) const {
 		search_result res;
+		usec_timer total_tm;
 #ifdef STDOUT_DEBUG
 				auto dump_vector = [] (const std::vector<size_t> &sh) -> std::string {
 					std::ostringstream ss;
@@ -124,235 +740,161 @@ public:
 
 #endif
 
-
-		std::vector<size_t> common_shards;
-		bool init = true;
-		for (const auto &ent: iq.se) {
-			for (const auto &attr: ent.idx.attributes) {
-				for (const auto &t: attr.tokens) {
-					std::string shard_key = document::generate_shard_key(m_db_indexes.options(), ent.mbox, attr.name, t.name);
-					auto shards = m_db_indexes.get_shards(shard_key);
+		usec_timer tm;
+		query_planner<DBT> planner(m_db_indexes);
+		auto plan = planner.build(iq);
+		res.timings.shard_lookup = tm.elapsed();
+		if (plan.empty()) {
+			return res;
+		}
 #ifdef STDOUT_DEBUG
-					printf("common_shards: %s, key: %s, shards: %s\n",
-							dump_vector(common_shards).c_str(), shard_key.c_str(),
-							dump_vector(shards).c_str());
-#endif
-					// one index is empty, intersection will be empty, return early
-					if (shards.size() == 0) {
-						return res;
-					}
-
-					if (init) {
-						common_shards = shards;
-						init = false;
-					} else {
-						std::vector<size_t> intersection;
-						std::set_intersection(common_shards.begin(), common_shards.end(),
-								shards.begin(), shards.end(),
-								std::back_inserter(intersection));
-						common_shards = intersection;
-					}
-
-					// intersection is empty, return early
-					if (common_shards.size() == 0) {
-						return res;
-					}
-				}
-			}
+		printf("plan: shards: %s, estimate: %zd\n", dump_vector(plan.shards).c_str(), plan.estimate);
+		for (const auto &t: plan.tokens) {
+			printf("plan: mbox: %s, attr: %s, token: %s, cost: %zd\n",
+					t.mbox.c_str(), t.attr.c_str(), t.name.c_str(), t.cost);
 		}
+#endif
 
 		struct iter {
 			greylock::index_iterator<DBT> begin, end;
 
 			iter(DBT &db, const std::string &mbox, const std::string &attr, const std::string &token,
-					const std::vector<size_t> &shards) :
-				begin(greylock::index_iterator<DBT>::begin(db, mbox, attr, token, shards)),
+					const std::vector<size_t> &shards, iterator_stats *stats) :
+				begin(greylock::index_iterator<DBT>::begin(db, mbox, attr, token, shards, stats)),
 				end(greylock::index_iterator<DBT>::end(db, mbox, attr, token))
 			{
 			}
 		};
 
-		// contains vector of iterators pointing to the requested indexes
+		// contains vector of iterators pointing to the requested indexes in plan order,
 		// iterator always points to the smallest document ID not yet pushed into resulting structure (or to client)
 		// or discarded (if other index iterators point to larger document IDs)
 		std::vector<iter> idata;
 		std::vector<iter> inegation;
 
+		// iterators keep pointers to the counters, vector must not be reallocated
+		auto &explain = res.explain;
+		size_t num_tokens = plan.tokens.size();
 		for (const auto &ent: iq.se) {
-			for (const auto &attr: ent.idx.attributes) {
-				for (const auto &t: attr.tokens) {
-					iter itr(m_db_indexes, ent.mbox, attr.name, t.name, common_shards);
+			for (const auto &attr: ent.idx.negation) {
+				num_tokens += attr.tokens.size();
+			}
+		}
+		explain.tokens.reserve(num_tokens);
 
-					if (iq.next_document_id != 0) {
-						itr.begin.rewind_to_index(iq.next_document_id);
-					} else {
-						itr.begin.rewind_to_index(iq.range_start);
-					}
+		auto add_explain = [&] (const std::string &mbox, const std::string &attr, const std::string &token,
+				bool negation, size_t shards) -> iterator_stats * {
+			explain.tokens.emplace_back();
+			auto &te = explain.tokens.back();
+			te.mbox = mbox;
+			te.attr = attr;
+			te.token = token;
+			te.negation = negation;
+			te.shards_considered = shards;
+			return &te.stats;
+		};
 
-					idata.emplace_back(itr);
-				}
+		for (const auto &t: plan.tokens) {
+			iter itr(m_db_indexes, t.mbox, t.attr, t.name, plan.shards,
+					add_explain(t.mbox, t.attr, t.name, false, plan.shards.size()));
+
+			if (iq.next_document_id != 0) {
+				itr.begin.rewind_to_index(iq.next_document_id);
+			} else {
+				itr.begin.rewind_to_index(iq.range_start);
 			}
 
+			idata.emplace_back(itr);
+		}
+
+		for (const auto &ent: iq.se) {
 			for (const auto &attr: ent.idx.negation) {
 				for (const auto &t: attr.tokens) {
 					std::string shard_key = document::generate_shard_key(m_db_indexes.options(), ent.mbox, attr.name, t.name);
-					auto shards = m_db_indexes.get_shards(shard_key);
+					tm.restart();
+					auto token_shards = m_db_indexes.get_shards(shard_key);
+					res.timings.shard_lookup += tm.elapsed();
 #ifdef STDOUT_DEBUG
 					printf("negation: key: %s, shards: %s\n",
 							shard_key.c_str(),
-							dump_vector(shards).c_str());
+							dump_vector(token_shards).c_str());
 #endif
 
-					iter itr(m_db_indexes, ent.mbox, attr.name, t.name, shards);
+					// negation only has to be checked in shards where query can match
+					std::vector<size_t> shards;
+					std::set_intersection(plan.shards.begin(), plan.shards.end(),
+							token_shards.begin(), token_shards.end(),
+							std::back_inserter(shards));
+
+					auto stats = add_explain(ent.mbox, attr.name, t.name, true, shards.size());
+					if (shards.empty())
+						continue;
+
+					iter itr(m_db_indexes, ent.mbox, attr.name, t.name, shards, stats);
 					inegation.emplace_back(itr);
 				}
 			}
 		}
 
+		int projection = iq.read_projection();
+
+		// when aggregations are requested, intersection continues after the page has been filled,
+		// subsequent documents are only read if they have to be checked
+		std::unique_ptr<aggregator<DBT>> aggr;
+		if (!iq.aggregation.empty()) {
+			aggr.reset(new aggregator<DBT>(m_db_indexes, iq, plan.shards));
+		}
+		bool page_full = false;
+		id_t page_next_document_id;
+
+		auto &driver = idata.front();
+
+		// postings of deleted documents indexed without forward index stay until full compaction
+		auto deleted = m_db_indexes.deleted_ids();
+
 		while (true) {
-			// contains indexes within @idata array of iterators,
-			// each iterator contains the same and smallest to the known moment reference to the document (i.e. document ID)
-			//
-			// if checking @idata array yelds smaller document ID than that in iterators referenced in @pos,
-			// then we clear @pos and starts pushing the new smallest iterator indexes
-			//
-			// we could break out of the @idata processing, increase the smallest pointing iterator and start over,
-			// but we optimize @idata processing - if there are other iterators in @idata which equal to the smallest
-			// iterator value (document ID), we put them into @pos
-			// Since @pos doesn't contain all indexes (its size doesn't equal to the size of @idata), we will increase
-			// all iterators where we have found the smallest document ID, hopefully they will point to the new document ID,
-			// which might be the same for all iterator among @idata and thus we will push this document ID to the result
-			// structure returned to the client
-			//
-			// Here is an example:
-			//
-			// 1. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d0	d2	d3	d3
-			// 			d2	d3	d4	d4
-			// 			d3	d4	d5	d5
-			// 			d4	-	-	-
-			// 			d5	-	-	-
-			//
-			// We start from the top of this table, i.e. row after 'document ids' string
-			// @pos will contain following values during iteration over @idata iterators
-			// 	0 - select the first value
-			// 	0 - skip iterator 1 (d2 document id) since its value is greater than that 0'th iterator value (d0)
-			// 	0 - skip iterator 2
-			// 	0 - skip iterator 3
-			//
-			// @pos contains only 0 index, it is not equal to the size of @idata (4), thus we have to increase 0'th iterator
-			// discarding its first value
-			//
-			// 2. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d2	d2	d3	d3
-			// 			d3	d3	d4	d4
-			// 			d4	d4	d5	d5
-			// 			d5	-	-	-
-			// @pos:
-			// 	0 - select the first iterator
-			// 	0 1 - 1'th iterator value equals to the value of the 0'th iterator, append it to the array
-			// 	0 1 - 2'th iterator value (d3) is greater than that of the 0'th iterator (d2)
-			// 	0 1 - the same as above
-			// since size of the @pos is not equal to the size of @idata we increment all iterators which are indexed in @pos
-			//
-			// 3. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d3	d3	d3	d3
-			// 			d4	d4	d4	d4
-			// 			d5	-	d5	d5
-			// @pos will contain all 4 indexes, since all iterator's value are the same (d3)
-			// We will increment all iterators and push d3 into resulting array which will be returned to the client,
-			// since size of the @pos array equals to the @idata size
-			//
-			// 4. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d4	d4	d4	d4
-			// 			d5	-	d5	d5
-			// We put d4 into resulting array and increment all iterators as above
-			//
-			// 5. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d5	-	d5	d5
-			//
-			// @pos:
-			// 	0 - select the first iterator
-			// 	Stop processing, since 1'th iterator is empty.
-			// 	This means no further iteration checks can contain all 4 the same value,
-			// 	thus it is not possible to find any other document with higher ID
-			// 	which will contain all 4 requested indexes.
-			//
-			// 6. Return [d3, d4] values to the client
-			std::vector<pos_t> pos;
-
-			id_t next_id;
-
-			int current = -1;
-			for (auto &itr: idata) {
-				auto &it = itr.begin;
-				auto &e = itr.end;
-				++current;
-
-				if (it == e) {
-					res.completed = true;
-					break;
-				}
+			// the cheapest posting list drives intersection: every other iterator is moved forward
+			// to the driver's document, if it lands on a larger document, driver skips to that document
+			// and the check is started over
+			if (driver.begin == driver.end || driver.begin->indexed_id > iq.range_end) {
+				res.completed = true;
+				break;
+			}
 
-				if (it->indexed_id > iq.range_end) {
-					res.completed = true;
-					break;
-				}
+			id_t indexed_id = driver.begin->indexed_id;
+			res.completed = false;
+			res.next_document_id.set_next_id(indexed_id);
 
-				res.completed = false;
-				res.next_document_id.set_next_id(it->indexed_id);
+			bool match = true;
+			for (size_t i = 1; i < idata.size(); ++i) {
+				auto &it = idata[i].begin;
 
-				if (pos.size() == 0) {
-					pos.push_back(current);
-					continue;
+				if (it != idata[i].end && it->indexed_id < indexed_id) {
+					it.rewind_to_index(indexed_id);
 				}
 
-				auto &min_it = idata[pos[0]].begin;
-#if 0
-				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: min-index: %s, id: %s, it-index: %s, id: %s",
-						idata[pos[0]].idx.start_key().str(), min_it->str(),
-						idata_it->idx.start_key().str(), it->str());
-#endif
-				if (it->indexed_id == min_it->indexed_id) {
-					pos.push_back(current);
-					continue;
+				// there are no more documents in one of the indexes, nothing can be added anymore
+				if (it == idata[i].end) {
+					res.completed = true;
+					break;
 				}
 
-				next_id = std::max(it->indexed_id, min_it->indexed_id);
-				res.next_document_id.set_next_id(next_id);
-
-				pos.clear();
-				break;
+				if (it->indexed_id != indexed_id) {
+					driver.begin.rewind_to_index(it->indexed_id);
+					match = false;
+					break;
+				}
 			}
 
-			// this can only happen if one of the iterators has been finished,
-			// which means number of found positions will not be equal to the number
-			// of indexes to intersect, and thus there is no more data to push into result.
-			// Just break out of the processing loop - nothing can be added anymore.
 			if (res.completed) {
 				break;
 			}
 
-			// number of entries with the same document ID doesn't match number of indexes,
-			// this means some index doesn't have this docuement and thus it has to be skipped
-			// and iteration check process has to be started over
-			if (pos.size() != idata.size()) {
-				for (auto &it: idata) {
-					auto &min_it = it.begin;
-
-					min_it.rewind_to_index(next_id);
-				}
-
+			if (!match) {
 				continue;
 			}
 
-			auto &min_it = idata[pos.front()].begin;
-			id_t indexed_id = min_it->indexed_id;
+			explain.candidates++;
 
 			bool negation_match = false;
 			for (auto &neg: inegation) {
@@ -366,44 +908,112 @@ public:
 				}
 			}
 
-			auto increment_all_iterators = [&] () {
-				for (auto it = pos.begin(); it != pos.end(); ++it) {
-					auto &idata_iter = idata[*it].begin;
-					++idata_iter;
-				}
-			};
-
 			if (negation_match) {
-				increment_all_iterators();
+				explain.negation_rejected++;
+				++driver.begin;
+				continue;
+			}
+
+			if (!deleted->empty() && deleted->count(indexed_id)) {
+				explain.deleted_rejected++;
+				++driver.begin;
 				continue;
 			}
 
+			if (page_full) {
+				projection = iq.check_projection();
+			}
+
 			single_doc_result rs;
-			auto err = min_it.document(m_db_docs, &rs.doc);
-			if (err) {
+			if (projection != document::projection_ids) {
+				tm.restart();
+				auto err = driver.begin.document(m_db_docs, &rs.doc, projection);
+				res.timings.documents += tm.elapsed();
+				explain.documents_read++;
+				if (err) {
+					explain.documents_missing++;
 #if 0
-				printf("could not read document id: %ld, err: %s [%d]\n",
-						min_it->indexed_id, err.message().c_str(), err.code());
+					printf("could not read document id: %ld, err: %s [%d]\n",
+							indexed_id.timestamp, err.message().c_str(), err.code());
 #endif
-				increment_all_iterators();
-				continue;
+					++driver.begin;
+					continue;
+				}
 			}
 			rs.doc.indexed_id = indexed_id;
 
-			// increment all iterators
-			increment_all_iterators();
+			// other iterators will be moved forward on the next iteration
+			++driver.begin;
 
 			if (!check(rs)) {
+				explain.check_rejected++;
+				continue;
+			}
+
+			res.count++;
+			if (aggr) {
+				aggr->insert(indexed_id);
+			}
+
+			if (iq.count_only || page_full) {
 				continue;
 			}
 
 			res.docs.emplace_back(rs);
-			if (res.docs.size() == iq.max_number)
-				break;
+			if (res.docs.size() == iq.max_number) {
+				if (!aggr)
+					break;
+
+				page_full = true;
+				page_next_document_id = res.next_document_id;
+			}
+		}
+
+		if (aggr) {
+			aggr->finish(res);
+		}
+
+		if (page_full) {
+			res.next_document_id = page_next_document_id;
+			res.completed = res.count == res.docs.size();
 		}
 
+		for (const auto &te: explain.tokens) {
+			res.timings.postings += te.stats.read_usec;
+		}
+		res.timings.intersection = std::max(0L, total_tm.elapsed() -
+				res.timings.shard_lookup - res.timings.postings - res.timings.documents);
 		return res;
 	}
+
+	search_result estimate(const intersection_query &iq) const {
+		return estimate(iq, [&] (single_doc_result &) -> bool {
+					return true;
+				});
+	}
+
+	// Estimates number of documents matching the query without reading posting lists.
+	// For every shard common for all query tokens the smallest per-shard document counter is taken,
+	// thus estimation is an upper bound, negation and exact phrase match are not taken into account.
+	//
+	// If some common shard has no known counter (shard lists written by older versions), documents are counted
+	// by intersection with @check, @search_result::estimated is not set in this case.
+	search_result estimate(const intersection_query &iq, check_result_function_t check) const {
+		usec_timer tm;
+		query_planner<DBT> planner(m_db_indexes);
+		auto plan = planner.build(iq);
+		if (!plan.estimate_known) {
+			return intersect(iq, check);
+		}
+
+		search_result res;
+		res.estimated = true;
+		res.count = plan.estimate;
+		res.timings.shard_lookup = tm.elapsed();
+
+		return res;
+	}
+
 private:
 	DBT &m_db_docs;
 	DBT &m_db_indexes;
@@ -13,16 +13,33 @@
 
 namespace ioremap { namespace greylock {
 
+// posting list reads and iterator movements, used to explain query execution
+struct iterator_stats {
+	size_t shards_loaded = 0;
+	size_t bytes_read = 0;
+	size_t ids_decoded = 0;
+	size_t rewinds = 0;
+
+	// shards read from mapped segments without decoding
+	size_t shards_mapped = 0;
+
+	// time spent reading and decoding posting lists, microseconds
+	long read_usec = 0;
+};
+
+// Posting lists are read by the database (@DBT::read_postings()) and are shared among iterator copies,
+// database implementation may also share them among different iterators (see @read_cache)
+// or return IDs stored in mapped segment files (see @segmented_database)
 template <typename DBT>
 class index_iterator {
 private:
-	disk_index m_current;
-	typename decltype(m_current.ids)::iterator m_idx_current, m_idx_end;
+	posting_list m_current;
+	const document_for_index *m_idx_current, *m_idx_end;
 public:
 	typedef index_iterator self_type;
 	typedef disk_index::value_type value_type;
-	typedef typename decltype(m_current.ids)::iterator::reference reference;
-	typedef typename decltype(m_current.ids)::iterator::pointer pointer;
+	typedef const document_for_index &reference;
+	typedef const document_for_index *pointer;
 	typedef std::forward_iterator_tag iterator_category;
 	typedef std::ptrdiff_t difference_type;
 
@@ -35,14 +52,15 @@ public:
 
 		return index_iterator(db, index_base, shards);
 	}
+	// if @stats is not null, posting list reads and rewinds of this iterator and its copies are accounted there
 	static index_iterator begin(DBT &db, const std::string &mbox, const std::string &attr, const std::string &token,
-			const std::vector<size_t> &shards) {
+			const std::vector<size_t> &shards, iterator_stats *stats = NULL) {
 		std::string index_base = document::generate_index_base(db.options(), mbox, attr, token);
 		if (shards.size() == 0) {
 			return end(db, index_base);
 		}
 
-		return index_iterator(db, index_base, shards);
+		return index_iterator(db, index_base, shards, stats);
 	}
 
 	static index_iterator end(DBT &db, const std::string &base) {
@@ -53,24 +71,16 @@ public:
 		return index_iterator(db, index_base);
 	}
 
+	// decoded posting list is immutable and shared, copy only takes a reference
 	index_iterator(const index_iterator &src): m_db(src.m_db) {
 		m_current = src.m_current;
-		if (src.m_idx_current == src.m_idx_end) {
-			m_idx_current = m_idx_end = m_current.ids.end();
-		} else {
-			typename decltype(src.m_current.ids)::const_iterator sib = src.m_current.ids.begin();
-			typename decltype(src.m_current.ids)::const_iterator sic = src.m_idx_current;
-
-			auto diff = std::distance(sib, sic);
-			dprintf("src: %s, diff: %ld\n", src.to_string().c_str(), diff);
-
-			m_idx_current = std::next(m_current.ids.begin(), diff);
-			m_idx_end = m_current.ids.end();
-		}
+		m_idx_current = src.m_idx_current;
+		m_idx_end = src.m_idx_end;
 
 		m_base = src.m_base;
 		m_shards = src.m_shards;
 		m_shards_idx = src.m_shards_idx;
+		m_stats = src.m_stats;
 	}
 
 	self_type &operator++() {
@@ -85,6 +95,10 @@ public:
 		size_t rewind_shard = document::generate_shard_number(m_db.options(), idx);
 		dprintf("rewind: %s, idx: %s, rewind_shard: %ld\n", to_string().c_str(), idx.to_string().c_str(), rewind_shard);
 
+		if (m_stats) {
+			m_stats->rewinds++;
+		}
+
 		auto rewind_shard_it = std::lower_bound(m_shards.begin(), m_shards.end(), rewind_shard);
 		if (rewind_shard_it == m_shards.end()) {
 			set_shard_index(-1);
@@ -125,12 +139,32 @@ public:
 	}
 
 	error_info document(DBT &db, document *doc) {
+		return document(db, doc, greylock::document::projection_full);
+	}
+
+	// reads document pointed to by this iterator, only fields required by @projection are unpacked
+	error_info document(DBT &db, greylock::document *doc, int projection) {
 		std::string doc_data;
 		auto err = db.read(greylock::options::documents_column, m_idx_current->indexed_id.to_string(), &doc_data);
 		if (err)
 			return err;
 
-		deserialize(*doc, doc_data.data(), doc_data.size());
+		try {
+			doc->unpack(greylock::unpack_object(doc_data.data(), doc_data.size()).get(), projection);
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EINVAL, "could not unpack document, indexed_id: %s, size: %ld, error: %s",
+					m_idx_current->indexed_id.to_string().c_str(), doc_data.size(), e.what());
+		}
+
+		// large content is stored separately and only read when full document has been requested
+		if (projection == greylock::document::projection_full && (doc->flags & greylock::document::flag_external_body)) {
+			err = db.read(greylock::options::bodies_column, m_idx_current->indexed_id.to_string(), &doc->ctx.content);
+			if (err) {
+				return greylock::create_error(err.code(), "could not read document body, indexed_id: %s, error: %s",
+						m_idx_current->indexed_id.to_string().c_str(), err.message().c_str());
+			}
+		}
+
 		return greylock::error_info();
 	}
 
@@ -148,7 +182,7 @@ public:
 		ss << "base: " << m_base <<
 			", next_shard_idx: " << m_shards_idx <<
 			", shards: [" << dump_shards() << "] " <<
-			", ids_size: " << m_current.ids.size() <<
+			", ids_size: " << m_current.size <<
 			", current_is_end: " << (m_idx_current == m_idx_end) <<
 			", indexed_id: " << ((m_idx_current == m_idx_end) ? "none" : m_idx_current->indexed_id.to_string());
 		return ss.str();
@@ -181,37 +215,42 @@ private:
 	std::string m_base;
 	std::vector<size_t> m_shards;
 	int m_shards_idx = -1;
+	iterator_stats *m_stats = NULL;
 
 	index_iterator(DBT &db, const std::string &base): m_db(db), m_base(base) {
+		reset_current();
 	}
 
-	index_iterator(DBT &db, const std::string &base, const std::vector<size_t> shards): m_db(db), m_base(base), m_shards(shards) {
+	index_iterator(DBT &db, const std::string &base, const std::vector<size_t> shards, iterator_stats *stats = NULL):
+		m_db(db), m_base(base), m_shards(shards), m_stats(stats) {
 		set_shard_index(0);
 		load_next();
 	}
 
+	void reset_current() {
+		m_current = posting_list();
+		m_idx_current = m_current.begin();
+		m_idx_end = m_current.end();
+	}
+
 	void set_shard_index(int idx) {
 		m_shards_idx = idx;
 		if (idx < 0) {
 			m_shards.clear();
 
-			m_current.ids.clear();
-			m_idx_current = m_current.ids.begin();
-			m_idx_end = m_current.ids.end();
+			reset_current();
 		}
 	}
 
 	void load_next() {
 		do {
 			load_next_one();
-		} while (m_shards_idx >= 0 && m_current.ids.empty());
+		} while (m_shards_idx >= 0 && m_current.empty());
 	}
 
 	void load_next_one() {
 		dprintf("loading: %s\n", to_string().c_str());
-		m_current.ids.clear();
-		m_idx_current = m_current.ids.begin();
-		m_idx_end = m_current.ids.end();
+		reset_current();
 
 		if (m_shards_idx < 0 || m_shards_idx >= (int)m_shards.size()) {
 			set_shard_index(-1);
@@ -219,23 +258,31 @@ private:
 		}
 
 		std::string key = document::generate_index_key_shard_number(m_base, m_shards[m_shards_idx]);
-		std::string data;
-		auto err = m_db.read(greylock::options::indexes_column, key, &data);
+		posting_list pl;
+		usec_timer tm;
+		auto err = m_db.read_postings(key, &pl);
+		if (m_stats) {
+			m_stats->read_usec += tm.elapsed();
+		}
 		if (err) {
 			set_shard_index(-1);
 			return;
 		}
 
-		try {
-			deserialize(m_current, data.data(), data.size());
-
-			m_idx_current = m_current.ids.begin();
-			m_idx_end = m_current.ids.end();
-		} catch (...) {
-			set_shard_index(-1);
-			return;
+		if (m_stats) {
+			m_stats->shards_loaded++;
+			m_stats->bytes_read += pl.encoded_size;
+			if (pl.decoded) {
+				m_stats->ids_decoded += pl.size;
+			} else {
+				m_stats->shards_mapped++;
+			}
 		}
 
+		m_current = pl;
+		m_idx_current = m_current.begin();
+		m_idx_end = m_current.end();
+
 		set_shard_index(m_shards_idx + 1);
 		dprintf("loaded: %s\n", to_string().c_str());
 	}
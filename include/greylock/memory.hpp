@@ -0,0 +1,367 @@
+#pragma once
+
+#include "greylock/database.hpp"
+#include "greylock/error.hpp"
+#include "greylock/types.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// In-memory database which implements the same read interface as @database,
+// it can be used as @DBT parameter of @intersector and @index_iterator.
+//
+// Every column is a sorted array searched with binary search, token shard lists and posting lists
+// are kept decoded, thus search does not unpack anything except documents.
+// Data is loaded from rocksdb databases (optionally only given mailboxes) and can be written back
+// in the same format, database is immutable after loading and concurrent reads do not need locking.
+class memory_database {
+public:
+	memory_database() {}
+	memory_database(const greylock::options &opts) : m_opts(opts) {}
+
+	const greylock::options &options() const {
+		return m_opts;
+	}
+
+	disk_token get_disk_token(const std::string &key) const {
+		auto t = m_tokens.find(key);
+		if (!t)
+			return disk_token();
+
+		return *t;
+	}
+
+	std::vector<size_t> get_shards(const std::string &key) const {
+		auto t = m_tokens.find(key);
+		if (!t)
+			return std::vector<size_t>();
+
+		return t->shards;
+	}
+
+	// returns at most @limit keys from @column which start with @prefix
+	std::vector<std::string> list_keys(int column, const std::string &prefix, size_t limit) const {
+		switch (column) {
+		case options::token_shards_column:
+			return m_tokens.list_keys(prefix, limit);
+		case options::indexes_column:
+			return m_indexes.list_keys(prefix, limit);
+		default:
+			if (column < 0 || column >= options::__column_size)
+				return std::vector<std::string>();
+
+			return m_columns[column].list_keys(prefix, limit);
+		}
+	}
+
+	// token shard lists and posting lists are serialized, other columns are returned as stored
+	greylock::error_info read(int column, const std::string &key, std::string *ret) const {
+		if (column == options::token_shards_column) {
+			auto t = m_tokens.find(key);
+			if (!t)
+				return not_found(column, key);
+
+			serialize(*t, ret);
+			return greylock::error_info();
+		}
+
+		if (column == options::indexes_column) {
+			auto idx = m_indexes.find(key);
+			if (!idx)
+				return not_found(column, key);
+
+			serialize(**idx, ret);
+			return greylock::error_info();
+		}
+
+		if (column < 0 || column >= options::__column_size) {
+			return greylock::create_error(-EINVAL, "invalid column %d", column);
+		}
+
+		auto v = m_columns[column].find(key);
+		if (!v)
+			return not_found(column, key);
+
+		ret->assign(*v);
+		return greylock::error_info();
+	}
+
+	greylock::error_info read_index(const std::string &key, std::shared_ptr<const disk_index> *ret) const {
+		auto idx = m_indexes.find(key);
+		if (!idx)
+			return not_found(options::indexes_column, key);
+
+		*ret = *idx;
+		return greylock::error_info();
+	}
+
+	greylock::error_info read_postings(const std::string &key, posting_list *ret) const {
+		auto idx = m_indexes.find(key);
+		if (!idx)
+			return not_found(options::indexes_column, key);
+
+		*ret = posting_list(*idx);
+		return greylock::error_info();
+	}
+
+	// IDs of deleted documents which were still present in loaded posting lists
+	std::shared_ptr<const std::set<id_t>> deleted_ids() const {
+		return m_deleted;
+	}
+
+	size_t num_documents() const {
+		return m_columns[options::documents_column].data.size();
+	}
+	size_t num_indexes() const {
+		return m_indexes.data.size();
+	}
+
+	// Loads posting lists, token shard lists and documents of the given @mailboxes, all mailboxes are loaded
+	// if array is empty. Only documents referenced by loaded posting lists are read, together with their bodies,
+	// ID mappings and forward index entries. Expired shards are skipped, previously loaded data is dropped.
+	greylock::error_info load(database &db_docs, database &db_indexes, const std::vector<std::string> &mailboxes) {
+		clear();
+		m_opts = db_indexes.options();
+		m_deleted = db_indexes.deleted_ids();
+
+		// empty mailbox name loads all keys
+		std::vector<std::string> mboxes(mailboxes);
+		if (mboxes.empty()) {
+			mboxes.emplace_back("");
+		}
+
+		std::vector<id_t> ids;
+		std::string key_mbox;
+		for (const auto &mbox: mboxes) {
+			std::string prefix = mbox.empty() ? mbox : mbox + ".";
+
+			// token shard key is the base of its posting list keys
+			for (const auto &key: db_indexes.list_keys(options::token_shards_column, prefix, ~0UL)) {
+				// prefix of mailbox 'a' also matches keys of mailbox 'a.b'
+				if (!mbox.empty() && (!document::parse_shard_key_mailbox(key, &key_mbox) || key_mbox != mbox))
+					continue;
+
+				disk_token dt = db_indexes.get_disk_token(key);
+				if (dt.shards.empty())
+					continue;
+
+				for (size_t shard: dt.shards) {
+					std::string ikey = document::generate_index_key_shard_number(key, shard);
+
+					std::shared_ptr<const disk_index> idx;
+					auto err = db_indexes.read_index(ikey, &idx);
+					if (err) {
+						if (err.code() == -rocksdb::Status::kNotFound)
+							continue;
+
+						return greylock::create_error(err.code(), "could not read posting list %s: %s",
+								ikey.c_str(), err.message().c_str());
+					}
+
+					for (const auto &did: idx->ids) {
+						ids.push_back(did.indexed_id);
+					}
+					m_indexes.data.emplace_back(ikey, idx);
+				}
+
+				m_tokens.data.emplace_back(key, std::move(dt));
+			}
+		}
+
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+		for (const auto &indexed_id: ids) {
+			std::string dkey = indexed_id.to_string();
+
+			std::string data;
+			auto err = db_docs.read(options::documents_column, dkey, &data);
+			if (err) {
+				// posting lists may reference removed documents until they are compacted
+				if (err.code() == -rocksdb::Status::kNotFound)
+					continue;
+
+				return greylock::create_error(err.code(), "could not read document %s: %s",
+						dkey.c_str(), err.message().c_str());
+			}
+
+			document doc;
+			err = deserialize_meta(doc, data);
+			if (err)
+				return err;
+
+			if (doc.flags & document::flag_external_body) {
+				std::string body;
+				err = db_docs.read(options::bodies_column, dkey, &body);
+				if (err) {
+					return greylock::create_error(err.code(), "could not read body of document %s: %s",
+							dkey.c_str(), err.message().c_str());
+				}
+				m_columns[options::bodies_column].data.emplace_back(dkey, std::move(body));
+			}
+
+			std::string fwd;
+			err = db_indexes.read(options::forward_column, dkey, &fwd);
+			if (!err) {
+				m_columns[options::forward_column].data.emplace_back(dkey, std::move(fwd));
+			}
+
+			m_columns[options::document_ids_column].data.emplace_back(doc.id, serialize(doc.indexed_id));
+			m_columns[options::documents_column].data.emplace_back(dkey, std::move(data));
+		}
+
+		m_tokens.sort();
+		m_indexes.sort();
+		for (auto &c: m_columns) {
+			c.sort();
+		}
+
+		return greylock::error_info();
+	}
+
+	// Writes all data into @db_docs and @db_indexes in the format used by @database,
+	// posting lists and token shard lists replace those already stored.
+	greylock::error_info snapshot(database &db_docs, database &db_indexes) const {
+		static const size_t batch_size = 16 * 1024 * 1024;
+
+		struct writer {
+			database &db;
+			rocksdb::WriteBatch batch;
+
+			writer(database &db) : db(db) {}
+
+			greylock::error_info put(int column, const std::string &key, const std::string &value) {
+				batch.Put(db.cfhandle(column), rocksdb::Slice(key), rocksdb::Slice(value));
+				if (batch.GetDataSize() < batch_size)
+					return greylock::error_info();
+
+				return flush();
+			}
+
+			greylock::error_info flush() {
+				auto err = db.write(&batch);
+				batch.Clear();
+				return err;
+			}
+		};
+
+		writer docs(db_docs), indexes(db_indexes);
+		greylock::error_info err;
+
+		for (int column: {options::documents_column, options::document_ids_column, options::bodies_column}) {
+			for (const auto &p: m_columns[column].data) {
+				err = docs.put(column, p.first, p.second);
+				if (err)
+					return err;
+			}
+		}
+		for (const auto &p: m_columns[options::forward_column].data) {
+			err = indexes.put(options::forward_column, p.first, p.second);
+			if (err)
+				return err;
+		}
+
+		std::string value;
+		for (const auto &p: m_tokens.data) {
+			serialize(p.second, &value);
+			err = indexes.put(options::token_shards_column, p.first, value);
+			if (err)
+				return err;
+		}
+		for (const auto &p: m_indexes.data) {
+			serialize(*p.second, &value);
+			err = indexes.put(options::indexes_column, p.first, value);
+			if (err)
+				return err;
+		}
+
+		// posting lists are written after documents, they must not reference missing documents
+		err = docs.flush();
+		if (err)
+			return err;
+
+		return indexes.flush();
+	}
+
+	void clear() {
+		m_deleted = std::make_shared<const std::set<id_t>>();
+		m_tokens.data.clear();
+		m_indexes.data.clear();
+		for (auto &c: m_columns) {
+			c.data.clear();
+		}
+	}
+
+private:
+	// array of (key, value) pairs sorted by key
+	template <typename T>
+	struct sorted_column {
+		std::vector<std::pair<std::string, T>> data;
+
+		void sort() {
+			std::sort(data.begin(), data.end(), [] (const std::pair<std::string, T> &a, const std::pair<std::string, T> &b) {
+					return a.first < b.first;
+				});
+		}
+
+		typename std::vector<std::pair<std::string, T>>::const_iterator lower_bound(const std::string &key) const {
+			return std::lower_bound(data.begin(), data.end(), key,
+					[] (const std::pair<std::string, T> &p, const std::string &k) {
+						return p.first < k;
+					});
+		}
+
+		const T *find(const std::string &key) const {
+			auto it = lower_bound(key);
+			if (it == data.end() || it->first != key)
+				return NULL;
+
+			return &it->second;
+		}
+
+		std::vector<std::string> list_keys(const std::string &prefix, size_t limit) const {
+			std::vector<std::string> keys;
+			for (auto it = lower_bound(prefix); it != data.end() && keys.size() < limit; ++it) {
+				if (it->first.compare(0, prefix.size(), prefix) != 0)
+					break;
+
+				keys.push_back(it->first);
+			}
+
+			return keys;
+		}
+	};
+
+	greylock::options m_opts;
+	std::shared_ptr<const std::set<id_t>> m_deleted = std::make_shared<const std::set<id_t>>();
+
+	sorted_column<disk_token> m_tokens;
+	sorted_column<std::shared_ptr<const disk_index>> m_indexes;
+
+	// raw values of the other columns, token shards and indexes entries are not used
+	sorted_column<std::string> m_columns[options::__column_size];
+
+	static greylock::error_info not_found(int column, const std::string &key) {
+		return greylock::create_error(-rocksdb::Status::kNotFound, "could not read key: %s, column: %d: not found",
+				key.c_str(), column);
+	}
+
+	static greylock::error_info deserialize_meta(document &doc, const std::string &data) {
+		try {
+			doc.unpack(unpack_object(data.data(), data.size()).get(), document::projection_meta);
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EINVAL, "could not unpack document, size: %ld, error: %s",
+					data.size(), e.what());
+		}
+
+		return greylock::error_info();
+	}
+};
+
+}} // namespace ioremap::greylock
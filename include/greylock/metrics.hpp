@@ -0,0 +1,196 @@
+#pragma once
+
+#include "greylock/database.hpp"
+
+#include <ctype.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Latency histogram with fixed exponential buckets, updates are lock-free.
+class latency_histogram {
+public:
+	// upper bounds of the buckets in microseconds, the last bucket is +Inf
+	static const std::vector<long> &bounds() {
+		static const std::vector<long> b = {
+			100, 250, 500,
+			1000, 2500, 5000,
+			10000, 25000, 50000,
+			100000, 250000, 500000,
+			1000000, 2500000, 5000000, 10000000,
+		};
+		return b;
+	}
+
+	latency_histogram() : m_buckets(bounds().size() + 1) {
+		for (auto &b: m_buckets) {
+			b = 0;
+		}
+	}
+
+	void observe(long usec) {
+		const auto &b = bounds();
+		size_t idx = std::lower_bound(b.begin(), b.end(), usec) - b.begin();
+
+		m_buckets[idx]++;
+		m_count++;
+		m_sum += usec;
+	}
+
+	// writes histogram in prometheus text format, buckets are cumulative and measured in seconds
+	void dump(std::ostream &out, const std::string &name, const std::string &labels) const {
+		const auto &b = bounds();
+		std::string sep = labels.empty() ? "" : ",";
+
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i < m_buckets.size(); ++i) {
+			cumulative += m_buckets[i];
+
+			out << name << "_bucket{" << labels << sep << "le=\"";
+			if (i < b.size()) {
+				out << b[i] / 1000000.;
+			} else {
+				out << "+Inf";
+			}
+			out << "\"} " << cumulative << "\n";
+		}
+
+		std::string l = labels.empty() ? "" : "{" + labels + "}";
+		out << name << "_sum" << l << " " << m_sum / 1000000. << "\n";
+		out << name << "_count" << l << " " << m_count << "\n";
+	}
+
+private:
+	std::vector<std::atomic<uint64_t>> m_buckets;
+	std::atomic<uint64_t> m_count{0};
+	std::atomic<uint64_t> m_sum{0};
+};
+
+// Process-wide metrics registry which is exported in prometheus text format.
+//
+// Histograms and counters are created on first use and are never removed,
+// returned references stay valid for the lifetime of the registry.
+class metrics {
+public:
+	latency_histogram &histogram(const std::string &name, const std::string &labels) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto &h = m_histograms[name][labels];
+		if (!h) {
+			h.reset(new latency_histogram);
+		}
+		return *h;
+	}
+
+	std::atomic<uint64_t> &counter(const std::string &name, const std::string &labels) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto &c = m_counters[name][labels];
+		if (!c) {
+			c.reset(new std::atomic<uint64_t>(0));
+		}
+		return *c;
+	}
+
+	void dump(std::ostream &out) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		for (const auto &p: m_histograms) {
+			out << "# TYPE " << p.first << " histogram\n";
+			for (const auto &h: p.second) {
+				h.second->dump(out, p.first, h.first);
+			}
+		}
+
+		for (const auto &p: m_counters) {
+			out << "# TYPE " << p.first << " counter\n";
+			for (const auto &c: p.second) {
+				out << p.first;
+				if (!c.first.empty())
+					out << "{" << c.first << "}";
+				out << " " << c.second->load() << "\n";
+			}
+		}
+	}
+
+	// Writes rocksdb tickers, histograms and per-column properties of @db,
+	// every metric gets db="@db_name" label.
+	static void dump_database(std::ostream &out, const std::string &db_name, database &db) {
+		std::string label = "db=\"" + db_name + "\"";
+
+		auto stats = db.statistics();
+		if (stats) {
+			uint64_t hit = 0, miss = 0;
+
+			for (const auto &t: rocksdb::TickersNameMap) {
+				uint64_t value = stats->getTickerCount(t.first);
+				if (t.first == rocksdb::BLOCK_CACHE_HIT)
+					hit = value;
+				if (t.first == rocksdb::BLOCK_CACHE_MISS)
+					miss = value;
+
+				out << metric_name(t.second) << "{" << label << "} " << value << "\n";
+			}
+
+			if (hit + miss != 0) {
+				out << "greylock_block_cache_hit_ratio{" << label << "} " << (double)hit / (hit + miss) << "\n";
+			}
+
+			for (const auto &h: rocksdb::HistogramsNameMap) {
+				rocksdb::HistogramData data;
+				stats->histogramData(h.first, &data);
+
+				std::string name = metric_name(h.second);
+				out << name << "{" << label << ",quantile=\"0.5\"} " << data.median << "\n";
+				out << name << "{" << label << ",quantile=\"0.95\"} " << data.percentile95 << "\n";
+				out << name << "{" << label << ",quantile=\"0.99\"} " << data.percentile99 << "\n";
+				out << name << "_avg{" << label << "} " << data.average << "\n";
+			}
+		}
+
+		static const std::vector<std::string> properties = {
+			"rocksdb.estimate-num-keys",
+			"rocksdb.num-entries-active-mem-table",
+			"rocksdb.num-immutable-mem-table",
+			"rocksdb.cur-size-all-mem-tables",
+			"rocksdb.estimate-pending-compaction-bytes",
+			"rocksdb.num-running-compactions",
+			"rocksdb.num-running-flushes",
+			"rocksdb.total-sst-files-size",
+		};
+
+		for (int column = 0; column < options::__column_size; ++column) {
+			std::string clabel = label + ",column=\"" + db.options().column_names[column] + "\"";
+
+			for (const auto &prop: properties) {
+				uint64_t value;
+				if (db.int_property(column, prop, &value)) {
+					out << metric_name(prop) << "{" << clabel << "} " << value << "\n";
+				}
+			}
+		}
+	}
+
+	// converts rocksdb statistics name into prometheus metric name
+	static std::string metric_name(const std::string &name) {
+		std::string ret = name;
+		for (auto &c: ret) {
+			if (!isalnum((unsigned char)c))
+				c = '_';
+		}
+		return ret;
+	}
+
+private:
+	std::mutex m_lock;
+	std::map<std::string, std::map<std::string, std::unique_ptr<latency_histogram>>> m_histograms;
+	std::map<std::string, std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>>> m_counters;
+};
+
+}} // namespace ioremap::greylock
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "greylock/batch.hpp"
+#include "greylock/error.hpp"
+#include "greylock/json.hpp"
+#include "greylock/types.hpp"
+#include "greylock/utils.hpp"
+
+#include <time.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Parses documents in the format accepted by indexing handler:
+// {
+//	"id": "document id",
+//	"author": "author",
+//	"timestamp": { "tsec": 1234567890, "tnsec": 0 },
+//	"content": { "content": "...", "title": "...", "links": [...], "images": [...] },
+//	"index": { "attribute": "text to index", ... }
+// }
+struct document_parser {
+	template <typename T>
+	static std::vector<T> get_numeric_vector(const rapidjson::Value &data, const char *name) {
+		std::vector<T> ret;
+		const auto &arr = greylock::get_array(data, name);
+		if (!arr.IsArray())
+			return ret;
+
+		for (auto it = arr.Begin(), end = arr.End(); it != end; it++) {
+			if (it->IsNumber())
+				ret.push_back((T)it->GetDouble());
+		}
+
+		return ret;
+	}
+
+	static std::vector<std::string> get_string_vector(const rapidjson::Value &ctx, const char *name) {
+		std::vector<std::string> ret;
+
+		const auto &a = greylock::get_array(ctx, name);
+		if (!a.IsArray())
+			return ret;
+
+		for (auto it = a.Begin(), end = a.End(); it != end; ++it) {
+			if (it->IsString())
+				ret.push_back(std::string(it->GetString(), it->GetStringLength()));
+		}
+
+		return ret;
+	}
+
+	static greylock::error_info parse_content(const rapidjson::Value &ctx, greylock::document &doc) {
+		doc.ctx.content = greylock::get_string(ctx, "content", "");
+		doc.ctx.title = greylock::get_string(ctx, "title", "");
+		doc.ctx.links = get_string_vector(ctx, "links");
+		doc.ctx.images = get_string_vector(ctx, "images");
+
+		return greylock::error_info();
+	}
+
+	// fills all document fields except indexes, @idxs is set to the object of attributes which have to be indexed,
+	// it has to be tokenized using @indexes::get_indexes()
+	static greylock::error_info parse(const std::string &mbox, const rapidjson::Value &val,
+			greylock::document &doc, const rapidjson::Value **idxs) {
+		if (!val.IsObject()) {
+			return greylock::create_error(-EINVAL, "docs entries must be objects");
+		}
+
+		const char *id = greylock::get_string(val, "id");
+		const char *author = greylock::get_string(val, "author");
+		if (!id) {
+			return greylock::create_error(-EINVAL, "id must be string");
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		long tsec, tnsec;
+		const rapidjson::Value &timestamp = greylock::get_object(val, "timestamp");
+		if (timestamp.IsObject()) {
+			tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
+			tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
+		} else {
+			tsec = ts.tv_sec;
+			tnsec = ts.tv_nsec;
+		}
+
+		doc.mbox = mbox;
+		doc.assign_id(id, std::hash<std::string>{}(id), tsec, tnsec);
+
+		if (author) {
+			doc.author.assign(author);
+		}
+
+		const rapidjson::Value &ctx = greylock::get_object(val, "content");
+		if (ctx.IsObject()) {
+			auto err = parse_content(ctx, doc);
+			if (err)
+				return err;
+		}
+
+		const rapidjson::Value &index = greylock::get_object(val, "index");
+		if (!index.IsObject()) {
+			return greylock::create_error(-EINVAL, "docs/index must be object");
+		}
+
+		*idxs = &index;
+		return greylock::error_info();
+	}
+
+	// parses array of documents, tokenizes them and puts into @batch, document with the same id is replaced,
+	// tokenization runs on the calling thread: requests are already prepared concurrently by pipeline parse threads
+	static greylock::error_info parse_docs(const greylock::options &options, const std::string &mbox,
+			const rapidjson::Value &docs, greylock::index_batch &batch) {
+		greylock::error_info err = greylock::create_error(-ENOENT,
+				"parse_docs: mbox: %s: could not parse document, there are no valid index entries", mbox.c_str());
+
+		std::vector<greylock::document> documents;
+		std::vector<std::string> serialized;
+		documents.reserve(docs.Size());
+		serialized.reserve(docs.Size());
+
+		for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
+			greylock::document doc;
+			const rapidjson::Value *idxs;
+
+			err = greylock::document_parser::parse(mbox, *it, doc, &idxs);
+			if (err)
+				return err;
+
+			doc.idx = greylock::indexes::get_indexes(options, *idxs);
+			serialized.emplace_back(greylock::index_batch::prepare(options, doc));
+			documents.emplace_back(std::move(doc));
+		}
+
+		if (documents.empty()) {
+			return err;
+		}
+
+		// document with the same id is replaced, its old postings are removed when batch is written
+		for (size_t i = 0; i < documents.size(); ++i) {
+			err = batch.remove(documents[i].id);
+			if (err)
+				return err;
+
+			batch.insert(documents[i], std::move(serialized[i]));
+		}
+
+		return greylock::error_info();
+	}
+
+	// parses indexing request body: {"mailbox": "mailbox name", "docs": [document, ...]}
+	// and puts all documents into @batch
+	static greylock::error_info parse_index_request(const greylock::options &options, const std::string &data,
+			greylock::index_batch &batch, std::string *mbox, size_t *num_docs) {
+		rapidjson::Document doc;
+		doc.Parse<0>(data.c_str());
+
+		if (doc.HasParseError()) {
+			return greylock::create_error(-EINVAL, "could not parse document: %s, error offset: %d",
+					doc.GetParseError(), doc.GetErrorOffset());
+		}
+
+		if (!doc.IsObject()) {
+			return greylock::create_error(-EINVAL, "document must be object, its type: %d", doc.GetType());
+		}
+
+		const char *m = greylock::get_string(doc, "mailbox");
+		if (!m) {
+			return greylock::create_error(-ENOENT, "'mailbox' must be a string");
+		}
+		mbox->assign(m);
+
+		const rapidjson::Value &docs = greylock::get_array(doc, "docs");
+		if (!docs.IsArray()) {
+			return greylock::create_error(-ENOENT, "mailbox: %s, 'docs' must be array", m);
+		}
+		*num_docs = docs.Size();
+
+		auto err = parse_docs(options, *mbox, docs, batch);
+		if (err) {
+			return greylock::create_error(err.code(), "mailbox: %s, keys: %ld: insertion error: %s",
+					m, *num_docs, err.message().c_str());
+		}
+
+		return greylock::error_info();
+	}
+};
+
+}} // namespace ioremap::greylock
@@ -0,0 +1,367 @@
+#pragma once
+
+#include "greylock/batch.hpp"
+#include "greylock/database.hpp"
+#include "greylock/error.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Bounded multi-producer multi-consumer queue.
+// After queue has been closed, push fails and pop returns remaining entries and then fails.
+template <typename T>
+class bounded_queue {
+public:
+	bounded_queue(size_t limit) : m_limit(limit) {}
+
+	// returns false if queue is full or closed
+	bool try_push(T &&t) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (m_closed || m_queue.size() >= m_limit)
+			return false;
+
+		m_queue.emplace_back(std::move(t));
+		m_pop_wait.notify_one();
+		return true;
+	}
+
+	// blocks until there is free space in the queue, returns false if queue is closed
+	bool push(T &&t) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_push_wait.wait(guard, [&] { return m_closed || m_queue.size() < m_limit; });
+		if (m_closed)
+			return false;
+
+		m_queue.emplace_back(std::move(t));
+		m_pop_wait.notify_one();
+		return true;
+	}
+
+	// blocks until there is at least one entry in the queue and moves at most @max entries into @ret,
+	// returns false if queue is closed and empty
+	bool pop(std::vector<T> &ret, size_t max) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_pop_wait.wait(guard, [&] { return m_closed || !m_queue.empty(); });
+		if (m_queue.empty())
+			return false;
+
+		while (!m_queue.empty() && ret.size() < max) {
+			ret.emplace_back(std::move(m_queue.front()));
+			m_queue.pop_front();
+		}
+
+		m_push_wait.notify_all();
+		return true;
+	}
+
+	void close() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_closed = true;
+		m_pop_wait.notify_all();
+		m_push_wait.notify_all();
+	}
+
+	size_t size() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		return m_queue.size();
+	}
+
+private:
+	size_t m_limit;
+	bool m_closed = false;
+	std::mutex m_lock;
+	std::condition_variable m_push_wait, m_pop_wait;
+	std::deque<T> m_queue;
+};
+
+struct pipeline_options {
+	// number of threads which parse and tokenize documents
+	int parse_threads = 4;
+	// number of threads which write prepared batches into the database,
+	// writes are serialized, removals are resolved against data written by the previous batches
+	int write_threads = 1;
+	// maximum number of requests waiting in every stage
+	size_t queue_size = 1024;
+	// maximum number of requests written using single batch
+	size_t group_commit_size = 128;
+
+	// invoked by writer thread with the number of failed requests, when write of the requests
+	// which have been acknowledged before write (@ingest_pipeline::ack_accepted) has failed
+	std::function<void (const greylock::error_info &, size_t)> write_error_handler;
+};
+
+// Staged ingestion pipeline.
+//
+// Requests are prepared (parsed and tokenized into @index_batch) on the pool of parse threads,
+// prepared batches are put into bounded queue and writer threads commit all batches which are waiting
+// in the queue using single write per database (group commit).
+//
+// Parse threads complete requests out of order, prepared batches are put into write queue in request order,
+// thus the later of two requests which update the same document always wins.
+//
+// Removed and replaced documents are looked up by the writer right before the batch is merged into group commit,
+// thus removals take into account all requests which have been written before.
+//
+// Every request selects acknowledgement level, completion callback is invoked either when request
+// has been prepared and queued for writing, when it has been written into memtable and write-ahead log,
+// or when write-ahead log has been synced to disk.
+class ingest_pipeline {
+public:
+	enum {
+		ack_accepted = 0,
+		ack_memtable,
+		ack_fsync,
+	};
+
+	// request state which is known only after its removals have been resolved by the writer,
+	// it is empty when request is completed at @ack_accepted level
+	struct result {
+		// number of removed documents, including replaced ones
+		size_t removed = 0;
+		// number of removed IDs which do not have stored documents
+		size_t missing = 0;
+	};
+
+	typedef std::function<greylock::error_info (index_batch &)> prepare_function_t;
+	typedef std::function<void (const greylock::error_info &, const result &)> completion_function_t;
+
+	ingest_pipeline(database &db_docs, database &db_indexes, const pipeline_options &opts) :
+		m_db_docs(db_docs),
+		m_db_indexes(db_indexes),
+		m_opts(opts),
+		m_parse_queue(opts.queue_size),
+		m_write_queue(opts.queue_size)
+	{
+		for (int i = 0; i < std::max(opts.parse_threads, 1); ++i) {
+			m_parse_threads.emplace_back(std::bind(&ingest_pipeline::parse_loop, this));
+		}
+		for (int i = 0; i < std::max(opts.write_threads, 1); ++i) {
+			m_write_threads.emplace_back(std::bind(&ingest_pipeline::write_loop, this));
+		}
+	}
+
+	~ingest_pipeline() {
+		stop();
+	}
+
+	// processes all queued requests and stops worker threads
+	void stop() {
+		m_parse_queue.close();
+		for (auto &t: m_parse_threads) {
+			if (t.joinable())
+				t.join();
+		}
+
+		m_write_queue.close();
+		for (auto &t: m_write_threads) {
+			if (t.joinable())
+				t.join();
+		}
+	}
+
+	// queues request, returns -EAGAIN error if pipeline is overloaded,
+	// @complete is not invoked in this case
+	greylock::error_info push(int ack, prepare_function_t prepare, completion_function_t complete) {
+		if (ack < ack_accepted || ack > ack_fsync) {
+			return greylock::create_error(-EINVAL, "invalid acknowledgement level %d", ack);
+		}
+
+		std::unique_ptr<task> t(new task);
+		t->ack = ack;
+		t->prepare = prepare;
+		t->complete = complete;
+
+		// sequence number is consumed only by queued request, writes wait for every number
+		std::unique_lock<std::mutex> guard(m_push_lock);
+		t->seq = m_push_seq;
+
+		if (!m_parse_queue.try_push(std::move(t))) {
+			return greylock::create_error(-EAGAIN, "ingestion queue is full, queued requests: %ld",
+					m_parse_queue.size());
+		}
+
+		m_push_seq++;
+		return greylock::error_info();
+	}
+
+	// number of failed writes of the requests which have been acknowledged before write
+	size_t write_errors() const {
+		return m_write_errors;
+	}
+
+	// number of requests waiting to be parsed or written
+	size_t queued() {
+		return m_parse_queue.size() + m_write_queue.size();
+	}
+
+	// parses acknowledgement level name, returns -1 if name is unknown
+	static int ack_from_string(const std::string &ack) {
+		if (ack == "accepted")
+			return ack_accepted;
+		if (ack == "memtable")
+			return ack_memtable;
+		if (ack == "fsync")
+			return ack_fsync;
+		return -1;
+	}
+
+private:
+	struct task {
+		size_t seq;
+		int ack;
+		prepare_function_t prepare;
+		completion_function_t complete;
+
+		std::unique_ptr<index_batch> batch;
+	};
+
+	database &m_db_docs;
+	database &m_db_indexes;
+	pipeline_options m_opts;
+
+	bounded_queue<std::unique_ptr<task>> m_parse_queue;
+	bounded_queue<std::unique_ptr<task>> m_write_queue;
+
+	std::vector<std::thread> m_parse_threads;
+	std::vector<std::thread> m_write_threads;
+
+	std::atomic<size_t> m_write_errors{0};
+
+	std::mutex m_push_lock;
+	size_t m_push_seq = 0;
+
+	// prepared requests which wait for the preceding ones, failed requests are stored as empty entries
+	std::mutex m_reorder_lock;
+	std::map<size_t, std::unique_ptr<task>> m_reorder;
+	size_t m_write_seq = 0;
+
+	// group commits are popped and written in queue order,
+	// removals are resolved against data written by the previous group commits
+	std::mutex m_commit_lock;
+
+	void parse_loop() {
+		std::vector<std::unique_ptr<task>> tasks;
+
+		while (m_parse_queue.pop(tasks, 1)) {
+			for (auto &t: tasks) {
+				size_t seq = t->seq;
+
+				// request must reach write queue even if it has failed, otherwise all following requests
+				// would wait for its sequence number forever
+				greylock::error_info err;
+				try {
+					t->batch.reset(new index_batch(m_db_docs, m_db_indexes));
+					err = t->prepare(*t->batch);
+				} catch (const std::bad_alloc &e) {
+					err = greylock::create_error(-ENOMEM, "could not prepare request: %s", e.what());
+				} catch (const std::exception &e) {
+					err = greylock::create_error(-EINVAL, "could not prepare request: %s", e.what());
+				}
+
+				if (err) {
+					t->complete(err, result());
+					t.reset();
+				} else if (t->ack == ack_accepted) {
+					t->complete(greylock::error_info(), result());
+				}
+
+				queue_write(seq, std::move(t));
+			}
+
+			tasks.clear();
+		}
+	}
+
+	// puts prepared request and all requests which wait for it into write queue
+	void queue_write(size_t seq, std::unique_ptr<task> &&t) {
+		std::unique_lock<std::mutex> guard(m_reorder_lock);
+		m_reorder.emplace(seq, std::move(t));
+
+		while (!m_reorder.empty() && m_reorder.begin()->first == m_write_seq) {
+			std::unique_ptr<task> next = std::move(m_reorder.begin()->second);
+			m_reorder.erase(m_reorder.begin());
+			m_write_seq++;
+
+			if (!next)
+				continue;
+
+			// blocks if writers can not keep up, this limits memory used by prepared batches
+			completion_function_t complete = next->complete;
+			int ack = next->ack;
+			if (!m_write_queue.push(std::move(next)) && ack != ack_accepted) {
+				complete(greylock::create_error(-ESHUTDOWN, "ingestion pipeline has been stopped"), result());
+			}
+		}
+	}
+
+	void write_loop() {
+		std::vector<std::unique_ptr<task>> tasks;
+
+		while (true) {
+			std::vector<result> results;
+			greylock::error_info err;
+
+			{
+				std::unique_lock<std::mutex> guard(m_commit_lock);
+
+				if (!m_write_queue.pop(tasks, m_opts.group_commit_size))
+					break;
+
+				results.resize(tasks.size());
+				index_batch batch(m_db_docs, m_db_indexes);
+				bool sync = false;
+
+				for (size_t i = 0; i < tasks.size(); ++i) {
+					auto &t = tasks[i];
+
+					err = batch.resolve(*t->batch);
+					if (err)
+						break;
+
+					results[i].removed = t->batch->removed_documents();
+					results[i].missing = t->batch->missing_documents();
+
+					batch.merge(*t->batch);
+					sync |= t->ack == ack_fsync;
+				}
+
+				if (!err) {
+					err = batch.write(sync);
+				}
+			}
+
+			size_t failed = 0;
+			for (size_t i = 0; i < tasks.size(); ++i) {
+				auto &t = tasks[i];
+				if (t->ack == ack_accepted) {
+					if (err)
+						failed++;
+					continue;
+				}
+
+				t->complete(err, results[i]);
+			}
+
+			// accepted requests have already been completed, error is reported only to the handler
+			if (failed) {
+				m_write_errors += failed;
+				if (m_opts.write_error_handler)
+					m_opts.write_error_handler(err, failed);
+			}
+
+			tasks.clear();
+		}
+	}
+};
+
+}} // namespace ioremap::greylock
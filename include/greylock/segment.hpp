@@ -0,0 +1,455 @@
+#pragma once
+
+#include "greylock/database.hpp"
+#include "greylock/error.hpp"
+#include "greylock/types.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Immutable segment holds posting lists of a range of frozen shards in a single file,
+// which is mapped into memory and used without decoding.
+//
+// File layout (all numbers are native-endian 64-bit integers):
+//	header
+//	posting lists: arrays of document IDs (@document_for_index), sorted
+//	dictionary: @segment_entry per posting list key, sorted by key
+//	keys: concatenated posting list keys
+//
+// Posting lists of frozen shards updated after segment has been written (late documents, removals)
+// are registered by the database (see @database::frozen_updated()), they are read from the database.
+// Updated shards can be written into a new segment to serve them from memory again.
+struct segment_header {
+	uint64_t magic;
+	uint64_t version;
+
+	// shards [@shard_start, @shard_end) are stored in this segment
+	uint64_t shard_start;
+	uint64_t shard_end;
+
+	uint64_t num_keys;
+	uint64_t dict_offset;
+	uint64_t keys_offset;
+	uint64_t size;
+};
+
+struct segment_entry {
+	// offset relative to @segment_header::keys_offset
+	uint64_t key_offset;
+	uint64_t key_size;
+
+	uint64_t ids_offset;
+	uint64_t ids_size;
+};
+
+static const uint64_t segment_magic = 0x31304745534c5247UL; // "GRLSEG01"
+static const uint64_t segment_version = 1;
+static const char segment_extension[] = ".seg";
+
+static_assert(sizeof(document_for_index) == sizeof(uint64_t), "document ID must be stored as single 64-bit integer");
+
+class segment : public std::enable_shared_from_this<segment> {
+public:
+	~segment() {
+		if (m_data) {
+			munmap(m_data, m_size);
+		}
+	}
+
+	// maps and verifies segment file, it is unmapped when segment and all posting lists read from it are destroyed
+	static greylock::error_info open(const std::string &path, std::shared_ptr<const segment> *ret) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return greylock::create_error(-errno, "could not open segment %s: %s", path.c_str(), strerror(errno));
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int err = -errno;
+			close(fd);
+			return greylock::create_error(err, "could not stat segment %s: %s", path.c_str(), strerror(-err));
+		}
+
+		if ((size_t)st.st_size < sizeof(segment_header)) {
+			close(fd);
+			return greylock::create_error(-EINVAL, "segment %s is too small: %ld bytes", path.c_str(), st.st_size);
+		}
+
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			return greylock::create_error(-errno, "could not map segment %s: %s", path.c_str(), strerror(errno));
+		}
+
+		std::shared_ptr<segment> seg(new segment(path, (char *)data, st.st_size));
+		auto err = seg->verify();
+		if (err)
+			return err;
+
+		*ret = seg;
+		return greylock::error_info();
+	}
+
+	const std::string &path() const {
+		return m_path;
+	}
+	size_t shard_start() const {
+		return header()->shard_start;
+	}
+	size_t shard_end() const {
+		return header()->shard_end;
+	}
+	size_t num_keys() const {
+		return header()->num_keys;
+	}
+	size_t size() const {
+		return m_size;
+	}
+
+	bool has_shard(size_t shard) const {
+		return shard >= shard_start() && shard < shard_end();
+	}
+
+	std::string key(size_t idx) const {
+		const segment_entry &e = entries()[idx];
+		return std::string(m_data + header()->keys_offset + e.key_offset, e.key_size);
+	}
+
+	// returns false if there is no posting list with given @key in this segment
+	bool find(const std::string &key, posting_list *ret) const {
+		const segment_entry *begin = entries();
+		const segment_entry *end = begin + num_keys();
+
+		auto it = std::lower_bound(begin, end, key, [&] (const segment_entry &e, const std::string &k) {
+				return k.compare(0, std::string::npos, m_data + header()->keys_offset + e.key_offset, e.key_size) > 0;
+			});
+		if (it == end)
+			return false;
+		if (key.compare(0, std::string::npos, m_data + header()->keys_offset + it->key_offset, it->key_size) != 0)
+			return false;
+
+		ret->owner = shared_from_this();
+		ret->ids = (const document_for_index *)(m_data + it->ids_offset);
+		ret->size = it->ids_size;
+		ret->encoded_size = it->ids_size * sizeof(document_for_index);
+		ret->decoded = false;
+		return true;
+	}
+
+private:
+	std::string m_path;
+	char *m_data;
+	size_t m_size;
+
+	segment(const std::string &path, char *data, size_t size) : m_path(path), m_data(data), m_size(size) {}
+
+	const segment_header *header() const {
+		return (const segment_header *)m_data;
+	}
+	const segment_entry *entries() const {
+		return (const segment_entry *)(m_data + header()->dict_offset);
+	}
+
+	// checks that every offset points inside the file, so that lookups do not have to check bounds
+	greylock::error_info verify() const {
+		const segment_header *h = header();
+
+		if (h->magic != segment_magic) {
+			return greylock::create_error(-EINVAL, "segment %s: invalid magic %lx", m_path.c_str(), h->magic);
+		}
+		if (h->version != segment_version) {
+			return greylock::create_error(-EINVAL, "segment %s: unsupported version %ld", m_path.c_str(), h->version);
+		}
+		if (h->size != m_size) {
+			return greylock::create_error(-EINVAL, "segment %s: size mismatch: header: %ld, file: %ld",
+					m_path.c_str(), h->size, m_size);
+		}
+		if (h->dict_offset % sizeof(uint64_t) != 0 || h->dict_offset > m_size ||
+				h->num_keys > (m_size - h->dict_offset) / sizeof(segment_entry) ||
+				h->keys_offset > m_size) {
+			return greylock::create_error(-EINVAL, "segment %s: invalid dictionary: offset: %ld, keys: %ld, keys offset: %ld",
+					m_path.c_str(), h->dict_offset, h->num_keys, h->keys_offset);
+		}
+
+		size_t keys_size = m_size - h->keys_offset;
+		const segment_entry *e = entries();
+		for (size_t i = 0; i < h->num_keys; ++i, ++e) {
+			if (e->key_offset > keys_size || e->key_size > keys_size - e->key_offset ||
+					e->ids_offset % sizeof(uint64_t) != 0 || e->ids_offset > m_size ||
+					e->ids_size > (m_size - e->ids_offset) / sizeof(document_for_index)) {
+				return greylock::create_error(-EINVAL, "segment %s: entry %ld is out of bounds", m_path.c_str(), i);
+			}
+		}
+
+		return greylock::error_info();
+	}
+};
+
+// Writes segment file, posting lists must be appended in key order.
+// Data is written into temporary file which is renamed when segment has been completed.
+class segment_writer {
+public:
+	~segment_writer() {
+		if (m_fd >= 0) {
+			close(m_fd);
+			unlink(m_tmp_path.c_str());
+		}
+	}
+
+	greylock::error_info open(const std::string &path, size_t shard_start, size_t shard_end) {
+		m_path = path;
+		m_tmp_path = path + ".tmp";
+
+		m_fd = ::open(m_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m_fd < 0) {
+			return greylock::create_error(-errno, "could not create segment %s: %s", m_tmp_path.c_str(), strerror(errno));
+		}
+
+		memset(&m_header, 0, sizeof(segment_header));
+		m_header.magic = segment_magic;
+		m_header.version = segment_version;
+		m_header.shard_start = shard_start;
+		m_header.shard_end = shard_end;
+
+		// header is rewritten when segment is completed
+		return write_data(&m_header, sizeof(segment_header));
+	}
+
+	greylock::error_info append(const std::string &key, const std::vector<document_for_index> &ids) {
+		if (!m_keys.empty() && key <= m_keys.back()) {
+			return greylock::create_error(-EINVAL, "segment %s: key %s is not greater than previous key %s",
+					m_path.c_str(), key.c_str(), m_keys.back().c_str());
+		}
+
+		segment_entry e;
+		e.key_offset = m_keys_size;
+		e.key_size = key.size();
+		e.ids_offset = m_offset;
+		e.ids_size = ids.size();
+
+		auto err = write_data(ids.data(), ids.size() * sizeof(document_for_index));
+		if (err)
+			return err;
+
+		m_entries.push_back(e);
+		m_keys.push_back(key);
+		m_keys_size += key.size();
+		return greylock::error_info();
+	}
+
+	size_t num_keys() const {
+		return m_keys.size();
+	}
+
+	// writes dictionary and header, syncs and renames file into its final name
+	greylock::error_info finish() {
+		m_header.num_keys = m_entries.size();
+		m_header.dict_offset = m_offset;
+
+		auto err = write_data(m_entries.data(), m_entries.size() * sizeof(segment_entry));
+		if (err)
+			return err;
+
+		m_header.keys_offset = m_offset;
+		for (const auto &key: m_keys) {
+			err = write_data(key.data(), key.size());
+			if (err)
+				return err;
+		}
+
+		m_header.size = m_offset;
+		if (pwrite(m_fd, &m_header, sizeof(segment_header), 0) != sizeof(segment_header)) {
+			return greylock::create_error(-errno, "could not write segment header %s: %s",
+					m_tmp_path.c_str(), strerror(errno));
+		}
+
+		if (fsync(m_fd) < 0) {
+			return greylock::create_error(-errno, "could not sync segment %s: %s", m_tmp_path.c_str(), strerror(errno));
+		}
+
+		close(m_fd);
+		m_fd = -1;
+
+		if (rename(m_tmp_path.c_str(), m_path.c_str()) < 0) {
+			int err = -errno;
+			unlink(m_tmp_path.c_str());
+			return greylock::create_error(err, "could not rename segment %s -> %s: %s",
+					m_tmp_path.c_str(), m_path.c_str(), strerror(-err));
+		}
+
+		return greylock::error_info();
+	}
+
+private:
+	std::string m_path, m_tmp_path;
+	int m_fd = -1;
+	uint64_t m_offset = 0;
+
+	segment_header m_header;
+	std::vector<segment_entry> m_entries;
+	std::vector<std::string> m_keys;
+	uint64_t m_keys_size = 0;
+
+	greylock::error_info write_data(const void *data, size_t size) {
+		const char *ptr = (const char *)data;
+		while (size) {
+			ssize_t written = write(m_fd, ptr, size);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+
+				return greylock::create_error(-errno, "could not write segment %s: %s",
+						m_tmp_path.c_str(), strerror(errno));
+			}
+
+			ptr += written;
+			size -= written;
+			m_offset += written;
+		}
+
+		return greylock::error_info();
+	}
+};
+
+// Set of non-overlapping segments sorted by shard range, it is immutable after it has been loaded.
+class segment_set {
+public:
+	// opens all segment files in @dir, missing directory is an empty set
+	greylock::error_info open(const std::string &dir) {
+		boost::system::error_code ec;
+		if (!boost::filesystem::exists(dir, ec) && !ec)
+			return greylock::error_info();
+
+		for (boost::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+			if (it->path().extension() != segment_extension)
+				continue;
+
+			std::shared_ptr<const segment> seg;
+			auto err = segment::open(it->path().string(), &seg);
+			if (err)
+				return err;
+
+			err = insert(seg);
+			if (err)
+				return err;
+		}
+
+		if (ec) {
+			return greylock::create_error(-ec.value(), "could not list segments in %s: %s",
+					dir.c_str(), ec.message().c_str());
+		}
+
+		return greylock::error_info();
+	}
+
+	greylock::error_info insert(const std::shared_ptr<const segment> &seg) {
+		auto it = std::lower_bound(m_segments.begin(), m_segments.end(), seg,
+				[] (const std::shared_ptr<const segment> &a, const std::shared_ptr<const segment> &b) {
+					return a->shard_start() < b->shard_start();
+				});
+
+		if ((it != m_segments.end() && (*it)->shard_start() < seg->shard_end()) ||
+				(it != m_segments.begin() && (*(it - 1))->shard_end() > seg->shard_start())) {
+			return greylock::create_error(-EEXIST, "segment %s [%ld, %ld) overlaps with already loaded segment",
+					seg->path().c_str(), seg->shard_start(), seg->shard_end());
+		}
+
+		m_segments.insert(it, seg);
+		return greylock::error_info();
+	}
+
+	// returns segment which contains @shard or NULL
+	const segment *find(size_t shard) const {
+		auto it = std::upper_bound(m_segments.begin(), m_segments.end(), shard,
+				[] (size_t s, const std::shared_ptr<const segment> &seg) {
+					return s < seg->shard_start();
+				});
+		if (it == m_segments.begin())
+			return NULL;
+
+		--it;
+		if (!(*it)->has_shard(shard))
+			return NULL;
+
+		return it->get();
+	}
+
+	const std::vector<std::shared_ptr<const segment>> &segments() const {
+		return m_segments;
+	}
+
+private:
+	std::vector<std::shared_ptr<const segment>> m_segments;
+};
+
+// Database wrapper which reads posting lists of frozen shards from mapped segments
+// and everything else from the underlying database, it can be used as @DBT parameter of @intersector.
+// Posting lists missing in segment or updated after segment has been created are read from the database.
+template <typename DBT>
+class segmented_database {
+public:
+	segmented_database(DBT &db, const std::shared_ptr<const segment_set> &segments) : m_db(db), m_segments(segments) {}
+
+	const greylock::options &options() const {
+		return m_db.options();
+	}
+
+	disk_token get_disk_token(const std::string &key) {
+		return m_db.get_disk_token(key);
+	}
+
+	std::vector<size_t> get_shards(const std::string &key) {
+		return m_db.get_shards(key);
+	}
+
+	std::vector<std::string> list_keys(int column, const std::string &prefix, size_t limit) {
+		return m_db.list_keys(column, prefix, limit);
+	}
+
+	greylock::error_info read(int column, const std::string &key, std::string *ret) {
+		return m_db.read(column, key, ret);
+	}
+
+	greylock::error_info read_index(const std::string &key, std::shared_ptr<const disk_index> *ret) {
+		return m_db.read_index(key, ret);
+	}
+
+	std::shared_ptr<const std::set<id_t>> deleted_ids() const {
+		return m_db.deleted_ids();
+	}
+
+	greylock::error_info read_postings(const std::string &key, posting_list *ret) {
+		if (m_segments) {
+			size_t shard;
+			if (document::parse_index_key_shard_number(key, &shard)) {
+				const segment *seg = m_segments->find(shard);
+				if (seg && !m_db.frozen_updated(key) && seg->find(key, ret))
+					return greylock::error_info();
+			}
+		}
+
+		return m_db.read_postings(key, ret);
+	}
+
+private:
+	DBT &m_db;
+	std::shared_ptr<const segment_set> m_segments;
+};
+
+}} // namespace ioremap::greylock
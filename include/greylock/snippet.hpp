@@ -0,0 +1,232 @@
+#pragma once
+
+#include <ctype.h>
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ribosome/html.hpp>
+#include <ribosome/lstring.hpp>
+
+namespace ioremap { namespace greylock {
+
+struct snippet_query {
+	// maximum number of fragments per document, 0 disables snippets
+	size_t max_fragments = 0;
+	// approximate size of every fragment in bytes
+	size_t fragment_size = 160;
+
+	// strings which surround matched words
+	std::string pre = "<b>";
+	std::string post = "</b>";
+
+	// names of the query attributes whose tokens are highlighted, empty means all attributes
+	std::vector<std::string> attributes;
+
+	bool empty() const {
+		return max_fragments == 0;
+	}
+};
+
+// Builds short fragments of document content around the words which match query tokens.
+//
+// Words shorter than @options::ngram_index_size are indexed only as concatenations with their neighbours,
+// thus pairs of adjacent words are matched against query tokens too.
+// Posting lists do not store token positions, thus content is scanned once per returned document,
+// which is cheap compared to sending the whole content to the client.
+// Fragment boundaries are aligned to word boundaries, all bytes of multibyte utf8 characters
+// are word characters, thus fragments never cut characters in the middle.
+class snippet_generator {
+public:
+	snippet_generator(const snippet_query &sq, const std::set<std::string> &tokens) : m_sq(sq), m_tokens(tokens) {}
+
+	// returns at most @max_fragments fragments, if nothing matches, the beginning of the content is returned
+	std::vector<std::string> generate(const std::string &content) const {
+		std::vector<std::string> ret;
+		if (m_sq.empty())
+			return ret;
+
+		std::string text = plain_text(content);
+		if (text.empty())
+			return ret;
+
+		std::vector<std::pair<size_t, size_t>> matches = find_matches(text);
+		if (matches.empty()) {
+			size_t end = align_end(text, std::min(text.size(), m_sq.fragment_size), 0);
+			ret.emplace_back(fragment(text, 0, end, matches, 0, 0));
+			return ret;
+		}
+
+		size_t covered = 0;
+		for (size_t i = 0; i < matches.size() && ret.size() < m_sq.max_fragments;) {
+			const auto &m = matches[i];
+
+			size_t start = m.first > m_sq.fragment_size / 2 ? m.first - m_sq.fragment_size / 2 : 0;
+			start = align_start(text, std::max(start, covered), m.first);
+
+			size_t end = std::max(m.second, std::min(text.size(), start + m_sq.fragment_size));
+			end = align_end(text, end, m.second);
+
+			size_t last = i;
+			while (last < matches.size() && matches[last].second <= end)
+				last++;
+
+			ret.emplace_back(fragment(text, start, end, matches, i, last));
+
+			covered = end;
+			i = last;
+		}
+
+		return ret;
+	}
+
+private:
+	const snippet_query &m_sq;
+	const std::set<std::string> &m_tokens;
+
+	static bool is_word(char c) {
+		return (c & 0x80) || isalnum((unsigned char)c);
+	}
+
+	// html markup is dropped, text chunks are joined with spaces
+	static std::string plain_text(const std::string &content) {
+		ribosome::html_parser html;
+		html.feed_text(content);
+
+		std::string ret;
+		ret.reserve(content.size());
+		for (const auto &t: html.tokens()) {
+			if (!ret.empty())
+				ret.push_back(' ');
+			ret.append(t);
+		}
+
+		return ret;
+	}
+
+	// returns byte ranges of the words and adjacent word pairs which match query tokens
+	std::vector<std::pair<size_t, size_t>> find_matches(const std::string &text) const {
+		// word byte range and its lowercase representation
+		std::vector<std::pair<size_t, size_t>> ranges;
+		std::vector<std::string> words;
+
+		size_t pos = 0;
+		while (pos < text.size()) {
+			while (pos < text.size() && !is_word(text[pos]))
+				pos++;
+
+			size_t start = pos;
+			bool ascii = true;
+			while (pos < text.size() && is_word(text[pos])) {
+				ascii &= !(text[pos] & 0x80);
+				pos++;
+			}
+
+			if (start == pos)
+				break;
+
+			std::string word;
+			if (ascii) {
+				word.assign(text, start, pos - start);
+				for (auto &c: word) {
+					c = tolower((unsigned char)c);
+				}
+			} else {
+				word = ribosome::lconvert::to_string(ribosome::lconvert::to_lower(
+							ribosome::lconvert::from_utf8(text.data() + start, pos - start)));
+			}
+
+			ranges.emplace_back(start, pos);
+			words.emplace_back(std::move(word));
+		}
+
+		std::vector<std::pair<size_t, size_t>> matches;
+		std::string ngram;
+		for (size_t i = 0; i < words.size(); ++i) {
+			size_t end = 0;
+			if (m_tokens.find(words[i]) != m_tokens.end()) {
+				end = ranges[i].second;
+			}
+
+			if (i + 1 < words.size()) {
+				ngram.assign(words[i]);
+				ngram.append(words[i + 1]);
+				if (m_tokens.find(ngram) != m_tokens.end()) {
+					end = ranges[i + 1].second;
+				}
+			}
+
+			if (end == 0)
+				continue;
+
+			// word pair overlaps with the previous match, they are highlighted together
+			if (!matches.empty() && matches.back().second >= ranges[i].first) {
+				matches.back().second = std::max(matches.back().second, end);
+			} else {
+				matches.emplace_back(ranges[i].first, end);
+			}
+		}
+
+		return matches;
+	}
+
+	// moves @pos forward to the beginning of the word, but not past @limit
+	static size_t align_start(const std::string &text, size_t pos, size_t limit) {
+		if (pos == 0 || !is_word(text[pos - 1]))
+			return pos;
+
+		while (pos < limit && is_word(text[pos]))
+			pos++;
+		while (pos < limit && !is_word(text[pos]))
+			pos++;
+
+		return pos;
+	}
+
+	// moves @pos back to the end of the previous word, but not before @limit
+	static size_t align_end(const std::string &text, size_t pos, size_t limit) {
+		if (pos == 0 || pos >= text.size() || !is_word(text[pos]) || !is_word(text[pos - 1]))
+			return pos;
+
+		size_t end = pos;
+		while (end > limit && is_word(text[end - 1]))
+			end--;
+
+		if (end > limit)
+			return end;
+
+		// the word at @limit is longer than fragment, it is not cut
+		while (pos < text.size() && is_word(text[pos]))
+			pos++;
+		return pos;
+	}
+
+	// returns text in [@start, @end) range with matches [@first, @last) highlighted
+	std::string fragment(const std::string &text, size_t start, size_t end,
+			const std::vector<std::pair<size_t, size_t>> &matches, size_t first, size_t last) const {
+		std::string ret;
+		ret.reserve(end - start + (last - first) * (m_sq.pre.size() + m_sq.post.size()) + 6);
+
+		if (start > 0)
+			ret.append("...");
+
+		size_t pos = start;
+		for (size_t i = first; i < last; ++i) {
+			ret.append(text, pos, matches[i].first - pos);
+			ret.append(m_sq.pre);
+			ret.append(text, matches[i].first, matches[i].second - matches[i].first);
+			ret.append(m_sq.post);
+			pos = matches[i].second;
+		}
+		ret.append(text, pos, end - pos);
+
+		if (end < text.size())
+			ret.append("...");
+
+		return ret;
+	}
+};
+
+}} // namespace ioremap::greylock
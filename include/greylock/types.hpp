@@ -13,6 +13,7 @@
 #include <set>
 #include <string>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include <ribosome/split.hpp>
@@ -49,9 +50,8 @@ struct attribute {
 					return t.name == tname;
 				});
 		if (it == tokens.end()) {
-			token t(tname);
-			t.insert_position(pos);
-			tokens.emplace_back(t);
+			tokens.emplace_back(tname);
+			tokens.back().insert_position(pos);
 			return;
 		}
 
@@ -63,9 +63,8 @@ struct attribute {
 					return t.name == tname;
 				});
 		if (it == tokens.end()) {
-			token t(tname);
-			t.insert_positions(positions);
-			tokens.emplace_back(t);
+			tokens.emplace_back(tname);
+			tokens.back().insert_positions(positions);
 			return;
 		}
 
@@ -73,6 +72,71 @@ struct attribute {
 	}
 };
 
+// Splits attribute text into tokens at indexing time.
+//
+// Every word is converted from lstring only once, n-grams of short words are concatenated in reusable buffer,
+// tokens are looked up using hash table instead of linear search over attribute tokens.
+// Tokenizer keeps its buffers between calls, it is not thread-safe.
+class tokenizer {
+public:
+	// appends tokens of @text to @a, which must not contain tokens yet
+	void tokenize(const greylock::options &options, const char *text, size_t size, attribute &a) {
+		std::vector<ribosome::lstring> words = m_split.convert_split_words(text, size);
+
+		m_words.resize(words.size());
+		m_sizes.resize(words.size());
+		for (size_t i = 0; i < words.size(); ++i) {
+			m_words[i] = ribosome::lconvert::to_string(words[i]);
+			m_sizes[i] = words[i].size();
+		}
+
+		m_lookup.clear();
+		m_lookup.reserve(words.size());
+
+		for (size_t pos = 0; pos < m_words.size(); ++pos) {
+			if (m_sizes[pos] >= options.ngram_index_size) {
+				insert(a, m_words[pos], pos);
+				continue;
+			}
+
+			// utf8 representation of concatenated words is concatenation of their utf8 representations
+			if (pos > 0) {
+				m_ngram.assign(m_words[pos - 1]);
+				m_ngram.append(m_words[pos]);
+				insert(a, m_ngram, pos);
+			}
+
+			if (pos < m_words.size() - 1) {
+				m_ngram.assign(m_words[pos]);
+				m_ngram.append(m_words[pos + 1]);
+				insert(a, m_ngram, pos);
+			}
+		}
+	}
+
+private:
+	ribosome::split m_split;
+
+	std::vector<std::string> m_words;
+	std::vector<size_t> m_sizes;
+	std::string m_ngram;
+
+	// token name -> token offset in attribute
+	std::unordered_map<std::string, size_t> m_lookup;
+
+	void insert(attribute &a, const std::string &name, pos_t pos) {
+		auto it = m_lookup.find(name);
+		if (it != m_lookup.end()) {
+			a.tokens[it->second].insert_position(pos);
+			return;
+		}
+
+		m_lookup.emplace(name, a.tokens.size());
+		a.tokens.emplace_back(name);
+		a.tokens.back().insert_position(pos);
+	}
+};
+
 struct indexes {
 	std::vector<attribute> attributes;
 	std::vector<attribute> exact;
@@ -153,7 +217,9 @@ struct indexes {
 		if (!idxs.IsObject())
 			return ireq;
 
-		ribosome::split spl;
+		// buffers are reused across attributes and documents tokenized by the same thread
+		static thread_local tokenizer tok;
+
 		for (rapidjson::Value::ConstMemberIterator it = idxs.MemberBegin(), idxs_end = idxs.MemberEnd(); it != idxs_end; ++it) {
 			const char *aname = it->name.GetString();
 			const rapidjson::Value &avalue = it->value;
@@ -162,27 +228,9 @@ struct indexes {
 				continue;
 
 			greylock::attribute a(aname);
+			tok.tokenize(options, avalue.GetString(), avalue.GetStringLength(), a);
 
-			std::vector<ribosome::lstring> indexes =
-				spl.convert_split_words(avalue.GetString(), avalue.GetStringLength());
-			for (size_t pos = 0; pos < indexes.size(); ++pos) {
-				auto &idx = indexes[pos];
-				if (idx.size() >= options.ngram_index_size) {
-					a.insert(ribosome::lconvert::to_string(idx), pos);
-				} else {
-					if (pos > 0) {
-						auto &prev = indexes[pos - 1];
-						a.insert(ribosome::lconvert::to_string(prev + idx), pos);
-					}
-
-					if (pos < indexes.size() - 1) {
-						auto &next = indexes[pos + 1];
-						a.insert(ribosome::lconvert::to_string(idx + next), pos);
-					}
-				}
-			}
-
-			ireq.attributes.emplace_back(a);
+			ireq.attributes.emplace_back(std::move(a));
 		}
 
 		return ireq;
@@ -206,10 +254,36 @@ struct document {
 		serialize_version_7 = 7,
 	};
 
+	// Which part of the document has to be read from the storage and sent to client.
+	// @projection_ids does not read document at all, only posting data (indexed ID) is used,
+	// @projection_meta converts identifiers, author and title, content, links and images are skipped.
+	enum {
+		projection_ids = 0,
+		projection_meta,
+		projection_full,
+	};
+
+	static int projection_from_string(const std::string &name) {
+		if (name == "ids")
+			return document::projection_ids;
+		if (name == "meta")
+			return document::projection_meta;
+		if (name == "full")
+			return document::projection_full;
+
+		return -1;
+	}
+
 	std::string mbox;
 
 	bool is_comment = false;
 
+	enum {
+		// content is stored in bodies column, document itself is packed with empty content
+		flag_external_body = 1,
+	};
+	uint32_t flags = 0;
+
 	std::string author;
 	std::string id;
 
@@ -226,10 +300,16 @@ struct document {
 		o.pack(ctx);
 		o.pack(id);
 		o.pack(indexed_id);
-		o.pack(0); // unused
+		o.pack(flags);
 	}
 
 	void msgpack_unpack(msgpack::object o) {
+		unpack(o, document::projection_full);
+	}
+
+	// unpacks only those fields which are required by @projection,
+	// large content, links and images are not converted unless full projection is requested
+	void unpack(msgpack::object o, int projection) {
 		if (o.type != msgpack::type::ARRAY) {
 			std::ostringstream ss;
 			ss << "could not unpack document, object type is " << o.type <<
@@ -252,10 +332,15 @@ struct document {
 		case document::serialize_version_7:
 			p[1].convert(&is_comment);
 			p[2].convert(&author);
-			p[3].convert(&ctx);
+			if (projection == document::projection_full) {
+				p[3].convert(&ctx);
+			} else {
+				unpack_title(p[3]);
+			}
 			p[4].convert(&id);
 			p[5].convert(&indexed_id);
-			//p[6].convert(); unused
+			// older documents have 0 in this field
+			p[6].convert(&flags);
 			break;
 		default: {
 			std::ostringstream ss;
@@ -265,6 +350,18 @@ struct document {
 		}
 	}
 
+	// content is packed as [content, title, links, images] array, only title is converted
+	void unpack_title(const msgpack::object &o) {
+		if (o.type != msgpack::type::ARRAY || o.via.array.size < 2) {
+			std::ostringstream ss;
+			ss << "could not unpack document title, content object type is " << o.type <<
+				", must be array (" << msgpack::type::ARRAY << ") of at least 2 elements";
+			throw std::runtime_error(ss.str());
+		}
+
+		o.via.array.ptr[1].convert(&ctx.title);
+	}
+
 	void assign_id(const char *cid, long seq, long tsec, long tnsec) {
 		id.assign(cid);
 		(void) tnsec;
@@ -307,6 +404,15 @@ struct document {
 
 		return std::string(ckey, csize);
 	}
+	// parses shard number of the key generated by @generate_index_key_shard_number()
+	static bool parse_index_key_shard_number(const std::string &key, size_t *sn) {
+		if (key.size() < 17 || key[16] != '.')
+			return false;
+
+		char *end;
+		*sn = strtoul(key.substr(0, 16).c_str(), &end, 16);
+		return *end == '\0';
+	}
 	static std::string generate_index_key(const options &options, const std::string &base, const id_t &indexed_id) {
 		size_t shard_number = generate_shard_number(options, indexed_id);
 		return generate_index_key_shard_number(base, shard_number);
@@ -322,6 +428,20 @@ struct document {
 			const std::string &mbox, const std::string &attr, const std::string &token) {
 		return generate_index_base(options, mbox, attr, token);
 	}
+	// parses mailbox of the key generated by @generate_shard_key(), mailbox name may contain dots,
+	// attribute names and tokens (words split at non-word characters) do not
+	static bool parse_shard_key_mailbox(const std::string &key, std::string *mbox) {
+		size_t token_pos = key.rfind('.');
+		if (token_pos == std::string::npos || token_pos == 0)
+			return false;
+
+		size_t attr_pos = key.rfind('.', token_pos - 1);
+		if (attr_pos == std::string::npos)
+			return false;
+
+		mbox->assign(key, 0, attr_pos);
+		return true;
+	}
 };
 
 }} // namespace ioremap::greylock
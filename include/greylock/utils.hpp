@@ -2,8 +2,16 @@
 
 #include "greylock/error.hpp"
 
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include <msgpack.hpp>
@@ -34,29 +42,174 @@ std::string dump_vector(const std::vector<T> &vec, std::function<std::string (co
 	return ss.str();
 }
 
+// Monotonic timer with microsecond resolution, used for per-stage request timings.
+class usec_timer {
+public:
+	usec_timer() : m_start(std::chrono::steady_clock::now()) {}
+
+	long elapsed() const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+	}
+
+	long restart() {
+		auto now = std::chrono::steady_clock::now();
+		long ret = std::chrono::duration_cast<std::chrono::microseconds>(now - m_start).count();
+		m_start = now;
+		return ret;
+	}
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// Calls @func(i) for every i in [0, @num) using at most @max_threads threads including the calling one.
+// Indexes are handed out one by one, thus threads which got cheap items take more work.
+template <typename Func>
+void parallel_for(size_t num, size_t max_threads, Func func) {
+	std::atomic_size_t next(0);
+
+	auto worker = [&] () {
+		while (true) {
+			size_t idx = next++;
+			if (idx >= num)
+				break;
+
+			func(idx);
+		}
+	};
+
+	size_t num_threads = std::max<size_t>(std::min(num, max_threads), 1);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < num_threads; ++i) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto &t: threads) {
+		t.join();
+	}
+}
+
+// Per-thread buffers reused by @serialize(), @deserialize() and @unpack_object(),
+// serialization into already grown buffer does not allocate.
+struct serialize_buffers {
+	// buffers which have grown larger are released after use, so that a single huge value
+	// does not pin memory in every thread which has ever packed it
+	static const size_t max_retained_size = 8 * 1024 * 1024;
+
+	msgpack::sbuffer buffer;
+	msgpack::zone zone;
+	// set while @zone holds object referenced by alive @unpacked_object
+	bool zone_used = false;
+
+	static serialize_buffers &get() {
+		static thread_local serialize_buffers buffers;
+		return buffers;
+	}
+};
+
+// Object unpacked by @unpack_object(), strings and binary objects reference unpacked data without copying,
+// thus data must outlive the handle.
+// Object is allocated in per-thread zone, which is reused after the handle has been destroyed,
+// object unpacked while another handle is alive in the same thread gets its own zone.
+class unpacked_object {
+public:
+	unpacked_object(const char *data, size_t size) {
+		serialize_buffers &buffers = serialize_buffers::get();
+		if (buffers.zone_used) {
+			m_own.reset(new msgpack::zone());
+			m_zone = m_own.get();
+		} else {
+			buffers.zone.clear();
+			buffers.zone_used = true;
+			m_zone = &buffers.zone;
+		}
+
+		try {
+			size_t offset = 0;
+			m_obj = msgpack::unpack(*m_zone, data, size, offset, reference, NULL);
+		} catch (...) {
+			release();
+			throw;
+		}
+	}
+
+	unpacked_object(unpacked_object &&other) : m_obj(other.m_obj), m_zone(other.m_zone), m_own(std::move(other.m_own)) {
+		other.m_zone = NULL;
+	}
+
+	unpacked_object(const unpacked_object &) = delete;
+	unpacked_object &operator=(const unpacked_object &) = delete;
+
+	~unpacked_object() {
+		release();
+	}
+
+	const msgpack::object &get() const {
+		return m_obj;
+	}
+
+private:
+	msgpack::object m_obj;
+	msgpack::zone *m_zone = NULL;
+	std::unique_ptr<msgpack::zone> m_own;
+
+	// strings, binary and extension objects are never copied into zone
+	static bool reference(msgpack::type::object_type, std::size_t, void *) {
+		return true;
+	}
+
+	void release() {
+		if (m_zone && !m_own) {
+			serialize_buffers::get().zone_used = false;
+		}
+		m_zone = NULL;
+	}
+};
+
+// Unpacks @data, returned object is valid while both @data and returned handle are alive.
+inline unpacked_object unpack_object(const char *data, size_t size) {
+	return unpacked_object(data, size);
+}
+
 template <typename T>
 greylock::error_info deserialize(T &t, const char *data, size_t size) {
-	msgpack::unpacked msg;
 	try {
-		msgpack::unpack(&msg, data, size);
-
-		msg.get().convert(&t);
+		unpacked_object obj(data, size);
+		try {
+			obj.get().convert(&t);
+		} catch (const std::exception &e) {
+			std::ostringstream ss;
+			ss << obj.get();
+			return greylock::create_error(-EINVAL, "could not unpack data, size: %ld, value: %s, error: %s",
+					size, ss.str().c_str(), e.what());
+		}
 	} catch (const std::exception &e) {
-		std::ostringstream ss;
-		ss << msg.get();
-		return greylock::create_error(-EINVAL, "could not unpack data, size: %ld, value: %s, error: %s",
-				size, ss.str().c_str(), e.what());
+		return greylock::create_error(-EINVAL, "could not unpack data, size: %ld, error: %s",
+				size, e.what());
 	}
 
 	return greylock::error_info();
 }
 
+// packs @t into @ret, memory already allocated by @ret is reused
 template <typename T>
-std::string serialize(const T &t) {
-	std::stringstream buffer;
+void serialize(const T &t, std::string *ret) {
+	msgpack::sbuffer &buffer = serialize_buffers::get().buffer;
+	buffer.clear();
+
 	msgpack::pack(buffer, t);
-	buffer.seekg(0);
-	return buffer.str();
+	ret->assign(buffer.data(), buffer.size());
+
+	if (buffer.size() > serialize_buffers::max_retained_size) {
+		::free(buffer.release());
+	}
+}
+
+template <typename T>
+std::string serialize(const T &t) {
+	std::string ret;
+	serialize(t, &ret);
+	return ret;
 }
 
 }} // namesapce ioremap::greylock
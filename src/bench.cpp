@@ -0,0 +1,449 @@
+#include "greylock/batch.hpp"
+#include "greylock/database.hpp"
+#include "greylock/intersection.hpp"
+#include "greylock/iterator.hpp"
+#include "greylock/memory.hpp"
+#include "greylock/types.hpp"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <benchmark/benchmark.h>
+#include <boost/filesystem.hpp>
+
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+
+using namespace ioremap;
+
+// Micro-benchmarks of the merge, serialization and search hot paths.
+//
+// Search benchmarks run over synthetic corpora stored in temporary rocksdb databases,
+// corpora are created once per term frequency skew and removed at exit.
+// Databases are created in $GREYLOCK_BENCH_DIR or /tmp.
+
+namespace {
+
+static const std::string bench_mbox = "bench";
+static const std::string bench_attr = "content";
+
+// term names are longer than any n-gram size, thus query tokenizer produces them as is
+static std::string term_name(size_t rank) {
+	char name[32];
+	snprintf(name, sizeof(name), "term%08zu", rank);
+	return name;
+}
+
+static std::vector<greylock::document_for_index> generate_ids(size_t num, size_t start_tsec, std::mt19937_64 &rng) {
+	std::vector<greylock::document_for_index> ids(num);
+
+	size_t tsec = start_tsec;
+	for (auto &did: ids) {
+		tsec += 1 + rng() % 16;
+		did.indexed_id.set_timestamp(tsec, rng() % 1024);
+	}
+
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+static greylock::document generate_document(size_t content_size, std::mt19937_64 &rng) {
+	greylock::document doc;
+	doc.mbox = bench_mbox;
+	doc.author = "author";
+	doc.assign_id(std::to_string(rng()).c_str(), rng() % 1024, 1000000 + rng() % 1000000, 0);
+
+	doc.ctx.title = "document title";
+	while (doc.ctx.content.size() < content_size) {
+		doc.ctx.content += term_name(rng() % 10000) + " ";
+	}
+	doc.ctx.links.emplace_back("http://example.com/link");
+
+	return doc;
+}
+
+// Documents with @terms_per_doc terms each, terms are drawn from Zipf-like distribution
+// with exponent @skew over @vocabulary terms, term of rank 0 is the most frequent one.
+// Documents are spread over @days shards.
+class corpus {
+public:
+	corpus(double skew) {
+		const char *base = getenv("GREYLOCK_BENCH_DIR");
+		std::string tmpl = std::string(base ? base : "/tmp") + "/greylock_bench.XXXXXX";
+
+		std::vector<char> path(tmpl.begin(), tmpl.end());
+		path.push_back('\0');
+		if (!mkdtemp(path.data())) {
+			throw std::runtime_error("could not create temporary directory " + tmpl + ": " + strerror(errno));
+		}
+		m_dir.path = path.data();
+
+		check(m_db_docs.open_read_write(m_dir.path + "/docs"));
+		check(m_db_indexes.open_read_write(m_dir.path + "/indexes"));
+
+		std::vector<double> weights(vocabulary);
+		for (size_t i = 0; i < vocabulary; ++i) {
+			weights[i] = 1.0 / pow(i + 1, skew);
+		}
+		std::discrete_distribution<size_t> terms(weights.begin(), weights.end());
+		std::mt19937_64 rng((uint64_t)(skew * 1000));
+
+		size_t seconds = days * m_db_indexes.options().tokens_shard_size;
+
+		for (size_t i = 0; i < num_documents;) {
+			greylock::index_batch batch(m_db_docs, m_db_indexes);
+
+			for (size_t j = 0; j < batch_size && i < num_documents; ++j, ++i) {
+				greylock::document doc;
+				doc.mbox = bench_mbox;
+				doc.author = "author";
+				doc.assign_id(std::to_string(i).c_str(), i, start_tsec + i * seconds / num_documents, 0);
+
+				greylock::attribute a(bench_attr);
+				for (size_t k = 0; k < terms_per_doc; ++k) {
+					std::string name = term_name(terms(rng));
+					a.insert(name, k);
+
+					doc.ctx.content += name + " ";
+				}
+				doc.ctx.title = "document " + std::to_string(i);
+				doc.idx.attributes.emplace_back(std::move(a));
+
+				batch.insert(doc);
+			}
+
+			check(batch.write());
+		}
+
+		m_db_docs.compact();
+		m_db_indexes.compact();
+	}
+
+	greylock::database &db_docs() {
+		return m_db_docs;
+	}
+	greylock::database &db_indexes() {
+		return m_db_indexes;
+	}
+
+	// the whole corpus loaded into memory, it is loaded on first use
+	greylock::memory_database &db_memory() {
+		if (!m_db_memory.num_indexes()) {
+			check(m_db_memory.load(m_db_docs, m_db_indexes, std::vector<std::string>()));
+		}
+		return m_db_memory;
+	}
+
+	// returns corpus for given skew, it is created on first use
+	static corpus &get(double skew) {
+		static std::map<double, std::unique_ptr<corpus>> corpora;
+
+		auto &c = corpora[skew];
+		if (!c) {
+			c.reset(new corpus(skew));
+		}
+		return *c;
+	}
+
+	static const size_t num_documents = 100000;
+	static const size_t terms_per_doc = 32;
+	static const size_t vocabulary = 50000;
+	static const size_t days = 16;
+	static const size_t start_tsec = 1000000000;
+	static const size_t batch_size = 1000;
+
+private:
+	// directory is removed after databases have been closed
+	struct temp_dir {
+		std::string path;
+
+		~temp_dir() {
+			boost::system::error_code ec;
+			boost::filesystem::remove_all(path, ec);
+		}
+	} m_dir;
+
+	greylock::database m_db_docs, m_db_indexes;
+	greylock::memory_database m_db_memory;
+
+	static void check(const greylock::error_info &err) {
+		if (err) {
+			throw std::runtime_error(err.message());
+		}
+	}
+};
+
+// query of two terms with given frequency ranks
+static greylock::intersection_query make_query(greylock::database &db, size_t rank1, size_t rank2, int projection) {
+	std::string json = "{\"query\": {\"" + bench_attr + "\": \"" + term_name(rank1) + " " + term_name(rank2) + "\"}}";
+
+	rapidjson::Document doc;
+	doc.Parse<0>(json.c_str());
+
+	greylock::mailbox_query mq(db.options(), doc);
+	mq.mbox = bench_mbox;
+
+	greylock::intersection_query iq;
+	iq.range_start.set_timestamp(0, 0);
+	iq.range_end.set_timestamp(LONG_MAX, 0);
+	iq.max_number = 100;
+	iq.projection = projection;
+	iq.se.emplace_back(std::move(mq));
+
+	return iq;
+}
+
+// skew is passed as integer percent, since benchmark arguments are integers
+static double skew_arg(const benchmark::State &state, int idx) {
+	return state.range(idx) / 100.;
+}
+
+} // namespace
+
+// merges @range(0) operands of @range(1) IDs each into existing posting list of the same size
+static void BM_merge_indexes(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+	greylock::indexes_merge_operator op;
+
+	greylock::disk_index old;
+	old.ids = generate_ids(state.range(1), 0, rng);
+	std::string old_value = greylock::serialize(old);
+	rocksdb::Slice old_slice(old_value);
+
+	std::deque<std::string> operands;
+	for (int i = 0; i < state.range(0); ++i) {
+		greylock::disk_index idx;
+		idx.ids = generate_ids(state.range(1), rng() % 1000000, rng);
+		operands.emplace_back(greylock::serialize(idx));
+	}
+
+	std::string new_value;
+	for (auto _: state) {
+		bool ok = op.merge_indexes(rocksdb::Slice("key"), &old_slice, operands, &new_value, NULL);
+		benchmark::DoNotOptimize(ok);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(1));
+}
+BENCHMARK(BM_merge_indexes)->ArgsProduct({{1, 16, 128}, {16, 1024, 65536}});
+
+// merges @range(0) shard list operands into shard list of @range(1) shards
+static void BM_merge_token_shards(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+	greylock::token_shards_merge_operator op;
+
+	std::vector<size_t> shards(state.range(1));
+	for (size_t i = 0; i < shards.size(); ++i) {
+		shards[i] = i;
+	}
+	greylock::disk_token old(shards);
+	old.counts.assign(shards.size(), 10);
+	std::string old_value = greylock::serialize(old);
+	rocksdb::Slice old_slice(old_value);
+
+	std::deque<std::string> operands;
+	for (int i = 0; i < state.range(0); ++i) {
+		std::set<size_t> s = {shards.size() + rng() % 16};
+		operands.emplace_back(greylock::serialize(greylock::disk_token(s)));
+	}
+
+	std::string new_value;
+	for (auto _: state) {
+		bool ok = op.merge_token_shards(rocksdb::Slice("key"), &old_slice, operands, &new_value, NULL);
+		benchmark::DoNotOptimize(ok);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_merge_token_shards)->ArgsProduct({{1, 16, 128}, {16, 1024}});
+
+static void BM_serialize_disk_index(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+
+	greylock::disk_index idx;
+	idx.ids = generate_ids(state.range(0), 0, rng);
+
+	std::string data;
+	for (auto _: state) {
+		greylock::serialize(idx, &data);
+		benchmark::DoNotOptimize(data.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_serialize_disk_index)->Range(16, 1 << 18);
+
+static void BM_deserialize_disk_index(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+
+	greylock::disk_index idx;
+	idx.ids = generate_ids(state.range(0), 0, rng);
+	std::string data = greylock::serialize(idx);
+
+	for (auto _: state) {
+		greylock::disk_index tmp;
+		auto err = greylock::deserialize(tmp, data.data(), data.size());
+		benchmark::DoNotOptimize(err);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_deserialize_disk_index)->Range(16, 1 << 18);
+
+static void BM_serialize_document(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+	greylock::document doc = generate_document(state.range(0), rng);
+
+	std::string data;
+	for (auto _: state) {
+		greylock::serialize(doc, &data);
+		benchmark::DoNotOptimize(data.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_serialize_document)->Range(256, 1 << 16);
+
+// @range(1) is document projection
+static void BM_deserialize_document(benchmark::State &state) {
+	std::mt19937_64 rng(0);
+	greylock::document doc = generate_document(state.range(0), rng);
+	std::string data = greylock::serialize(doc);
+
+	for (auto _: state) {
+		greylock::document tmp;
+		tmp.unpack(greylock::unpack_object(data.data(), data.size()).get(), state.range(1));
+		benchmark::DoNotOptimize(tmp.id.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_deserialize_document)->ArgsProduct({{256, 4096, 1 << 16},
+		{greylock::document::projection_meta, greylock::document::projection_full}});
+
+// walks the whole posting list of the term with rank @range(1)
+static void BM_iterator_scan(benchmark::State &state) {
+	corpus &c = corpus::get(skew_arg(state, 0));
+	std::string token = term_name(state.range(1));
+
+	size_t ids = 0;
+	for (auto _: state) {
+		auto it = greylock::index_iterator<greylock::database>::begin(c.db_indexes(), bench_mbox, bench_attr, token);
+		auto end = greylock::index_iterator<greylock::database>::end(c.db_indexes(), bench_mbox, bench_attr, token);
+
+		for (; it != end; ++it) {
+			benchmark::DoNotOptimize(it->indexed_id);
+			ids++;
+		}
+	}
+
+	state.SetItemsProcessed(ids);
+}
+BENCHMARK(BM_iterator_scan)->ArgsProduct({{80, 120}, {0, 10, 1000}})->Unit(benchmark::kMillisecond);
+
+// rewinds posting list of the term with rank @range(1) in steps of 1/1024 of the corpus time range
+static void BM_iterator_rewind(benchmark::State &state) {
+	corpus &c = corpus::get(skew_arg(state, 0));
+	std::string token = term_name(state.range(1));
+
+	size_t seconds = corpus::days * c.db_indexes().options().tokens_shard_size;
+	size_t rewinds = 0;
+	for (auto _: state) {
+		auto it = greylock::index_iterator<greylock::database>::begin(c.db_indexes(), bench_mbox, bench_attr, token);
+		auto end = greylock::index_iterator<greylock::database>::end(c.db_indexes(), bench_mbox, bench_attr, token);
+
+		for (size_t step = 0; step < 1024 && it != end; ++step) {
+			greylock::id_t id;
+			id.set_timestamp(corpus::start_tsec + step * seconds / 1024, 0);
+
+			it.rewind_to_index(id);
+			rewinds++;
+		}
+	}
+
+	state.SetItemsProcessed(rewinds);
+}
+BENCHMARK(BM_iterator_rewind)->ArgsProduct({{80, 120}, {0, 10, 1000}})->Unit(benchmark::kMillisecond);
+
+// intersects terms with ranks @range(1) and @range(2), @range(3) is document projection
+static void BM_intersect(benchmark::State &state) {
+	corpus &c = corpus::get(skew_arg(state, 0));
+	auto iq = make_query(c.db_indexes(), state.range(1), state.range(2), state.range(3));
+
+	greylock::intersector<greylock::database> inter(c.db_docs(), c.db_indexes());
+
+	size_t docs = 0;
+	for (auto _: state) {
+		greylock::intersection_query q = iq;
+		while (true) {
+			auto res = inter.intersect(q);
+			docs += res.docs.size();
+
+			if (res.completed)
+				break;
+
+			q.next_document_id = res.next_document_id;
+		}
+	}
+
+	state.SetItemsProcessed(docs);
+}
+BENCHMARK(BM_intersect)->ArgsProduct({
+		{80, 120},
+		{0, 10},
+		{1, 100, 10000},
+		{greylock::document::projection_ids, greylock::document::projection_meta}})->Unit(benchmark::kMillisecond);
+
+// the same as @BM_intersect, but over in-memory copy of the corpus
+static void BM_intersect_memory(benchmark::State &state) {
+	corpus &c = corpus::get(skew_arg(state, 0));
+	auto iq = make_query(c.db_indexes(), state.range(1), state.range(2), state.range(3));
+
+	greylock::intersector<greylock::memory_database> inter(c.db_memory(), c.db_memory());
+
+	size_t docs = 0;
+	for (auto _: state) {
+		greylock::intersection_query q = iq;
+		while (true) {
+			auto res = inter.intersect(q);
+			docs += res.docs.size();
+
+			if (res.completed)
+				break;
+
+			q.next_document_id = res.next_document_id;
+		}
+	}
+
+	state.SetItemsProcessed(docs);
+}
+BENCHMARK(BM_intersect_memory)->ArgsProduct({
+		{80, 120},
+		{0, 10},
+		{1, 100, 10000},
+		{greylock::document::projection_ids, greylock::document::projection_meta}})->Unit(benchmark::kMillisecond);
+
+// counts documents matching frequent terms without reading documents
+static void BM_count(benchmark::State &state) {
+	corpus &c = corpus::get(skew_arg(state, 0));
+	auto iq = make_query(c.db_indexes(), state.range(1), state.range(2), greylock::document::projection_ids);
+	iq.count_only = true;
+
+	greylock::intersector<greylock::database> inter(c.db_docs(), c.db_indexes());
+
+	for (auto _: state) {
+		auto res = inter.intersect(iq);
+		benchmark::DoNotOptimize(res.count);
+	}
+}
+BENCHMARK(BM_count)->ArgsProduct({{80, 120}, {0, 10}, {1, 100}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,501 @@
+#include "greylock/batch.hpp"
+#include "greylock/database.hpp"
+#include "greylock/json.hpp"
+#include "greylock/parser.hpp"
+#include "greylock/types.hpp"
+#include "greylock/utils.hpp"
+
+#include <ribosome/error.hpp>
+#include <ribosome/timer.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <queue>
+
+#include <stdio.h>
+
+using namespace ioremap;
+
+// Sorted run of key/value pairs of one column stored in temporary file,
+// every entry is msgpack array of key and value.
+class run_reader {
+public:
+	run_reader(const std::string &path) : m_path(path), m_in(path.c_str(), std::ios::binary) {
+		if (!m_in) {
+			ribosome::throw_error(-errno, "could not open run file %s", path.c_str());
+		}
+
+		next();
+	}
+
+	bool valid() const {
+		return m_valid;
+	}
+
+	const std::string &key() const {
+		return m_key;
+	}
+	const std::string &value() const {
+		return m_value;
+	}
+
+	void next() {
+		while (true) {
+			msgpack::unpacked msg;
+			if (m_unpacker.next(&msg)) {
+				msgpack::object o = msg.get();
+				if (o.type != msgpack::type::ARRAY || o.via.array.size != 2) {
+					ribosome::throw_error(-EINVAL, "run file %s is corrupted", m_path.c_str());
+				}
+
+				o.via.array.ptr[0].convert(&m_key);
+				o.via.array.ptr[1].convert(&m_value);
+				m_valid = true;
+				return;
+			}
+
+			if (!m_in.good()) {
+				m_valid = false;
+				return;
+			}
+
+			m_unpacker.reserve_buffer(buffer_size);
+			m_in.read(m_unpacker.buffer(), buffer_size);
+			m_unpacker.buffer_consumed(m_in.gcount());
+		}
+	}
+
+private:
+	enum {
+		buffer_size = 1024 * 1024,
+	};
+
+	std::string m_path;
+	std::ifstream m_in;
+	msgpack::unpacker m_unpacker;
+
+	bool m_valid = false;
+	std::string m_key, m_value;
+};
+
+struct bulk_options {
+	std::string tmp;
+	std::string mailbox;
+
+	size_t threads = 8;
+	size_t chunk_size = 10000;
+	size_t run_documents = 100000;
+	size_t sst_size = 256 * 1024 * 1024;
+};
+
+// Offline indexer.
+//
+// Input JSON-lines files are tokenized in parallel using the same rules as indexing server,
+// documents and posting lists are accumulated in memory and flushed into sorted run files,
+// runs are merged (posting lists and token shard lists using database merge operators)
+// and written into SST files which are ingested into databases bypassing write-ahead log and memtable.
+class bulk_indexer {
+public:
+	bulk_indexer(greylock::database &db_docs, greylock::database &db_indexes, const bulk_options &opts) :
+		m_db_docs(db_docs),
+		m_db_indexes(db_indexes),
+		m_opts(opts)
+	{
+	}
+
+	void index(const std::vector<std::string> &inputs) {
+		greylock::index_batch batch(m_db_docs, m_db_indexes);
+		std::vector<std::string> lines;
+
+		for (const auto &path: inputs) {
+			std::ifstream in(path.c_str());
+			if (!in) {
+				ribosome::throw_error(-errno, "could not open input file %s", path.c_str());
+			}
+
+			std::string line;
+			while (std::getline(in, line)) {
+				if (line.empty())
+					continue;
+
+				lines.emplace_back(std::move(line));
+				if (lines.size() == m_opts.chunk_size) {
+					process_lines(lines, batch);
+				}
+			}
+
+			printf("Input file %s has been processed\n", path.c_str());
+		}
+
+		process_lines(lines, batch);
+		flush_run(batch);
+
+		printf("Indexing completed: lines: %ld, documents: %ld, errors: %ld, runs: %ld, duration: %.1f seconds\n",
+				m_lines, m_documents, m_errors, m_runs, m_tm.elapsed() / 1000.0);
+	}
+
+	void write() {
+		ribosome::timer tm;
+		std::vector<greylock::error_info> errors(columns().size());
+
+		greylock::parallel_for(columns().size(), m_opts.threads, [&] (size_t idx) {
+				errors[idx] = merge_column(columns()[idx]);
+			});
+
+		for (const auto &err: errors) {
+			if (err) {
+				ribosome::throw_error(err.code(), "%s", err.message().c_str());
+			}
+		}
+
+		for (size_t run = 0; run < m_runs; ++run) {
+			for (int column: columns()) {
+				::remove(run_path(run, column).c_str());
+			}
+		}
+
+		printf("Ingestion completed: duration: %.1f seconds\n", tm.elapsed() / 1000.0);
+	}
+
+private:
+	greylock::database &m_db_docs;
+	greylock::database &m_db_indexes;
+	bulk_options m_opts;
+
+	ribosome::timer m_tm;
+	size_t m_lines = 0;
+	size_t m_documents = 0;
+	size_t m_errors = 0;
+	size_t m_runs = 0;
+
+	static const std::vector<int> &columns() {
+		static const std::vector<int> cols = {
+			greylock::options::documents_column,
+			greylock::options::document_ids_column,
+			greylock::options::bodies_column,
+			greylock::options::indexes_column,
+			greylock::options::token_shards_column,
+			greylock::options::forward_column,
+		};
+
+		return cols;
+	}
+
+	greylock::database &column_db(int column) {
+		if (column == greylock::options::indexes_column || column == greylock::options::token_shards_column ||
+				column == greylock::options::forward_column)
+			return m_db_indexes;
+
+		return m_db_docs;
+	}
+
+	std::string run_path(size_t run, int column) const {
+		return m_opts.tmp + "/run." + std::to_string(run) + "." + m_db_docs.options().column_names[column];
+	}
+
+	void process_lines(std::vector<std::string> &lines, greylock::index_batch &batch) {
+		const auto &options = m_db_indexes.options();
+
+		std::vector<greylock::document> docs(lines.size());
+		std::vector<std::string> serialized(lines.size());
+		std::vector<greylock::error_info> errors(lines.size());
+
+		greylock::parallel_for(lines.size(), m_opts.threads, [&] (size_t idx) {
+				rapidjson::Document doc;
+				doc.Parse<0>(lines[idx].c_str());
+				if (doc.HasParseError()) {
+					errors[idx] = greylock::create_error(-EINVAL, "could not parse document: %s, error offset: %d",
+							doc.GetParseError(), (int)doc.GetErrorOffset());
+					return;
+				}
+
+				const char *mbox = greylock::get_string(doc, "mailbox", m_opts.mailbox.c_str());
+				if (!*mbox) {
+					errors[idx] = greylock::create_error(-ENOENT, "there is no 'mailbox' string and no default mailbox");
+					return;
+				}
+
+				const rapidjson::Value *idxs;
+				errors[idx] = greylock::document_parser::parse(mbox, doc, docs[idx], &idxs);
+				if (errors[idx])
+					return;
+
+				docs[idx].idx = greylock::indexes::get_indexes(options, *idxs);
+				serialized[idx] = greylock::index_batch::prepare(options, docs[idx]);
+			});
+
+		for (size_t i = 0; i < lines.size(); ++i) {
+			if (errors[i]) {
+				fprintf(stderr, "line %ld: %s [%d]\n", m_lines + i, errors[i].message().c_str(), errors[i].code());
+				m_errors++;
+				continue;
+			}
+
+			batch.insert(docs[i], std::move(serialized[i]));
+			m_documents++;
+
+			if (batch.documents() >= m_opts.run_documents) {
+				flush_run(batch);
+			}
+		}
+
+		m_lines += lines.size();
+		lines.clear();
+	}
+
+	void flush_run(greylock::index_batch &batch) {
+		if (batch.documents() == 0)
+			return;
+
+		std::vector<greylock::error_info> errors(columns().size());
+
+		// every column is stored in separate member of the batch, they can be dumped concurrently
+		greylock::parallel_for(columns().size(), m_opts.threads, [&] (size_t idx) {
+				int column = columns()[idx];
+				std::string path = run_path(m_runs, column);
+
+				std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+				if (!out) {
+					errors[idx] = greylock::create_error(-errno, "could not create run file %s", path.c_str());
+					return;
+				}
+
+				msgpack::packer<std::ofstream> pk(&out);
+				batch.for_each(column, [&] (const std::string &key, const std::string &value) {
+						pk.pack_array(2);
+						pk.pack(key);
+						pk.pack(value);
+					});
+
+				out.flush();
+				if (!out) {
+					errors[idx] = greylock::create_error(-EIO, "could not write run file %s", path.c_str());
+				}
+			});
+
+		for (const auto &err: errors) {
+			if (err) {
+				ribosome::throw_error(err.code(), "%s", err.message().c_str());
+			}
+		}
+
+		printf("Run %ld has been written: documents: %ld, tokens: %ld, posting lists: %ld, "
+				"total documents: %ld, duration: %.1f seconds\n",
+				m_runs, batch.documents(), batch.tokens(), batch.keys(), m_documents, m_tm.elapsed() / 1000.0);
+
+		batch.clear();
+		m_runs++;
+	}
+
+	greylock::error_info merge_column(int column) {
+		greylock::database &db = column_db(column);
+		const std::string &cname = db.options().column_names[column];
+
+		std::vector<std::unique_ptr<run_reader>> readers;
+		try {
+			for (size_t run = 0; run < m_runs; ++run) {
+				readers.emplace_back(new run_reader(run_path(run, column)));
+			}
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EINVAL, "column: %s: %s", cname.c_str(), e.what());
+		}
+
+		// heap top is the smallest key, the same keys are ordered by run number
+		auto cmp = [&] (size_t a, size_t b) -> bool {
+			int c = readers[a]->key().compare(readers[b]->key());
+			if (c != 0)
+				return c > 0;
+			return a > b;
+		};
+		std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+		for (size_t i = 0; i < readers.size(); ++i) {
+			if (readers[i]->valid())
+				heap.push(i);
+		}
+
+		// ingested values overwrite existing ones, posting lists and shard lists are only written
+		// as values when column is empty, otherwise they are ingested as merge operands
+		bool merge = (column == greylock::options::indexes_column || column == greylock::options::token_shards_column) &&
+			!db.list_keys(column, "", 1).empty();
+
+		std::vector<std::string> files;
+		std::unique_ptr<rocksdb::SstFileWriter> writer;
+		size_t keys = 0;
+
+		auto finish = [&] () -> greylock::error_info {
+			if (!writer)
+				return greylock::error_info();
+
+			auto s = writer->Finish();
+			writer.reset();
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "column: %s: could not finish SST file %s: %s",
+						cname.c_str(), files.back().c_str(), s.ToString().c_str());
+			}
+
+			return greylock::error_info();
+		};
+
+		try {
+			while (!heap.empty()) {
+				size_t idx = heap.top();
+				heap.pop();
+
+				std::string key = readers[idx]->key();
+				std::deque<std::string> values;
+				values.push_back(readers[idx]->value());
+
+				readers[idx]->next();
+				if (readers[idx]->valid())
+					heap.push(idx);
+
+				while (!heap.empty() && readers[heap.top()]->key() == key) {
+					idx = heap.top();
+					heap.pop();
+
+					values.push_back(readers[idx]->value());
+
+					readers[idx]->next();
+					if (readers[idx]->valid())
+						heap.push(idx);
+				}
+
+				std::string value;
+				auto err = greylock::merge_column_values(column, key, values, &value);
+				if (err)
+					return err;
+
+				if (!writer) {
+					files.emplace_back(m_opts.tmp + "/" + cname + "." + std::to_string(files.size()) + ".sst");
+
+					writer = db.sst_file_writer(column);
+					auto s = writer->Open(files.back());
+					if (!s.ok()) {
+						return greylock::create_error(-s.code(), "column: %s: could not open SST file %s: %s",
+								cname.c_str(), files.back().c_str(), s.ToString().c_str());
+					}
+				}
+
+				rocksdb::Status s;
+				if (merge) {
+					s = writer->Merge(rocksdb::Slice(key), rocksdb::Slice(value));
+				} else {
+					s = writer->Put(rocksdb::Slice(key), rocksdb::Slice(value));
+				}
+				if (!s.ok()) {
+					return greylock::create_error(-s.code(), "column: %s: could not write key %s into SST file %s: %s",
+							cname.c_str(), key.c_str(), files.back().c_str(), s.ToString().c_str());
+				}
+
+				keys++;
+
+				if (writer->FileSize() >= m_opts.sst_size) {
+					err = finish();
+					if (err)
+						return err;
+				}
+			}
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EINVAL, "column: %s: %s", cname.c_str(), e.what());
+		}
+
+		auto err = finish();
+		if (err)
+			return err;
+
+		if (files.empty())
+			return greylock::error_info();
+
+		err = db.ingest(column, files);
+		if (err)
+			return err;
+
+		printf("Column %s has been ingested: keys: %ld, files: %ld\n", cname.c_str(), keys, files.size());
+		return greylock::error_info();
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Bulk index options");
+
+	bulk_options opts;
+	std::string docs_path, indexes_path;
+	std::vector<std::string> inputs;
+	size_t sst_size_mb;
+	generic.add_options()
+		("help", "This help message")
+		("input", bpo::value<std::vector<std::string>>(&inputs)->required()->composing(),
+			"Input JSON-lines file, every line is a document in /index format with optional 'mailbox' string")
+		("docs", bpo::value<std::string>(&docs_path)->required(), "Documents rocksdb database")
+		("indexes", bpo::value<std::string>(&indexes_path)->required(), "Indexes rocksdb database")
+		("tmp", bpo::value<std::string>(&opts.tmp)->required(),
+			"Directory for temporary run and SST files, it should be on the same filesystem as databases")
+		("mailbox", bpo::value<std::string>(&opts.mailbox)->default_value(""), "Mailbox of documents which do not have one")
+		("threads", bpo::value<size_t>(&opts.threads)->default_value(8), "Number of tokenization and merge threads")
+		("chunk-size", bpo::value<size_t>(&opts.chunk_size)->default_value(10000), "Number of lines tokenized in parallel")
+		("run-documents", bpo::value<size_t>(&opts.run_documents)->default_value(100000),
+			"Number of documents accumulated in memory before they are flushed into sorted run")
+		("sst-size", bpo::value<size_t>(&sst_size_mb)->default_value(256), "Maximum size of generated SST file in megabytes")
+		("compact", "Whether to compact databases after ingestion or not")
+		;
+
+	bpo::options_description cmdline_options;
+	cmdline_options.add(generic);
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	opts.sst_size = sst_size_mb * 1024 * 1024;
+
+	try {
+		greylock::database db_docs, db_indexes;
+
+		auto err = db_docs.open(docs_path, false, true);
+		if (err) {
+			ribosome::throw_error(err.code(), "could not open documents database: %s: %s",
+					docs_path.c_str(), err.message().c_str());
+		}
+
+		err = db_indexes.open(indexes_path, false, true);
+		if (err) {
+			ribosome::throw_error(err.code(), "could not open indexes database: %s: %s",
+					indexes_path.c_str(), err.message().c_str());
+		}
+
+		bulk_indexer indexer(db_docs, db_indexes, opts);
+		indexer.index(inputs);
+		indexer.write();
+
+		if (vm.count("compact")) {
+			ribosome::timer tm;
+
+			db_docs.compact();
+			db_indexes.compact();
+			printf("Compaction took %.1f seconds\n", tm.elapsed() / 1000.0);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
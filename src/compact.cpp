@@ -2,11 +2,16 @@
 
 #include "greylock/database.hpp"
 #include "greylock/types.hpp"
+#include "greylock/utils.hpp"
 
+#include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 
 #include <ribosome/timer.hpp>
 
+#include <atomic>
+#include <mutex>
+
 using namespace ioremap;
 
 static inline const char *print_time(long tsec, long tnsec)
@@ -23,6 +28,48 @@ static inline const char *print_time(long tsec, long tnsec)
 	return __dnet_print_time;
 }
 
+#define SECONDS(x) ((x) / 1000.)
+
+// asks running server to compact column, database can not be opened by this tool while server uses it
+static int compact_remote(const std::string &remote, const std::string &db_name, const std::string &cname,
+		long csize_mb, int threads, long rate_mb) {
+	auto pos = remote.rfind(':');
+	if (pos == std::string::npos) {
+		std::cerr << "Invalid remote address " << remote << ", must be host:port" << std::endl;
+		return -EINVAL;
+	}
+
+	std::string body = "{\"db\": \"" + db_name + "\", \"column\": \"" + cname + "\", " +
+		"\"size_mb\": " + std::to_string(csize_mb) + ", " +
+		"\"threads\": " + std::to_string(threads) + ", " +
+		"\"rate_mb\": " + std::to_string(rate_mb) + "}";
+
+	boost::asio::ip::tcp::iostream s(remote.substr(0, pos), remote.substr(pos + 1));
+	if (!s) {
+		std::cerr << "Could not connect to " << remote << ": " << s.error().message() << std::endl;
+		return -ECONNREFUSED;
+	}
+
+	s << "POST /compact HTTP/1.0\r\n" <<
+		"Host: " << remote << "\r\n" <<
+		"Content-Type: application/json\r\n" <<
+		"Content-Length: " << body.size() << "\r\n\r\n" << body;
+	s.flush();
+
+	std::string version;
+	int status = 0;
+	s >> version >> status;
+
+	std::string line;
+	while (std::getline(s, line) && line != "\r") {
+	}
+
+	std::string reply((std::istreambuf_iterator<char>(s)), std::istreambuf_iterator<char>());
+	printf("%s: status: %d, reply: %s\n", remote.c_str(), status, reply.c_str());
+
+	return (status >= 200 && status < 300) ? 0 : -EIO;
+}
+
 int main(int argc, char *argv[])
 {
 	namespace bpo = boost::program_options;
@@ -34,13 +81,30 @@ int main(int argc, char *argv[])
 
 
 	std::string dpath;
+	std::string remote, remote_db;
 	long csize_mb;
+	long rate_mb;
+	int threads;
 	std::string cname;
+	greylock::options opt;
 	bpo::options_description gr("Compaction options");
 	gr.add_options()
-		("path", bpo::value<std::string>(&dpath)->required(), "path to rocksdb database")
+		("path", bpo::value<std::string>(&dpath), "path to rocksdb database")
+		("remote", bpo::value<std::string>(&remote),
+			"host:port of running server, compaction is started by the server using the same options")
+		("remote-db", bpo::value<std::string>(&remote_db)->default_value("indexes"),
+			"database of the remote server to compact: docs or indexes")
 		("column", bpo::value<std::string>(&cname)->required(), "Column name to compact")
 		("size", bpo::value<long>(&csize_mb)->default_value(1024), "Number of MBs to compact in one chunk")
+		("threads", bpo::value<int>(&threads)->default_value(4), "Number of chunks compacted concurrently")
+		("subcompactions", bpo::value<uint32_t>(&opt.max_subcompactions)->default_value(opt.max_subcompactions),
+			"Number of threads every chunk compaction is split into")
+		("rate", bpo::value<long>(&rate_mb)->default_value(0),
+			"Limit of compaction writes in MB/s, 0 disables limit")
+		("dict-size", bpo::value<uint32_t>(&opt.documents_dict_size)->default_value(opt.documents_dict_size),
+			"Size of zstd dictionary of documents column, it is retrained for every compacted file, 0 disables dictionary")
+		("dict-train-size", bpo::value<uint32_t>(&opt.documents_dict_train_size)->default_value(opt.documents_dict_train_size),
+			"Maximum size of document samples used to train dictionary")
 		;
 
 	bpo::options_description cmdline_options;
@@ -62,7 +126,6 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	greylock::options opt;
 	auto it = std::find(opt.column_names.begin(), opt.column_names.end(), cname);
 	if (it == opt.column_names.end()) {
 		std::cerr << "Invalig column " << cname << ", supported columns: " << greylock::dump_vector(opt.column_names) << std::endl;
@@ -71,65 +134,73 @@ int main(int argc, char *argv[])
 
 	auto column_id = std::distance(opt.column_names.begin(), it);
 
-#define SECONDS(x) ((x) / 1000.)
+	if (vm.count("remote")) {
+		return compact_remote(remote, remote_db, cname, csize_mb, threads, rate_mb);
+	}
+
+	if (dpath.empty()) {
+		std::cerr << "Either --path or --remote must be specified\n" << cmdline_options << std::endl;
+		return -EINVAL;
+	}
+
+	opt.compaction_rate_limit = rate_mb * 1024 * 1024;
 
 	try {
 		ribosome::timer tm;
 
 		greylock::database db;
-		auto err = db.open_read_write(dpath);
+		auto err = db.set_options(opt);
+		if (err) {
+			std::cerr << "could not set database options: " << err.message();
+			return err.code();
+		}
+
+		err = db.open_read_write(dpath);
 		if (err) {
 			std::cerr << "could not open database: " << err.message();
 			return err.code();
 		}
 		long open_time = tm.elapsed();
-		printf("%.2fs : %.2fs: database has been opened\n", SECONDS(tm.elapsed()), SECONDS(open_time)); 
-
-		rocksdb::ReadOptions ro;
-		auto it = db.iterator(column_id, ro);
-		it->SeekToFirst();
-		long position_time = tm.elapsed() - open_time;
-		printf("%.2fs : %.2fs: database has been positioned\n", SECONDS(tm.elapsed()), SECONDS(position_time));
-
-		if (!it->Valid()) {
-			auto s = it->status();
-			fprintf(stderr, "iterator is not valid: %s [%d]", s.ToString().c_str(), s.code());
-			return -s.code();
-		}
+		printf("%.2fs : %.2fs: database has been opened\n", SECONDS(tm.elapsed()), SECONDS(open_time));
 
-		long compact_size = csize_mb * 1024 * 1024;
+		// chunk boundaries are taken from SST file metadata, data is not read
+		auto ranges = db.compaction_ranges(column_id, csize_mb * 1024 * 1024);
+		printf("%.2fs : %.2fs: column %s has been split into %ld chunks, threads: %d, subcompactions: %d, rate: %ld MB/s\n",
+				SECONDS(tm.elapsed()), SECONDS(tm.elapsed() - open_time),
+				cname.c_str(), ranges.size(), threads, opt.max_subcompactions, rate_mb);
 
 		long compaction_start_time = tm.elapsed();
-		while (it->Valid()) {
-			long compaction_tmp_start_time = tm.elapsed();
-
-			long current_size = 0;
-			rocksdb::Slice start, end;
-
-			start = it->key();
-			while (it->Valid() && current_size < compact_size) {
-				current_size += it->value().size();
-				end = it->key();
 
-				it->Next();
-			}
-
-			db.compact(column_id, start, end);
-			long compaction_time = tm.elapsed() - compaction_tmp_start_time;
-
-			printf("%.2fs : %.2fs: compaction: start: %s, end: %s, size: %.2f MB\n",
-					SECONDS(tm.elapsed()), SECONDS(compaction_time),
-					start.ToString().c_str(), end.ToString().c_str(),
-					current_size / (1024. * 1024.)); 
-		}
-
-		if (!it->Valid()) {
-			auto s = it->status();
-			if (s.code() != 0) {
-				fprintf(stderr, "iterator has become invalid during iteration: %s [%d]", s.ToString().c_str(), s.code());
-				return -s.code();
-			}
-		}
+		std::mutex lock;
+		std::atomic_size_t completed(0);
+		greylock::error_info compact_err;
+
+		greylock::parallel_for(ranges.size(), threads, [&] (size_t idx) {
+				const auto &r = ranges[idx];
+
+				ribosome::timer ctm;
+				auto err = db.compact_range(column_id, r.first, r.second);
+
+				std::lock_guard<std::mutex> guard(lock);
+				if (err) {
+					fprintf(stderr, "chunk compaction has failed: start: %s, end: %s: %s [%d]\n",
+							r.first.c_str(), r.second.c_str(), err.message().c_str(), err.code());
+					if (!compact_err)
+						compact_err = err;
+					return;
+				}
+
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				printf("%s: %.2fs : %.2fs: compaction: chunks: %ld/%ld, start: %s, end: %s\n",
+						print_time(ts.tv_sec, ts.tv_nsec),
+						SECONDS(tm.elapsed()), SECONDS(ctm.elapsed()),
+						++completed, ranges.size(),
+						r.first.c_str(), r.second.c_str());
+			});
+
+		if (compact_err)
+			return compact_err.code();
 
 		long compaction_time = tm.elapsed() - compaction_start_time;
 
@@ -138,4 +209,3 @@ int main(int argc, char *argv[])
 		std::cerr << "Exception: " << e.what() << std::endl;
 	}
 }
-
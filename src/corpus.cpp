@@ -0,0 +1,389 @@
+#include "greylock/database.hpp"
+#include "greylock/jsonvalue.hpp"
+#include "greylock/parser.hpp"
+#include "greylock/pipeline.hpp"
+#include "greylock/utils.hpp"
+
+#include <ribosome/error.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <math.h>
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace ioremap;
+
+// Generates synthetic corpus in the format of indexing requests and optionally indexes it in-process.
+//
+// Every mailbox has its own Zipf-distributed vocabulary: word ranks are shared, but the most frequent
+// words differ between mailboxes, thus per-mailbox posting lists have different sizes.
+// Document lengths follow log-normal distribution, timestamps are spread uniformly over given number of days.
+//
+// Generated requests are written one per line as '/index <json>', which is the input format of greylock_replay.
+// In ingest mode requests are parsed, tokenized and written through the same ingestion pipeline as server uses.
+
+struct corpus_options {
+	size_t mailboxes = 16;
+	size_t documents = 100000;
+	size_t docs_per_request = 100;
+
+	size_t vocabulary = 100000;
+	double skew = 1.0;
+
+	// mean number of words in document content
+	size_t doc_words = 300;
+	size_t title_words = 8;
+
+	size_t days = 30;
+	long end_tsec = 0;
+
+	uint64_t seed = 0;
+};
+
+class corpus_generator {
+public:
+	corpus_generator(const corpus_options &opts) :
+		m_opts(opts),
+		m_rng(opts.seed),
+		m_mailbox(0, opts.mailboxes - 1),
+		// log-normal mean is exp(mu + sigma^2 / 2)
+		m_length(log(std::max<size_t>(opts.doc_words, 1)) - 0.32, 0.8),
+		m_time(0, opts.days * 24 * 3600)
+	{
+		std::vector<double> weights(opts.vocabulary);
+		for (size_t i = 0; i < opts.vocabulary; ++i) {
+			weights[i] = 1.0 / pow(i + 1, opts.skew);
+		}
+		m_words = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+
+		m_end_tsec = opts.end_tsec;
+		if (m_end_tsec == 0) {
+			m_end_tsec = time(NULL);
+		}
+	}
+
+	// returns false when all documents have been generated
+	bool next_request(std::string *ret, size_t *num_docs) {
+		if (m_generated >= m_opts.documents)
+			return false;
+
+		size_t mbox = m_mailbox(m_rng);
+
+		greylock::JsonValue req;
+		auto &allocator = req.GetAllocator();
+
+		std::string mbox_name = "mailbox" + std::to_string(mbox);
+		rapidjson::Value mv(mbox_name.c_str(), mbox_name.size(), allocator);
+		req.AddMember("mailbox", mv, allocator);
+
+		rapidjson::Value docs(rapidjson::kArrayType);
+		*num_docs = 0;
+		for (; *num_docs < m_opts.docs_per_request && m_generated < m_opts.documents; ++*num_docs, ++m_generated) {
+			rapidjson::Value doc(rapidjson::kObjectType);
+
+			std::string id = "doc" + std::to_string(m_generated);
+			rapidjson::Value idv(id.c_str(), id.size(), allocator);
+			doc.AddMember("id", idv, allocator);
+
+			std::string author = "author" + std::to_string(m_rng() % 1000);
+			rapidjson::Value av(author.c_str(), author.size(), allocator);
+			doc.AddMember("author", av, allocator);
+
+			rapidjson::Value ts(rapidjson::kObjectType);
+			ts.AddMember("tsec", (int64_t)(m_end_tsec - m_time(m_rng)), allocator);
+			ts.AddMember("tnsec", (int64_t)(m_rng() % 1000000000), allocator);
+			doc.AddMember("timestamp", ts, allocator);
+
+			std::string title = text(mbox, m_opts.title_words);
+			std::string content = text(mbox, std::max<size_t>(1, m_length(m_rng)));
+
+			rapidjson::Value ctx(rapidjson::kObjectType);
+			rapidjson::Value tv(title.c_str(), title.size(), allocator);
+			ctx.AddMember("title", tv, allocator);
+			rapidjson::Value cv(content.c_str(), content.size(), allocator);
+			ctx.AddMember("content", cv, allocator);
+			doc.AddMember("content", ctx, allocator);
+
+			rapidjson::Value idx(rapidjson::kObjectType);
+			rapidjson::Value itv(title.c_str(), title.size(), allocator);
+			idx.AddMember("title", itv, allocator);
+			rapidjson::Value icv(content.c_str(), content.size(), allocator);
+			idx.AddMember("content", icv, allocator);
+			rapidjson::Value iav(author.c_str(), author.size(), allocator);
+			idx.AddMember("author", iav, allocator);
+			doc.AddMember("index", idx, allocator);
+
+			docs.PushBack(doc, allocator);
+		}
+		req.AddMember("docs", docs, allocator);
+
+		*ret = req.ToString();
+		return true;
+	}
+
+private:
+	corpus_options m_opts;
+	std::mt19937_64 m_rng;
+
+	std::uniform_int_distribution<size_t> m_mailbox;
+	std::lognormal_distribution<double> m_length;
+	std::uniform_int_distribution<long> m_time;
+	std::discrete_distribution<size_t> m_words;
+
+	long m_end_tsec;
+	size_t m_generated = 0;
+
+	// word of given rank, words consist of letters only, thus tokenizer does not split them
+	static std::string word(size_t rank) {
+		static const char *syllables[] = {
+			"ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "de", "ga", "po", "zu", "be", "fi", "ho", "ja",
+		};
+
+		std::string ret;
+		size_t r = rank + 16;
+		while (r) {
+			ret += syllables[r % 16];
+			r /= 16;
+		}
+		return ret;
+	}
+
+	std::string text(size_t mbox, size_t words) {
+		std::string ret;
+		for (size_t i = 0; i < words; ++i) {
+			// the same rank maps to different words in different mailboxes
+			size_t rank = (m_words(m_rng) + mbox * 7919) % m_opts.vocabulary;
+
+			if (i != 0)
+				ret.push_back(' ');
+			ret += word(rank);
+		}
+		return ret;
+	}
+};
+
+static void print_database_stats(const char *name, greylock::database &db) {
+	auto stats = db.statistics();
+	if (stats) {
+		uint64_t user = stats->getTickerCount(rocksdb::BYTES_WRITTEN);
+		uint64_t wal = stats->getTickerCount(rocksdb::WAL_FILE_BYTES);
+		uint64_t flush = stats->getTickerCount(rocksdb::FLUSH_WRITE_BYTES);
+		uint64_t compact = stats->getTickerCount(rocksdb::COMPACT_WRITE_BYTES);
+
+		printf("%s: bytes written: user: %.2f MB, wal: %.2f MB, flush: %.2f MB, compaction: %.2f MB, "
+				"write amplification: %.2f\n",
+				name, user / 1048576., wal / 1048576., flush / 1048576., compact / 1048576.,
+				user ? (double)(wal + flush + compact) / user : 0.);
+	}
+
+	for (int column = 0; column < greylock::options::__column_size; ++column) {
+		uint64_t sst = 0, mem = 0, keys = 0;
+		db.int_property(column, "rocksdb.total-sst-files-size", &sst);
+		db.int_property(column, "rocksdb.cur-size-all-mem-tables", &mem);
+		db.int_property(column, "rocksdb.estimate-num-keys", &keys);
+
+		if (sst + mem == 0)
+			continue;
+
+		printf("%s: column: %s: sst: %.2f MB, memtables: %.2f MB, keys: %lu\n",
+				name, db.options().column_names[column].c_str(), sst / 1048576., mem / 1048576., keys);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Synthetic corpus options");
+	generic.add_options()
+		("help", "this help message")
+		;
+
+	corpus_options copt;
+	greylock::pipeline_options popt;
+	std::string output, docs_path, indexes_path, ack;
+	bool compact = false;
+
+	bpo::options_description gr("Corpus options");
+	gr.add_options()
+		("mailboxes", bpo::value<size_t>(&copt.mailboxes)->default_value(copt.mailboxes), "number of mailboxes")
+		("documents", bpo::value<size_t>(&copt.documents)->default_value(copt.documents), "number of documents")
+		("docs-per-request", bpo::value<size_t>(&copt.docs_per_request)->default_value(copt.docs_per_request),
+			"number of documents in one indexing request")
+		("vocabulary", bpo::value<size_t>(&copt.vocabulary)->default_value(copt.vocabulary), "number of distinct words")
+		("skew", bpo::value<double>(&copt.skew)->default_value(copt.skew), "Zipf exponent of word frequencies")
+		("doc-words", bpo::value<size_t>(&copt.doc_words)->default_value(copt.doc_words),
+			"mean number of words in document, lengths are log-normally distributed")
+		("days", bpo::value<size_t>(&copt.days)->default_value(copt.days), "documents are spread over this many days")
+		("end-time", bpo::value<long>(&copt.end_tsec)->default_value(0), "timestamp of the newest document, 0 - now")
+		("seed", bpo::value<uint64_t>(&copt.seed)->default_value(0), "random generator seed")
+		("output", bpo::value<std::string>(&output), "file where generated requests are written, one per line")
+		;
+
+	bpo::options_description ing("Ingestion benchmark options");
+	ing.add_options()
+		("docs", bpo::value<std::string>(&docs_path), "path to documents database, corpus is indexed when both paths are set")
+		("indexes", bpo::value<std::string>(&indexes_path), "path to indexes database")
+		("parse-threads", bpo::value<int>(&popt.parse_threads)->default_value(popt.parse_threads),
+			"number of threads which parse and tokenize requests")
+		("write-threads", bpo::value<int>(&popt.write_threads)->default_value(popt.write_threads),
+			"number of threads which write batches")
+		("group-commit-size", bpo::value<size_t>(&popt.group_commit_size)->default_value(popt.group_commit_size),
+			"maximum number of requests merged into one write")
+		("ack", bpo::value<std::string>(&ack)->default_value("accepted"), "acknowledgement level: accepted, memtable, fsync")
+		("compact", "compact databases after ingestion, sizes and write amplification include compaction")
+		;
+
+	bpo::options_description cmdline_options;
+	cmdline_options.add(generic).add(gr).add(ing);
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << cmdline_options << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << cmdline_options << std::endl;
+		return -1;
+	}
+
+	compact = vm.count("compact") != 0;
+	bool ingest = !docs_path.empty() && !indexes_path.empty();
+	if (output.empty() && !ingest) {
+		std::cerr << "Either output file or both database paths must be specified\n" << cmdline_options << std::endl;
+		return -EINVAL;
+	}
+	if (copt.mailboxes == 0 || copt.vocabulary == 0 || copt.docs_per_request == 0) {
+		std::cerr << "Number of mailboxes, vocabulary size and documents per request must be positive" << std::endl;
+		return -EINVAL;
+	}
+
+	int ack_level = greylock::ingest_pipeline::ack_from_string(ack);
+	if (ack_level < 0) {
+		std::cerr << "Invalid acknowledgement level " << ack << std::endl;
+		return -EINVAL;
+	}
+
+	try {
+		std::ofstream out;
+		if (!output.empty()) {
+			out.open(output, std::ios::trunc);
+			if (!out) {
+				ribosome::throw_error(-errno, "could not open output file %s", output.c_str());
+			}
+		}
+
+		greylock::database db_docs, db_indexes;
+		std::unique_ptr<greylock::ingest_pipeline> pipeline;
+
+		if (ingest) {
+			auto err = db_docs.open_read_write(docs_path);
+			if (err) {
+				ribosome::throw_error(err.code(), "could not open documents database %s: %s",
+						docs_path.c_str(), err.message().c_str());
+			}
+
+			err = db_indexes.open_read_write(indexes_path);
+			if (err) {
+				ribosome::throw_error(err.code(), "could not open indexes database %s: %s",
+						indexes_path.c_str(), err.message().c_str());
+			}
+
+			popt.queue_size = std::max<size_t>(popt.queue_size, popt.group_commit_size * 2);
+			popt.write_error_handler = [] (const greylock::error_info &err, size_t requests) {
+				fprintf(stderr, "write of %zd accepted requests has failed: %s\n", requests, err.message().c_str());
+			};
+			pipeline.reset(new greylock::ingest_pipeline(db_docs, db_indexes, popt));
+		}
+
+		std::atomic<size_t> failed(0);
+		size_t requests = 0, documents = 0, request_bytes = 0;
+
+		corpus_generator gen(copt);
+		greylock::usec_timer tm;
+
+		std::string data;
+		size_t num_docs;
+		while (gen.next_request(&data, &num_docs)) {
+			requests++;
+			documents += num_docs;
+			request_bytes += data.size();
+
+			if (out.is_open()) {
+				out << "/index " << data << "\n";
+			}
+
+			if (!pipeline)
+				continue;
+
+			auto shared = std::make_shared<std::string>(std::move(data));
+			auto prepare = [shared, &db_indexes] (greylock::index_batch &batch) -> greylock::error_info {
+				std::string mbox;
+				size_t num;
+				return greylock::document_parser::parse_index_request(db_indexes.options(), *shared, batch, &mbox, &num);
+			};
+			auto complete = [&failed] (const greylock::error_info &err, const greylock::ingest_pipeline::result &) {
+				if (err && failed++ == 0) {
+					fprintf(stderr, "indexing request has failed: %s\n", err.message().c_str());
+				}
+			};
+
+			// queue is full, ingestion is slower than generation
+			while (true) {
+				auto err = pipeline->push(ack_level, prepare, complete);
+				if (!err)
+					break;
+				if (err.code() != -EAGAIN) {
+					ribosome::throw_error(err.code(), "could not queue request: %s", err.message().c_str());
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		if (out.is_open()) {
+			out.close();
+			printf("generated: requests: %zd, documents: %zd, size: %.2f MB, output: %s\n",
+					requests, documents, request_bytes / 1048576., output.c_str());
+		}
+
+		if (!pipeline)
+			return 0;
+
+		// stop() returns when all queued requests have been written
+		pipeline->stop();
+		long ingest_time = tm.elapsed();
+
+		printf("ingested: requests: %zd, documents: %zd, failed requests: %zd, write errors: %zd, "
+				"duration: %.2f s, %.1f docs/s, %.2f MB/s of requests\n",
+				requests, documents, failed.load(), pipeline->write_errors(),
+				ingest_time / 1000000., documents * 1000000. / std::max(ingest_time, 1L),
+				request_bytes / 1048576. * 1000000. / std::max(ingest_time, 1L));
+
+		if (compact) {
+			greylock::usec_timer ctm;
+			db_docs.compact();
+			db_indexes.compact();
+			printf("compaction: duration: %.2f s\n", ctm.elapsed() / 1000000.);
+		}
+
+		print_database_stats("docs", db_docs);
+		print_database_stats("indexes", db_indexes);
+	} catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
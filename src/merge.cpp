@@ -1,12 +1,21 @@
 #include "greylock/database.hpp"
 #include "greylock/types.hpp"
+#include "greylock/utils.hpp"
 
 #include <ribosome/error.hpp>
 #include <ribosome/timer.hpp>
 
+#include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
-#include <rocksdb/comparator.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <thread>
 
 using namespace ioremap;
 
@@ -24,16 +33,179 @@ static inline const char *print_time(long tsec, long tnsec)
 	return __dnet_print_time;
 }
 
+struct merge_options {
+	int threads = 8;
+
+	// number of key ranges the key space is split into, 0 means 4 ranges per thread
+	size_t ranges = 0;
+
+	size_t sst_size = 256 * 1024 * 1024;
+
+	// directory for SST files and checkpoint, it must be on the same filesystem as output database
+	std::string tmp;
+
+	long print_interval = 10000;
+};
+
+// key range [start, end) merged by a single thread, empty @end means the end of the key space
+struct merge_range {
+	std::string start, end;
+	bool done = false;
+};
+
+// Merge progress: merge id, column, inputs, key ranges and completed ranges.
+// Completed range is appended to the file after its SST files have been ingested,
+// thus restarted merge skips ranges which are already present in the output database.
+class merge_checkpoint {
+public:
+	merge_checkpoint(const std::string &path) : m_path(path) {}
+
+	// unique id of the merge, it is generated when checkpoint is created
+	const std::string &id() const {
+		return m_id;
+	}
+
+	bool exists() const {
+		boost::system::error_code ec;
+		return boost::filesystem::exists(m_path, ec);
+	}
+
+	// reads checkpoint and verifies that it has been created for the same column and inputs
+	void load(const std::string &column, const std::vector<std::string> &inputs, bool *merge_operands,
+			std::vector<merge_range> *ranges) {
+		std::ifstream in(m_path.c_str());
+		if (!in) {
+			ribosome::throw_error(-errno, "could not open checkpoint %s", m_path.c_str());
+		}
+
+		std::vector<std::string> stored_inputs;
+		std::string cname, type;
+		while (in >> type) {
+			if (type == "id") {
+				in >> m_id;
+			} else if (type == "column") {
+				in >> cname;
+			} else if (type == "input") {
+				std::string input;
+				in >> input;
+				stored_inputs.push_back(input);
+			} else if (type == "merge") {
+				in >> *merge_operands;
+			} else if (type == "range") {
+				merge_range r;
+				std::string start, end;
+				in >> start >> end;
+				r.start = unhex(start);
+				r.end = unhex(end);
+				ranges->emplace_back(std::move(r));
+			} else if (type == "done") {
+				size_t idx;
+				in >> idx;
+				if (idx < ranges->size())
+					(*ranges)[idx].done = true;
+			} else {
+				ribosome::throw_error(-EINVAL, "checkpoint %s is corrupted: unknown record %s",
+						m_path.c_str(), type.c_str());
+			}
+		}
+
+		if (cname != column || stored_inputs != inputs) {
+			ribosome::throw_error(-EINVAL, "checkpoint %s has been created for column %s and inputs %s, "
+					"remove it to start merge from scratch",
+					m_path.c_str(), cname.c_str(), greylock::dump_vector(stored_inputs).c_str());
+		}
+	}
+
+	void create(const std::string &column, const std::vector<std::string> &inputs, bool merge_operands,
+			const std::vector<merge_range> &ranges) {
+		m_id = std::to_string(time(NULL)) + "." + std::to_string(getpid());
+
+		std::ostringstream out;
+		out << "id " << m_id << "\n";
+		out << "column " << column << "\n";
+		for (const auto &input: inputs) {
+			out << "input " << input << "\n";
+		}
+		out << "merge " << merge_operands << "\n";
+		for (const auto &r: ranges) {
+			out << "range " << hex(r.start) << " " << hex(r.end) << "\n";
+		}
+
+		append(out.str());
+	}
+
+	void done(size_t idx) {
+		append("done " + std::to_string(idx) + "\n");
+	}
+
+	void remove() {
+		boost::system::error_code ec;
+		boost::filesystem::remove(m_path, ec);
+	}
+
+private:
+	std::string m_path;
+	std::string m_id;
+	std::mutex m_lock;
+
+	void append(const std::string &data) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		FILE *fp = fopen(m_path.c_str(), "a");
+		if (!fp) {
+			ribosome::throw_error(-errno, "could not open checkpoint %s", m_path.c_str());
+		}
+
+		size_t written = fwrite(data.data(), 1, data.size(), fp);
+		int err = (written == data.size() && fflush(fp) == 0 && fsync(fileno(fp)) == 0) ? 0 : -errno;
+		fclose(fp);
+
+		if (err) {
+			ribosome::throw_error(err, "could not write checkpoint %s", m_path.c_str());
+		}
+	}
+
+	// keys are binary, empty key is stored as "-"
+	static std::string hex(const std::string &key) {
+		static const char digits[] = "0123456789abcdef";
+
+		if (key.empty())
+			return "-";
+
+		std::string ret;
+		for (unsigned char c: key) {
+			ret.push_back(digits[c >> 4]);
+			ret.push_back(digits[c & 0xf]);
+		}
+		return ret;
+	}
+
+	static std::string unhex(const std::string &h) {
+		std::string ret;
+		if (h == "-")
+			return ret;
+
+		for (size_t i = 0; i + 1 < h.size(); i += 2) {
+			ret.push_back((char)strtoul(h.substr(i, 2).c_str(), NULL, 16));
+		}
+		return ret;
+	}
+};
+
+// Merges one column of several databases into output database.
+//
+// Key space is split into ranges of roughly equal size using SST file boundaries of the input databases,
+// ranges are merged in parallel, every range is written into SST files which are ingested into output database.
+// Posting lists and token shard lists of the same key are merged, for other columns the last input wins.
 class merger {
 public:
-	merger(long print_interval) : m_print_interval(print_interval) {
+	merger(const merge_options &opts) : m_opts(opts) {
 	}
 
 	void merge(int column, const std::string &output, const std::vector<std::string> &inputs, bool compact) {
 		ribosome::timer tm;
 
-		greylock::database odb;
-		auto err = odb.open_read_write(output);
+		auto err = m_odb.open_read_write(output);
 		if (err) {
 			ribosome::throw_error(err.code(), "could not open output database: %s: %s",
 					output.c_str(), err.message().c_str());
@@ -41,10 +213,6 @@ public:
 
 		printf("Output databse %s has been opened\n", output.c_str());
 
-		std::vector<std::unique_ptr<greylock::database>> dbs;
-		std::vector<rocksdb::Iterator *> its;
-		rocksdb::ReadOptions ro;
-
 		for (auto &path: inputs) {
 			std::unique_ptr<greylock::database> dbu(new greylock::database());
 			err = dbu->open_read_only(path);
@@ -54,36 +222,72 @@ public:
 			}
 
 			printf("Input databse %s has been opened\n", path.c_str());
+			m_dbs.emplace_back(std::move(dbu));
+		}
+
+		m_column = column;
+		const std::string &cname = m_odb.options().column_names[column];
+
+		std::string tmp = m_opts.tmp.empty() ? output + ".merge" : m_opts.tmp;
+		boost::filesystem::create_directories(tmp);
+		m_tmp = tmp;
+
+		merge_checkpoint checkpoint(tmp + "/" + cname + ".checkpoint");
+		if (checkpoint.exists()) {
+			checkpoint.load(cname, inputs, &m_merge_operands, &m_ranges);
+			m_id = checkpoint.id();
+
+			// merge could be interrupted after range has been ingested but before it has been
+			// marked as done, merge operands of such range must not be ingested again
+			for (size_t i = 0; i < m_ranges.size(); ++i) {
+				if (m_ranges[i].done || !m_merge_operands)
+					continue;
 
-			auto it = dbu->iterator(column, ro);
-			it->SeekToFirst();
+				std::string marker;
+				err = m_odb.read(greylock::options::meta_column, marker_key(i), &marker);
+				if (err) {
+					if (err.code() == -rocksdb::Status::kNotFound)
+						continue;
 
-			printf("Input databse %s has been positioned\n", path.c_str());
+					ribosome::throw_error(err.code(), "could not read merge marker of range %ld: %s",
+							i, err.message().c_str());
+				}
 
-			if (!it->Valid()) {
-				auto s = it->status();
-				ribosome::throw_error(-s.code(), "iterator from database %s is not valid: %s [%d]",
-						path.c_str(), s.ToString().c_str(), s.code());
+				checkpoint.done(i);
+				m_ranges[i].done = true;
 			}
+		} else {
+			// when output already has posting lists or token shard lists, merged values are ingested
+			// as merge operands, otherwise they would overwrite existing values
+			m_merge_operands = (column == greylock::options::indexes_column ||
+					column == greylock::options::token_shards_column) &&
+				!m_odb.list_keys(column, "", 1).empty();
+
+			split_ranges();
+			checkpoint.create(cname, inputs, m_merge_operands, m_ranges);
+			m_id = checkpoint.id();
+		}
 
-			its.emplace_back(it);
-			dbs.emplace_back(std::move(dbu));
+		std::vector<size_t> pending;
+		for (size_t i = 0; i < m_ranges.size(); ++i) {
+			if (!m_ranges[i].done)
+				pending.push_back(i);
 		}
 
-		auto cmp = rocksdb::BytewiseComparator();
+		printf("Column %s: ranges: %ld, pending: %ld, threads: %d, merge operands: %d\n",
+				cname.c_str(), m_ranges.size(), pending.size(), m_opts.threads, m_merge_operands);
 
-		long data_size = 0;
-		long written_keys = 0;
-		std::string first_key, last_key;
+		ribosome::timer merge_tm;
 		long prev_written_keys = 0;
 		long prev_data_size = 0;
 
-		ribosome::timer merge_tm;
-
 		auto print_stats = [&] () {
 			struct timespec ts;
 			clock_gettime(CLOCK_REALTIME, &ts);
 
+			long written_keys = m_written_keys;
+			long data_size = m_data_size;
+
 			float kspeed = (float)written_keys * 1000.0 / (float)merge_tm.elapsed();
 			float kspeed_moment = (float)(written_keys - prev_written_keys) * 1000.0 / (float)tm.elapsed();
 
@@ -91,100 +295,88 @@ public:
 			float dspeed_moment = (float)(data_size - prev_data_size) * 1000.0 / (float)tm.elapsed() / (1024.0 * 1024.0);
 
 			printf("%s: column: %s [%d], written keys: %ld, speed: %.2f [%.2f] keys/s, "
-				"written data size: %.2f MBs, speed: %.2f [%.2f] MB/s, "
-				"first_key: %s, last_key: %s\n",
+				"read data size: %.2f MBs, speed: %.2f [%.2f] MB/s, "
+				"completed ranges: %ld/%ld\n",
 				print_time(ts.tv_sec, ts.tv_nsec),
-				odb.options().column_names[column].c_str(), column,
+				cname.c_str(), column,
 				written_keys, kspeed, kspeed_moment,
 				(float)data_size / (1024.0 * 1024.0), dspeed, dspeed_moment,
-				first_key.c_str(), last_key.c_str());
+				(size_t)m_completed_ranges, pending.size());
 
 			prev_written_keys = written_keys;
 			prev_data_size = data_size;
 			tm.restart();
 		};
 
-		while (true) {
-			rocksdb::Slice key;
-			std::vector<size_t> positions;
-			std::vector<size_t> to_remove;
+		std::mutex lock;
+		std::condition_variable cv;
+		bool finished = false;
 
-			for (size_t pos = 0; pos < its.size(); ++pos) {
-				auto &it = its[pos];
-				if (!it->Valid()) {
-					to_remove.push_back(pos);
-					continue;
+		std::thread printer([&] () {
+				std::unique_lock<std::mutex> guard(lock);
+				while (!cv.wait_for(guard, std::chrono::milliseconds(m_opts.print_interval),
+							[&] { return finished; })) {
+					print_stats();
 				}
-
-				if (key.size() == 0) {
-					key = it->key();
-					positions.push_back(pos);
-					continue;
+			});
+
+		greylock::error_info merge_err;
+		greylock::parallel_for(pending.size(), m_opts.threads, [&] (size_t i) {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (merge_err)
+						return;
 				}
 
-				int cval = cmp->Compare(it->key(), key);
-				if (cval < 0) {
-					key = it->key();
-					positions.clear();
-					positions.push_back(pos);
-					continue;
+				size_t idx = pending[i];
+				auto err = merge_one_range(idx);
+				if (!err) {
+					try {
+						checkpoint.done(idx);
+					} catch (const std::exception &e) {
+						err = greylock::create_error(-EIO, "%s", e.what());
+					}
 				}
 
-				if (cval > 0) {
-					continue;
+				std::lock_guard<std::mutex> guard(lock);
+				if (err) {
+					if (!merge_err)
+						merge_err = err;
+					return;
 				}
 
-				positions.push_back(pos);
-			}
+				m_completed_ranges++;
+			});
 
-			if (key.size() == 0)
-				break;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			finished = true;
+		}
+		cv.notify_all();
+		printer.join();
 
-			rocksdb::WriteBatch batch;
+		print_stats();
 
-			long ds = 0;
-			for (auto pos: positions) {
-				auto &it = its[pos];
+		if (merge_err) {
+			ribosome::throw_error(merge_err.code(), "merge has failed, restart to continue from checkpoint: %s",
+					merge_err.message().c_str());
+		}
 
-				if ((column == greylock::options::token_shards_column) || (column == greylock::options::indexes_column)) {
-					batch.Merge(odb.cfhandle(column), key, it->value());
-				} else {
-					batch.Put(odb.cfhandle(column), key, it->value());
-				}
-				ds += it->value().size();
+		if (m_merge_operands) {
+			rocksdb::WriteBatch batch;
+			for (size_t i = 0; i < m_ranges.size(); ++i) {
+				batch.Delete(m_odb.cfhandle(greylock::options::meta_column), rocksdb::Slice(marker_key(i)));
 			}
 
-			err = odb.write(&batch);
+			err = m_odb.write(&batch);
 			if (err) {
-				ribosome::throw_error(err.code(), "key: %s, inputs: %s, could not write batch of %ld elements: %s",
-						key.ToString().c_str(), greylock::dump_vector(positions).c_str(),
-						positions.size(), err.message().c_str());
-			}
-
-			if (written_keys == 0) {
-				first_key = key.ToString();
-			}
-
-			written_keys++;
-			data_size += ds;
-			last_key = key.ToString();
-
-			for (auto pos: positions) {
-				auto &it = its[pos];
-				it->Next();
-			}
-
-			for (auto it = to_remove.rbegin(); it != to_remove.rend(); ++it) {
-				printf("Input file %s has been processed\n", inputs[*it].c_str());
-				its.erase(its.begin() + (*it));
-			}
-
-			if (tm.elapsed() > m_print_interval) {
-				print_stats();
+				ribosome::throw_error(err.code(), "could not remove merge markers: %s", err.message().c_str());
 			}
 		}
 
-		print_stats();
+		checkpoint.remove();
+		boost::system::error_code ec;
+		boost::filesystem::remove(tmp, ec);
 
 		if (compact) {
 			struct timespec ts;
@@ -193,17 +385,269 @@ public:
 			printf("%s: starting compaction\n", print_time(ts.tv_sec, ts.tv_nsec));
 			tm.restart();
 
-			odb.compact();
+			m_odb.compact();
 			clock_gettime(CLOCK_REALTIME, &ts);
 			printf("%s: compaction 1 took %.1f seconds\n", print_time(ts.tv_sec, ts.tv_nsec), tm.restart() / 1000.0);
 
-			odb.compact();
+			m_odb.compact();
 			clock_gettime(CLOCK_REALTIME, &ts);
 			printf("%s: compaction 2 took %.1f seconds\n", print_time(ts.tv_sec, ts.tv_nsec), tm.restart() / 1000.0);
 		}
 	}
 private:
-	long m_print_interval;
+	merge_options m_opts;
+
+	greylock::database m_odb;
+	std::vector<std::unique_ptr<greylock::database>> m_dbs;
+
+	int m_column;
+	std::string m_id;
+	std::string m_tmp;
+	bool m_merge_operands = false;
+	std::vector<merge_range> m_ranges;
+
+	std::atomic<long> m_written_keys{0};
+	std::atomic<long> m_data_size{0};
+	std::atomic<size_t> m_completed_ranges{0};
+
+	// range boundaries are taken from the largest keys of input SST files, so that every range
+	// covers roughly the same amount of input data, keys are not read
+	void split_ranges() {
+		std::vector<std::pair<std::string, uint64_t>> points;
+		uint64_t total_size = 0;
+
+		for (auto &db: m_dbs) {
+			for (const auto &f: db->live_files(m_column)) {
+				points.emplace_back(f.largestkey, f.size);
+				total_size += f.size;
+			}
+		}
+
+		std::sort(points.begin(), points.end());
+
+		size_t num = m_opts.ranges ? m_opts.ranges : m_opts.threads * 4;
+		uint64_t range_size = total_size / std::max<size_t>(num, 1) + 1;
+
+		std::vector<std::string> bounds;
+		uint64_t size = 0;
+		for (const auto &p: points) {
+			size += p.second;
+			if (size >= range_size * (bounds.size() + 1) && (bounds.empty() || p.first > bounds.back())) {
+				bounds.push_back(p.first);
+			}
+		}
+
+		std::string start;
+		for (const auto &b: bounds) {
+			merge_range r;
+			r.start = start;
+			r.end = b;
+			m_ranges.emplace_back(std::move(r));
+
+			start = b;
+		}
+
+		merge_range r;
+		r.start = start;
+		m_ranges.emplace_back(std::move(r));
+	}
+
+	// meta key which is ingested together with merge operands of range @idx
+	std::string marker_key(size_t idx) const {
+		return "greylock.merge." + m_id + "." + std::to_string(idx);
+	}
+
+	greylock::error_info write_marker(const std::string &path, size_t idx) {
+		auto writer = m_odb.sst_file_writer(greylock::options::meta_column);
+
+		auto s = writer->Open(path);
+		if (s.ok())
+			s = writer->Put(rocksdb::Slice(marker_key(idx)), rocksdb::Slice());
+		if (s.ok())
+			s = writer->Finish();
+		if (!s.ok()) {
+			return greylock::create_error(-s.code(), "could not write merge marker SST file %s: %s",
+					path.c_str(), s.ToString().c_str());
+		}
+
+		return greylock::error_info();
+	}
+
+	greylock::error_info merge_one_range(size_t idx) {
+		const merge_range &range = m_ranges[idx];
+		const std::string &cname = m_odb.options().column_names[m_column];
+
+		rocksdb::Slice upper(range.end);
+		rocksdb::ReadOptions ro;
+		ro.fill_cache = false;
+		ro.readahead_size = 8 * 1024 * 1024;
+		if (!range.end.empty()) {
+			ro.iterate_upper_bound = &upper;
+		}
+
+		std::vector<std::unique_ptr<rocksdb::Iterator>> its;
+		for (auto &db: m_dbs) {
+			std::unique_ptr<rocksdb::Iterator> it(db->iterator(m_column, ro));
+			if (range.start.empty()) {
+				it->SeekToFirst();
+			} else {
+				it->Seek(range.start);
+			}
+
+			its.emplace_back(std::move(it));
+		}
+
+		// heap top is the smallest key, the same keys are ordered by input number
+		auto cmp = [&] (size_t a, size_t b) -> bool {
+			int c = its[a]->key().compare(its[b]->key());
+			if (c != 0)
+				return c > 0;
+			return a > b;
+		};
+		std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+		for (size_t i = 0; i < its.size(); ++i) {
+			if (its[i]->Valid())
+				heap.push(i);
+		}
+
+		std::vector<std::string> files;
+		std::unique_ptr<rocksdb::SstFileWriter> writer;
+
+		auto finish = [&] () -> greylock::error_info {
+			if (!writer)
+				return greylock::error_info();
+
+			auto s = writer->Finish();
+			writer.reset();
+			if (!s.ok()) {
+				return greylock::create_error(-s.code(), "column: %s: could not finish SST file %s: %s",
+						cname.c_str(), files.back().c_str(), s.ToString().c_str());
+			}
+
+			return greylock::error_info();
+		};
+
+		auto remove_files = [&] () {
+			for (const auto &f: files) {
+				boost::system::error_code ec;
+				boost::filesystem::remove(f, ec);
+			}
+		};
+
+		auto next = [&] (size_t i) {
+			its[i]->Next();
+			if (its[i]->Valid())
+				heap.push(i);
+		};
+
+		try {
+			while (!heap.empty()) {
+				size_t i = heap.top();
+				heap.pop();
+
+				std::string key = its[i]->key().ToString();
+				std::deque<std::string> values;
+				values.push_back(its[i]->value().ToString());
+				next(i);
+
+				while (!heap.empty() && its[heap.top()]->key() == rocksdb::Slice(key)) {
+					i = heap.top();
+					heap.pop();
+
+					values.push_back(its[i]->value().ToString());
+					next(i);
+				}
+
+				long ds = 0;
+				for (const auto &v: values) {
+					ds += v.size();
+				}
+
+				std::string value;
+				auto err = greylock::merge_column_values(m_column, key, values, &value);
+				if (err) {
+					remove_files();
+					return err;
+				}
+
+				if (!writer) {
+					files.emplace_back(m_tmp + "/" + cname + "." + std::to_string(idx) + "." +
+							std::to_string(files.size()) + ".sst");
+
+					writer = m_odb.sst_file_writer(m_column);
+					auto s = writer->Open(files.back());
+					if (!s.ok()) {
+						remove_files();
+						return greylock::create_error(-s.code(), "column: %s: could not open SST file %s: %s",
+								cname.c_str(), files.back().c_str(), s.ToString().c_str());
+					}
+				}
+
+				rocksdb::Status s;
+				if (m_merge_operands) {
+					s = writer->Merge(rocksdb::Slice(key), rocksdb::Slice(value));
+				} else {
+					s = writer->Put(rocksdb::Slice(key), rocksdb::Slice(value));
+				}
+				if (!s.ok()) {
+					writer.reset();
+					remove_files();
+					return greylock::create_error(-s.code(), "column: %s: could not write key %s into SST file %s: %s",
+							cname.c_str(), key.c_str(), files.back().c_str(), s.ToString().c_str());
+				}
+
+				m_written_keys++;
+				m_data_size += ds;
+
+				if (writer->FileSize() >= m_opts.sst_size) {
+					err = finish();
+					if (err) {
+						remove_files();
+						return err;
+					}
+				}
+			}
+		} catch (const std::exception &e) {
+			writer.reset();
+			remove_files();
+			return greylock::create_error(-EINVAL, "column: %s: range: %ld: %s", cname.c_str(), idx, e.what());
+		}
+
+		for (size_t i = 0; i < its.size(); ++i) {
+			auto s = its[i]->status();
+			if (!s.ok()) {
+				writer.reset();
+				remove_files();
+				return greylock::create_error(-s.code(), "column: %s: range: %ld: iterator of input %ld has failed: %s",
+						cname.c_str(), idx, i, s.ToString().c_str());
+			}
+		}
+
+		auto err = finish();
+		if (!err && !files.empty()) {
+			if (m_merge_operands) {
+				// marker is ingested atomically with merge operands, restarted merge does not
+				// ingest this range again, otherwise operands would be applied twice
+				std::string marker = m_tmp + "/" + cname + "." + std::to_string(idx) + ".marker.sst";
+				err = write_marker(marker, idx);
+				if (!err) {
+					std::map<int, std::vector<std::string>> columns;
+					columns[m_column] = files;
+					columns[greylock::options::meta_column].push_back(marker);
+
+					err = m_odb.ingest(columns);
+				}
+				files.push_back(marker);
+			} else {
+				// values are written as Put, ingesting the same range again is idempotent
+				err = m_odb.ingest(m_column, files);
+			}
+		}
+
+		// ingested files are moved into database directory, anything left is garbage
+		remove_files();
+		return err;
+	}
 };
 
 int main(int argc, char *argv[])
@@ -212,19 +656,27 @@ int main(int argc, char *argv[])
 
 	bpo::options_description generic("Merge options");
 
+	merge_options opts;
 	std::string output;
 	std::vector<std::string> inputs;
-	int thread_num;
 	std::string column;
-	long print_interval;
+	size_t sst_size_mb;
 	generic.add_options()
 		("help", "This help message")
 		("column", bpo::value<std::string>(&column)->required(), "Column name to merge")
 		("compact", "Whether to compact output database or not")
 		("input", bpo::value<std::vector<std::string>>(&inputs)->required()->composing(), "Input rocksdb database")
 		("output", bpo::value<std::string>(&output)->required(), "Output rocksdb database")
-		("threads", bpo::value<int>(&thread_num)->default_value(8), "Number of merge threads")
-		("print-interval", bpo::value<long>(&print_interval)->default_value(10000), "Period to dump merge stats (in milliseconds)")
+		("threads", bpo::value<int>(&opts.threads)->default_value(opts.threads), "Number of merge threads")
+		("ranges", bpo::value<size_t>(&opts.ranges)->default_value(opts.ranges),
+			"Number of key ranges merged independently, 0 means 4 ranges per thread")
+		("sst-size", bpo::value<size_t>(&sst_size_mb)->default_value(opts.sst_size / (1024 * 1024)),
+			"Maximum size of SST file ingested into output database (in megabytes)")
+		("tmp", bpo::value<std::string>(&opts.tmp),
+			"Directory for temporary SST files and merge checkpoint, it must be on the same filesystem "
+			"as output database (default: <output>.merge), interrupted merge continues from checkpoint")
+		("print-interval", bpo::value<long>(&opts.print_interval)->default_value(opts.print_interval),
+			"Period to dump merge stats (in milliseconds)")
 		;
 
 	bpo::options_description cmdline_options;
@@ -246,6 +698,8 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	opts.sst_size = sst_size_mb * 1024 * 1024;
+
 	greylock::options opt;
 	auto it = std::find(opt.column_names.begin(), opt.column_names.end(), column);
 	if (it == opt.column_names.end()) {
@@ -256,7 +710,7 @@ int main(int argc, char *argv[])
 	auto column_id = std::distance(opt.column_names.begin(), it);
 
 	try {
-		merger m(print_interval);
+		merger m(opts);
 		m.merge(column_id, output, inputs, vm.count("compact") != 0);
 	} catch (const std::exception &e) {
 		std::cerr << "Exception: " << e.what() << std::endl;
@@ -11,6 +11,15 @@
 
 using namespace ioremap;
 
+// large document content is stored in bodies column
+static greylock::error_info read_body(greylock::database &db_docs, const std::string &dkey, greylock::document &doc)
+{
+	if (!(doc.flags & greylock::document::flag_external_body))
+		return greylock::error_info();
+
+	return db_docs.read(greylock::options::bodies_column, dkey, &doc.ctx.content);
+}
+
 static inline const char *print_time(long tsec, long tnsec)
 {
 	char str[64];
@@ -228,6 +237,13 @@ int main(int argc, char *argv[])
 							return err.code();
 						}
 
+						err = read_body(db_docs, dkey, doc);
+						if (err) {
+							fprintf(stderr, "could not read document body %s: %s [%d]\n",
+									dkey.c_str(), err.message().c_str(), err.code());
+							return err.code();
+						}
+
 						std::cout << ", doc: " << print_doc(doc);
 					}
 
@@ -266,6 +282,13 @@ int main(int argc, char *argv[])
 				return err.code();
 			}
 
+			err = read_body(db_docs, indexed_id.to_string(), doc);
+			if (err) {
+				std::cout << "could not read body of document with indexed_id: " << id_str <<
+					", error: " << err.message() << std::endl;
+				return err.code();
+			}
+
 			std::cout << "indexed_id: " << print_index(doc.indexed_id) <<
 				", doc: " << print_doc(doc) << std::endl;
 		}
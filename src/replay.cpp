@@ -0,0 +1,443 @@
+#include "greylock/database.hpp"
+#include "greylock/intersection.hpp"
+#include "greylock/json.hpp"
+#include "greylock/utils.hpp"
+
+#include <ribosome/error.hpp>
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace ioremap;
+
+// Replays recorded request bodies against running server or directly against databases.
+//
+// Every line of the input file is one request: "<path> <json body>", for example
+// "/search {"request": ...}" or "/index {"mailbox": ...}", lines without path are sent to --endpoint.
+// File is replayed --loops times, lines are handed out to --threads workers in file order,
+// thus file with both search and index requests is replayed as mixed read/write load.
+//
+// When --rate is set, request number N is scheduled at N/rate seconds from the start and its latency
+// is measured from the scheduled time, thus requests delayed by slow server are accounted (open loop).
+// Without --rate every worker sends the next request as soon as previous one has completed (closed loop).
+
+struct request {
+	std::string path;
+	std::string body;
+};
+
+static std::vector<request> load_requests(const std::string &file, const std::string &default_path) {
+	std::ifstream in(file);
+	if (!in) {
+		ribosome::throw_error(-errno, "could not open requests file %s", file.c_str());
+	}
+
+	std::vector<request> ret;
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty())
+			continue;
+
+		request r;
+		if (line[0] == '/') {
+			size_t pos = line.find_first_of(" \t");
+			if (pos == std::string::npos) {
+				ribosome::throw_error(-EINVAL, "%s: line %zd: there is no body after path",
+						file.c_str(), ret.size() + 1);
+			}
+
+			r.path = line.substr(0, pos);
+			r.body = line.substr(line.find_first_not_of(" \t", pos));
+		} else {
+			r.path = default_path;
+			r.body = line;
+		}
+
+		ret.emplace_back(std::move(r));
+	}
+
+	return ret;
+}
+
+struct endpoint_stats {
+	std::vector<long> latencies;
+	size_t errors = 0;
+
+	void merge(const endpoint_stats &other) {
+		latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+		errors += other.errors;
+	}
+};
+
+typedef std::map<std::string, endpoint_stats> stats_t;
+
+// executes one request, returns error if request has failed
+class executor {
+public:
+	virtual ~executor() {}
+	virtual greylock::error_info execute(const request &r) = 0;
+};
+
+// Minimal blocking HTTP/1.1 client, connection is kept alive between requests
+// and reopened if server has closed it.
+class http_executor : public executor {
+public:
+	http_executor(const std::string &host, const std::string &port) : m_host(host), m_port(port), m_socket(m_io) {}
+
+	virtual greylock::error_info execute(const request &r) {
+		for (int attempt = 0; attempt < 2; ++attempt) {
+			int status;
+			auto err = send(r, &status);
+			if (err) {
+				// server could have closed idle keep-alive connection, request is resent once
+				close();
+				continue;
+			}
+
+			if (status < 200 || status >= 300) {
+				return greylock::create_error(-EIO, "%s: http status %d", r.path.c_str(), status);
+			}
+
+			return greylock::error_info();
+		}
+
+		return greylock::create_error(-ECONNRESET, "%s: could not send request to %s:%s",
+				r.path.c_str(), m_host.c_str(), m_port.c_str());
+	}
+
+private:
+	std::string m_host, m_port;
+
+	boost::asio::io_service m_io;
+	boost::asio::ip::tcp::socket m_socket;
+	boost::asio::streambuf m_buf;
+	bool m_connected = false;
+
+	void close() {
+		boost::system::error_code ec;
+		m_socket.close(ec);
+		m_buf.consume(m_buf.size());
+		m_connected = false;
+	}
+
+	greylock::error_info send(const request &r, int *status) {
+		try {
+			if (!m_connected) {
+				boost::asio::ip::tcp::resolver resolver(m_io);
+				boost::asio::connect(m_socket, resolver.resolve(boost::asio::ip::tcp::resolver::query(m_host, m_port)));
+				m_socket.set_option(boost::asio::ip::tcp::no_delay(true));
+				m_connected = true;
+			}
+
+			std::ostringstream req;
+			req << "POST " << r.path << " HTTP/1.1\r\n" <<
+				"Host: " << m_host << "\r\n" <<
+				"Content-Type: application/json\r\n" <<
+				"Content-Length: " << r.body.size() << "\r\n" <<
+				"Connection: keep-alive\r\n\r\n";
+			std::string hdr = req.str();
+
+			std::vector<boost::asio::const_buffer> bufs = {
+				boost::asio::buffer(hdr),
+				boost::asio::buffer(r.body),
+			};
+			boost::asio::write(m_socket, bufs);
+
+			size_t hdr_size = boost::asio::read_until(m_socket, m_buf, "\r\n\r\n");
+			std::string headers(boost::asio::buffers_begin(m_buf.data()),
+					boost::asio::buffers_begin(m_buf.data()) + hdr_size);
+			m_buf.consume(hdr_size);
+
+			if (sscanf(headers.c_str(), "HTTP/%*d.%*d %d", status) != 1) {
+				return greylock::create_error(-EPROTO, "invalid status line");
+			}
+
+			std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+
+			bool keep_alive = headers.find("connection: close") == std::string::npos;
+			size_t pos = headers.find("content-length:");
+			if (pos == std::string::npos) {
+				// body ends when server closes connection
+				boost::system::error_code ec;
+				boost::asio::read(m_socket, m_buf, ec);
+				m_buf.consume(m_buf.size());
+				close();
+				return greylock::error_info();
+			}
+
+			size_t body_size = strtoul(headers.c_str() + pos + strlen("content-length:"), NULL, 10);
+			if (m_buf.size() < body_size) {
+				boost::asio::read(m_socket, m_buf, boost::asio::transfer_exactly(body_size - m_buf.size()));
+			}
+			m_buf.consume(body_size);
+
+			if (!keep_alive) {
+				close();
+			}
+		} catch (const std::exception &e) {
+			return greylock::create_error(-EIO, "%s", e.what());
+		}
+
+		return greylock::error_info();
+	}
+};
+
+// Runs search and count requests through @intersector in-process, other requests are not supported.
+// Exact phrase match checks are done by the server, they are skipped here.
+class local_executor : public executor {
+public:
+	local_executor(greylock::database &db_docs, greylock::database &db_indexes) : m_db_docs(db_docs), m_db_indexes(db_indexes) {}
+
+	virtual greylock::error_info execute(const request &r) {
+		bool count = r.path == "/count";
+		if (r.path != "/search" && !count) {
+			return greylock::create_error(-ENOTSUP, "%s: only /search and /count requests can be replayed locally",
+					r.path.c_str());
+		}
+
+		rapidjson::Document doc;
+		doc.Parse<0>(r.body.c_str());
+		if (doc.HasParseError() || !doc.IsObject()) {
+			return greylock::create_error(-EINVAL, "%s: could not parse request, error offset: %zd",
+					r.path.c_str(), doc.GetErrorOffset());
+		}
+
+		greylock::intersection_query iq;
+		auto err = greylock::intersection_query::parse(m_db_indexes.options(), doc, iq);
+		if (err)
+			return err;
+
+		greylock::intersector<greylock::database> inter(m_db_docs, m_db_indexes);
+		if (count) {
+			iq.projection = greylock::document::projection_ids;
+			iq.snippets = greylock::snippet_query();
+			iq.count_only = true;
+
+			if (greylock::get_bool(doc, "estimate", false)) {
+				inter.estimate(iq);
+				return greylock::error_info();
+			}
+		}
+
+		inter.intersect(iq);
+		return greylock::error_info();
+	}
+
+private:
+	greylock::database &m_db_docs;
+	greylock::database &m_db_indexes;
+};
+
+class replayer {
+public:
+	replayer(const std::vector<request> &requests, size_t loops, double rate) :
+		m_requests(requests),
+		m_total(requests.size() * loops),
+		m_rate(rate)
+	{
+	}
+
+	// every worker gets its own executor, workers run until all requests have been sent
+	void run(size_t num_threads, std::function<std::unique_ptr<executor> ()> create) {
+		m_start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < num_threads; ++i) {
+			threads.emplace_back([&] () {
+					std::unique_ptr<executor> ex = create();
+					worker(*ex);
+				});
+		}
+
+		for (auto &t: threads) {
+			t.join();
+		}
+
+		m_duration = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - m_start).count();
+	}
+
+	void print() {
+		printf("requests: %zd, duration: %.2f s, throughput: %.1f rps\n",
+				m_total, m_duration / 1000000., m_total * 1000000. / std::max(m_duration, 1L));
+
+		for (auto &p: m_stats) {
+			auto &lat = p.second.latencies;
+			std::sort(lat.begin(), lat.end());
+
+			auto percentile = [&] (double q) -> double {
+				if (lat.empty())
+					return 0;
+
+				size_t idx = std::min(lat.size() - 1, (size_t)(q * lat.size()));
+				return lat[idx] / 1000.;
+			};
+
+			printf("%s: requests: %zd, errors: %zd, throughput: %.1f rps, latency ms: "
+					"p50: %.2f, p90: %.2f, p99: %.2f, p999: %.2f, max: %.2f\n",
+					p.first.c_str(), lat.size(), p.second.errors,
+					lat.size() * 1000000. / std::max(m_duration, 1L),
+					percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+					lat.empty() ? 0. : lat.back() / 1000.);
+		}
+	}
+
+private:
+	const std::vector<request> &m_requests;
+	size_t m_total;
+	double m_rate;
+
+	std::atomic_size_t m_next{0};
+	std::chrono::steady_clock::time_point m_start;
+	long m_duration = 0;
+
+	std::mutex m_lock;
+	stats_t m_stats;
+
+	void worker(executor &ex) {
+		stats_t stats;
+
+		while (true) {
+			size_t idx = m_next++;
+			if (idx >= m_total)
+				break;
+
+			const request &r = m_requests[idx % m_requests.size()];
+
+			auto start = std::chrono::steady_clock::now();
+			if (m_rate > 0) {
+				start = m_start + std::chrono::microseconds((long)(idx * 1000000. / m_rate));
+				std::this_thread::sleep_until(start);
+			}
+
+			auto err = ex.execute(r);
+
+			long usec = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start).count();
+
+			auto &st = stats[r.path];
+			if (err) {
+				if (st.errors++ == 0) {
+					fprintf(stderr, "%s\n", err.message().c_str());
+				}
+				continue;
+			}
+			st.latencies.push_back(usec);
+		}
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (const auto &p: stats) {
+			m_stats[p.first].merge(p.second);
+		}
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Request replay options");
+	generic.add_options()
+		("help", "this help message")
+		;
+
+	std::string input, endpoint, remote, docs_path, indexes_path;
+	size_t threads, loops;
+	double rate;
+	bpo::options_description gr("Replay options");
+	gr.add_options()
+		("input", bpo::value<std::string>(&input)->required(),
+			"file with requests, one per line: '<path> <json body>' or '<json body>'")
+		("endpoint", bpo::value<std::string>(&endpoint)->default_value("/search"), "path of the requests without explicit path")
+		("remote", bpo::value<std::string>(&remote), "server address, host:port")
+		("docs", bpo::value<std::string>(&docs_path), "path to documents database, it is opened read-only, "
+			"search requests are executed in-process when remote server is not specified")
+		("indexes", bpo::value<std::string>(&indexes_path), "path to indexes database, it is opened read-only")
+		("threads", bpo::value<size_t>(&threads)->default_value(8), "number of concurrent workers")
+		("rate", bpo::value<double>(&rate)->default_value(0), "total number of requests per second, 0 - as fast as possible")
+		("loops", bpo::value<size_t>(&loops)->default_value(1), "number of times the file is replayed")
+		;
+
+	bpo::options_description cmdline_options;
+	cmdline_options.add(generic).add(gr);
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << cmdline_options << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << cmdline_options << std::endl;
+		return -1;
+	}
+
+	if (remote.empty() && (docs_path.empty() || indexes_path.empty())) {
+		std::cerr << "Either remote server or both database paths must be specified\n" << cmdline_options << std::endl;
+		return -EINVAL;
+	}
+
+	try {
+		std::vector<request> requests = load_requests(input, endpoint);
+		if (requests.empty()) {
+			std::cerr << "There are no requests in " << input << std::endl;
+			return -ENOENT;
+		}
+
+		replayer rp(requests, loops, rate);
+
+		if (!remote.empty()) {
+			size_t pos = remote.rfind(':');
+			if (pos == std::string::npos) {
+				std::cerr << "Invalid remote address " << remote << ", must be host:port" << std::endl;
+				return -EINVAL;
+			}
+
+			std::string host = remote.substr(0, pos);
+			std::string port = remote.substr(pos + 1);
+
+			rp.run(threads, [&] () {
+					return std::unique_ptr<executor>(new http_executor(host, port));
+				});
+		} else {
+			greylock::database db_docs, db_indexes;
+
+			auto err = db_docs.open_read_only(docs_path);
+			if (err) {
+				std::cerr << "could not open documents database: " << err.message() << std::endl;
+				return err.code();
+			}
+
+			err = db_indexes.open_read_only(indexes_path);
+			if (err) {
+				std::cerr << "could not open indexes database: " << err.message() << std::endl;
+				return err.code();
+			}
+
+			rp.run(threads, [&] () {
+					return std::unique_ptr<executor>(new local_executor(db_docs, db_indexes));
+				});
+		}
+
+		rp.print();
+	} catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include "greylock/database.hpp"
+#include "greylock/segment.hpp"
+#include "greylock/types.hpp"
+
+#include <ribosome/error.hpp>
+#include <ribosome/timer.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <time.h>
+
+#include <iostream>
+
+using namespace ioremap;
+
+// Writes posting lists of shards [@start, @end) from indexes database into segment file @output.
+static void create(const std::string &input, const std::string &output, size_t start, size_t end) {
+	greylock::database db;
+	auto err = db.open_read_only(input);
+	if (err) {
+		ribosome::throw_error(err.code(), "could not open indexes database: %s: %s",
+				input.c_str(), err.message().c_str());
+	}
+
+	greylock::segment_writer writer;
+	err = writer.open(output, start, end);
+	if (err) {
+		ribosome::throw_error(err.code(), "%s", err.message().c_str());
+	}
+
+	ribosome::timer tm;
+
+	// posting list keys are prefixed with shard number, all shards of the segment form contiguous key range
+	std::string first_key = greylock::document::generate_index_key_shard_number("", start);
+	std::string last_key = greylock::document::generate_index_key_shard_number("", end);
+
+	rocksdb::ReadOptions ro;
+	ro.fill_cache = false;
+	std::unique_ptr<rocksdb::Iterator> it(db.iterator(greylock::options::indexes_column, ro));
+
+	size_t data_size = 0, ids = 0;
+	for (it->Seek(first_key); it->Valid(); it->Next()) {
+		std::string key = it->key().ToString();
+		if (key >= last_key)
+			break;
+
+		greylock::disk_index idx;
+		err = greylock::deserialize(idx, it->value().data(), it->value().size());
+		if (err) {
+			ribosome::throw_error(err.code(), "could not deserialize posting list %s: %s",
+					key.c_str(), err.message().c_str());
+		}
+
+		if (idx.ids.empty())
+			continue;
+
+		err = writer.append(key, idx.ids);
+		if (err) {
+			ribosome::throw_error(err.code(), "%s", err.message().c_str());
+		}
+
+		data_size += it->value().size();
+		ids += idx.ids.size();
+
+		if (writer.num_keys() % 100000 == 0) {
+			printf("%.2fs: keys: %ld, ids: %ld, encoded size: %.2f MB, last key: %s\n",
+					tm.elapsed() / 1000., writer.num_keys(), ids, data_size / (1024. * 1024.), key.c_str());
+		}
+	}
+
+	if (!it->status().ok()) {
+		auto s = it->status();
+		ribosome::throw_error(-s.code(), "iterator has become invalid during iteration: %s [%d]",
+				s.ToString().c_str(), s.code());
+	}
+
+	err = writer.finish();
+	if (err) {
+		ribosome::throw_error(err.code(), "%s", err.message().c_str());
+	}
+
+	printf("%.2fs: segment %s has been written: shards: [%ld, %ld), keys: %ld, ids: %ld, encoded size: %.2f MB\n",
+			tm.elapsed() / 1000., output.c_str(), start, end, writer.num_keys(), ids, data_size / (1024. * 1024.));
+}
+
+static void info(const std::string &path, bool keys) {
+	std::shared_ptr<const greylock::segment> seg;
+	auto err = greylock::segment::open(path, &seg);
+	if (err) {
+		ribosome::throw_error(err.code(), "%s", err.message().c_str());
+	}
+
+	printf("segment: %s, shards: [%ld, %ld), keys: %ld, size: %.2f MB\n",
+			seg->path().c_str(), seg->shard_start(), seg->shard_end(), seg->num_keys(),
+			seg->size() / (1024. * 1024.));
+
+	if (keys) {
+		for (size_t i = 0; i < seg->num_keys(); ++i) {
+			std::string key = seg->key(i);
+
+			greylock::posting_list pl;
+			seg->find(key, &pl);
+			printf("key: %s, ids: %ld\n", key.c_str(), pl.size);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Segment options");
+
+	std::string input, output, info_path;
+	size_t start, end;
+	generic.add_options()
+		("help", "This help message")
+		("indexes", bpo::value<std::string>(&input), "Input indexes rocksdb database")
+		("output", bpo::value<std::string>(&output), "Segment file to create, server loads files with .seg extension")
+		("start", bpo::value<size_t>(&start)->default_value(0), "First shard number to write into segment")
+		("end", bpo::value<size_t>(&end), "Shard number after the last one written into segment")
+		("force", "Allow segment to include current and future shards, which are still being updated")
+		("info", bpo::value<std::string>(&info_path), "Print information about given segment file")
+		("keys", "List posting list keys and sizes with --info")
+		;
+
+	bpo::options_description cmdline_options;
+	cmdline_options.add(generic);
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	try {
+		if (vm.count("info")) {
+			info(info_path, vm.count("keys") != 0);
+			return 0;
+		}
+
+		if (!vm.count("indexes") || !vm.count("output") || !vm.count("end")) {
+			std::cerr << "Either --info or --indexes, --output and --end must be specified\n" << generic << std::endl;
+			return -1;
+		}
+
+		if (end <= start) {
+			std::cerr << "Invalid shard range [" << start << ", " << end << ")" << std::endl;
+			return -EINVAL;
+		}
+
+		greylock::options opt;
+		size_t current_shard = time(NULL) / opt.tokens_shard_size;
+		if (end > current_shard && !vm.count("force")) {
+			std::cerr << "Shard range [" << start << ", " << end << ") includes shards which are not frozen yet, " <<
+				"current shard: " << current_shard << ", use --force to write it anyway" << std::endl;
+			return -EINVAL;
+		}
+
+		create(input, output, start, end);
+	} catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
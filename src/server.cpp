@@ -1,8 +1,14 @@
+#include "greylock/batch.hpp"
+#include "greylock/cache.hpp"
 #include "greylock/database.hpp"
 #include "greylock/error.hpp"
 #include "greylock/json.hpp"
 #include "greylock/jsonvalue.hpp"
 #include "greylock/intersection.hpp"
+#include "greylock/metrics.hpp"
+#include "greylock/parser.hpp"
+#include "greylock/pipeline.hpp"
+#include "greylock/segment.hpp"
 #include "greylock/types.hpp"
 #include "greylock/utils.hpp"
 
@@ -12,6 +18,7 @@
 #include <thevoid/server.hpp>
 #include <thevoid/stream.hpp>
 
+#include <ribosome/expiration.hpp>
 #include <ribosome/html.hpp>
 #include <ribosome/split.hpp>
 #include <ribosome/timer.hpp>
@@ -20,7 +27,10 @@
 
 #include <msgpack.hpp>
 
+#include <atomic>
 #include <functional>
+#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 
@@ -66,16 +76,37 @@ struct simple_request_stream_error : public thevoid::simple_request_stream<Serve
 	}
 };
 
+// posting lists of frozen shards are read from segments, everything else from rocksdb
+typedef greylock::segmented_database<greylock::database> search_database;
+
 class http_server : public thevoid::server<http_server>
 {
 public:
 	virtual ~http_server() {
+		m_retention_timer.stop();
+
+		// running range compaction stops after chunks which are being compacted now
+		m_compaction_stop = true;
+		if (m_compaction.joinable()) {
+			m_compaction.join();
+		}
 	}
 
 	virtual bool initialize(const rapidjson::Value &config) {
 		if (!rocksdb_init(config))
 			return false;
 
+		pipeline_init(config);
+		retention_init(config);
+
+		const auto &sconf = greylock::get_object(config, "search");
+		if (sconf.IsObject()) {
+			m_slow_query_ms = greylock::get_int64(sconf, "slow_query_ms", m_slow_query_ms);
+			m_batch_threads = greylock::get_int64(sconf, "batch_threads", m_batch_threads);
+			m_batch_cache_size = greylock::get_int64(sconf, "batch_cache_mb", m_batch_cache_size / (1024 * 1024)) * 1024 * 1024;
+		}
+		m_batch_threads_free = m_batch_threads;
+
 		on<on_ping>(
 			options::exact_match("/ping"),
 			options::methods("GET")
@@ -86,16 +117,41 @@ public:
 			options::methods("POST", "PUT")
 		);
 
+		on<on_expire>(
+			options::exact_match("/expire"),
+			options::methods("POST", "PUT")
+		);
+
 		on<on_index>(
 			options::exact_match("/index"),
 			options::methods("POST", "PUT")
 		);
 
+		on<on_delete>(
+			options::exact_match("/delete"),
+			options::methods("POST", "PUT")
+		);
+
 		on<on_search>(
 			options::exact_match("/search"),
 			options::methods("POST", "PUT")
 		);
 
+		on<on_search_batch>(
+			options::exact_match("/search/batch"),
+			options::methods("POST", "PUT")
+		);
+
+		on<on_count>(
+			options::exact_match("/count"),
+			options::methods("POST", "PUT")
+		);
+
+		on<on_metrics>(
+			options::exact_match("/metrics"),
+			options::methods("GET")
+		);
+
 		return true;
 	}
 
@@ -108,18 +164,184 @@ public:
 		}
 	};
 
+	// Without request body both databases are fully compacted before reply is sent.
+	// Request {"db": "docs|indexes", "column": name, "size_mb": chunk size, "threads": N, "rate_mb": MB/s}
+	// starts background compaction of the column split into chunks, several chunks are compacted concurrently.
+	// "rate_mb" limits compaction and flush writes while this compaction runs, configured limit is restored afterwards.
 	struct on_compact : public simple_request_stream_error<http_server> {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) req;
+
+			greylock::usec_timer tm;
+
+			if (boost::asio::buffer_size(buffer) == 0) {
+				auto err = server()->db_docs().compact();
+				if (!err) {
+					err = server()->db_indexes().compact();
+				}
+				if (err) {
+					send_error(swarm::http_response::internal_server_error, err.code(), "compact: %s",
+							err.message().c_str());
+					return;
+				}
+
+				this->send_reply(thevoid::http_response::ok);
+
+				server()->observe_request("compact", tm.elapsed());
+				return;
+			}
+
+			std::string data(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
+
+			rapidjson::Document doc;
+			doc.Parse<0>(data.c_str());
+
+			if (doc.HasParseError() || !doc.IsObject()) {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"compact: could not parse document, error offset: %d", doc.GetErrorOffset());
+				return;
+			}
+
+			std::string db_name = greylock::get_string(doc, "db", "indexes");
+			if (db_name != "docs" && db_name != "indexes") {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"compact: invalid database %s, must be docs or indexes", db_name.c_str());
+				return;
+			}
+			greylock::database &db = (db_name == "docs") ? server()->db_docs() : server()->db_indexes();
+
+			std::string cname = greylock::get_string(doc, "column", "");
+			const auto &names = db.options().column_names;
+			auto it = std::find(names.begin(), names.end(), cname);
+			if (it == names.end()) {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"compact: invalid column '%s'", cname.c_str());
+				return;
+			}
+
+			long size_mb = greylock::get_int64(doc, "size_mb", 1024);
+			long threads = greylock::get_int64(doc, "threads", 2);
+			long rate_mb = greylock::get_int64(doc, "rate_mb", 0);
+			if (size_mb <= 0 || threads <= 0) {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"compact: invalid chunk size %ld MB or number of threads %ld", size_mb, threads);
+				return;
+			}
+
+			size_t chunks;
+			auto err = server()->start_compaction(db_name, db, std::distance(names.begin(), it),
+					size_mb * 1024 * 1024, threads, rate_mb * 1024 * 1024, &chunks);
+			if (err) {
+				int status = (err.code() == -EBUSY) ? swarm::http_response::service_unavailable :
+					swarm::http_response::bad_request;
+				send_error(status, err.code(), "compact: %s", err.message().c_str());
+				return;
+			}
+
+			greylock::JsonValue ret;
+			ret.AddMember("chunks", (uint64_t)chunks, ret.GetAllocator());
+
+			std::string reply_data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::accepted);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(reply_data.size());
+
+			this->send_reply(std::move(reply), std::move(reply_data));
+
+			server()->observe_request("compact", tm.elapsed());
+		}
+	};
+
+	// exports request latency histograms, search stage timings, ingestion pipeline state
+	// and rocksdb statistics of both databases in prometheus text format
+	struct on_metrics : public simple_request_stream_error<http_server> {
 		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
 			(void) req;
 			(void) buffer;
 
-			server()->db_docs().compact();
-			server()->db_indexes().compact();
-			this->send_reply(thevoid::http_response::ok);
+			std::ostringstream out;
+			server()->metrics().dump(out);
+
+			out << "# TYPE greylock_ingest_write_errors counter\n";
+			out << "greylock_ingest_write_errors " << server()->pipeline().write_errors() << "\n";
+			out << "# TYPE greylock_ingest_queued gauge\n";
+			out << "greylock_ingest_queued " << server()->pipeline().queued() << "\n";
+
+			greylock::metrics::dump_database(out, "docs", server()->db_docs());
+			greylock::metrics::dump_database(out, "indexes", server()->db_indexes());
+
+			std::string data = out.str();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/plain; version=0.0.4");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
 		}
 	};
 
-	struct on_search : public simple_request_stream_error<http_server> {
+	// drops shards older than given number of days: { "days": 90 },
+	// configured retention period is used if request body is empty
+	struct on_expire : public simple_request_stream_error<http_server> {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) req;
+
+			greylock::usec_timer expire_tm;
+			long days = server()->retention_days();
+
+			if (boost::asio::buffer_size(buffer) != 0) {
+				// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
+				std::string data(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
+
+				rapidjson::Document doc;
+				doc.Parse<0>(data.c_str());
+
+				if (doc.HasParseError() || !doc.IsObject()) {
+					send_error(swarm::http_response::bad_request, -EINVAL,
+							"expire: could not parse document, error offset: %d", doc.GetErrorOffset());
+					return;
+				}
+
+				days = greylock::get_int64(doc, "days", days);
+			}
+
+			if (days <= 0) {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"expire: there is no retention period in config and request, days: %ld", days);
+				return;
+			}
+
+			size_t shard;
+			auto err = server()->expire(days, &shard);
+			if (err) {
+				send_error(swarm::http_response::internal_server_error, err.code(), "expire: %s", err.message().c_str());
+				return;
+			}
+
+			greylock::JsonValue ret;
+			ret.AddMember("days", (int64_t)days, ret.GetAllocator());
+			ret.AddMember("expired_shard", (uint64_t)shard, ret.GetAllocator());
+
+			std::string data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
+
+			server()->observe_request("expire", expire_tm.elapsed());
+
+			ILOG_INFO("expire: days: %ld, expired shard: %ld, duration: %ld ms", days, shard, expire_tm.elapsed() / 1000);
+		}
+	};
+
+	// common part of the search handlers: query parsing and exact phrase match checks
+	struct on_search_base : public simple_request_stream_error<http_server> {
 		bool check_negation(const std::vector<greylock::token> &tokens, const std::vector<std::string> &content) {
 			for (const auto &t: tokens) {
 				for (const auto &word: content) {
@@ -207,86 +429,138 @@ public:
 			return true;
 		}
 
-		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
-			(void) req;
-
-			ribosome::timer search_tm;
+		// parses search request object @doc into intersection query @iq
+		greylock::error_info parse_query(const rapidjson::Value &doc, greylock::intersection_query &iq) {
+			return greylock::intersection_query::parse(server()->db_indexes().options(), doc, iq);
+		}
 
+		// parses request body into @doc, sends error reply and returns false if it is not a valid JSON object
+		bool parse_document(const char *name, const boost::asio::const_buffer &buffer, rapidjson::Document &doc) {
 			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
 			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)),
 					boost::asio::buffer_size(buffer));
 
-			rapidjson::Document doc;
 			doc.Parse<0>(data.c_str());
 
 			if (doc.HasParseError()) {
 				send_error(swarm::http_response::bad_request, -EINVAL,
-						"search: could not parse document: %s, error offset: %d",
-						doc.GetParseError(), doc.GetErrorOffset());
-				return;
+						"%s: could not parse document: %s, error offset: %d",
+						name, doc.GetParseError(), doc.GetErrorOffset());
+				return false;
 			}
 			if (!doc.IsObject()) {
-				send_error(swarm::http_response::bad_request, -EINVAL, "search: document must be object");
-				return;
+				send_error(swarm::http_response::bad_request, -EINVAL, "%s: document must be object", name);
+				return false;
 			}
 
-			greylock::intersection_query iq;
+			return true;
+		}
+
+		// parses request body into @doc and then into intersection query @iq,
+		// sends error reply and returns false if request is invalid
+		bool parse_request(const char *name, const boost::asio::const_buffer &buffer,
+				rapidjson::Document &doc, greylock::intersection_query &iq) {
+			if (!parse_document(name, buffer, doc))
+				return false;
 
-			const auto &paging = greylock::get_object(doc, "paging");
-			if (paging.IsObject()) {
-				iq.next_document_id = greylock::id_t(greylock::get_string(paging, "next_document_id"));
-				iq.max_number = greylock::get_int64(paging, "max_number", LONG_MAX);
+			auto err = parse_query(doc, iq);
+			if (err) {
+				send_error(swarm::http_response::bad_request, err.code(), "%s: %s", name, err.message().c_str());
+				return false;
 			}
 
-			long sec_start = 0, sec_end = LONG_MAX;
-			const auto &time = greylock::get_object(doc, "time");
-			if (time.IsObject()) {
-				sec_start = greylock::get_int64(time, "start", sec_start);
-				sec_end = greylock::get_int64(time, "end", sec_end);
+			return true;
+		}
+
+		// per-token posting list counters, candidate checks and time spent in every stage of the intersection
+		void pack_explain(rapidjson::Value &parent, rapidjson::Document::AllocatorType &allocator,
+				const greylock::search_result &result) {
+			const auto &ex = result.explain;
+			rapidjson::Value jex(rapidjson::kObjectType);
+
+			rapidjson::Value timings(rapidjson::kObjectType);
+			timings.AddMember("shard_lookup", (int64_t)result.timings.shard_lookup, allocator);
+			timings.AddMember("postings", (int64_t)result.timings.postings, allocator);
+			timings.AddMember("intersection", (int64_t)result.timings.intersection, allocator);
+			timings.AddMember("documents", (int64_t)result.timings.documents, allocator);
+			jex.AddMember("timings_usec", timings, allocator);
+
+			jex.AddMember("candidates", (uint64_t)ex.candidates, allocator);
+			jex.AddMember("negation_rejected", (uint64_t)ex.negation_rejected, allocator);
+			jex.AddMember("deleted_rejected", (uint64_t)ex.deleted_rejected, allocator);
+			jex.AddMember("documents_read", (uint64_t)ex.documents_read, allocator);
+			jex.AddMember("documents_missing", (uint64_t)ex.documents_missing, allocator);
+			jex.AddMember("check_rejected", (uint64_t)ex.check_rejected, allocator);
+
+			rapidjson::Value tokens(rapidjson::kArrayType);
+			for (const auto &te: ex.tokens) {
+				rapidjson::Value jt(rapidjson::kObjectType);
+
+				rapidjson::Value mv(te.mbox.c_str(), te.mbox.size(), allocator);
+				jt.AddMember("mbox", mv, allocator);
+				rapidjson::Value av(te.attr.c_str(), te.attr.size(), allocator);
+				jt.AddMember("attr", av, allocator);
+				rapidjson::Value tv(te.token.c_str(), te.token.size(), allocator);
+				jt.AddMember("token", tv, allocator);
+				jt.AddMember("negation", te.negation, allocator);
+
+				jt.AddMember("shards_considered", (uint64_t)te.shards_considered, allocator);
+				jt.AddMember("shards_loaded", (uint64_t)te.stats.shards_loaded, allocator);
+				jt.AddMember("bytes_read", (uint64_t)te.stats.bytes_read, allocator);
+				jt.AddMember("ids_decoded", (uint64_t)te.stats.ids_decoded, allocator);
+				jt.AddMember("shards_mapped", (uint64_t)te.stats.shards_mapped, allocator);
+				jt.AddMember("rewinds", (uint64_t)te.stats.rewinds, allocator);
+				jt.AddMember("read_usec", (int64_t)te.stats.read_usec, allocator);
+
+				tokens.PushBack(jt, allocator);
 			}
-			iq.range_start.set_timestamp(sec_start, 0);
-			iq.range_end.set_timestamp(sec_end, 0);
+			jex.AddMember("tokens", tokens, allocator);
 
+			parent.AddMember("explain", jex, allocator);
+		}
 
-			std::vector<greylock::mailbox_query> se;
-			const auto &request = greylock::get_object(doc, "request");
-			if (!request.IsObject()) {
-				send_error(swarm::http_response::bad_request, -EINVAL, "search: document must contain 'request' object");
+		// queries which took longer than configured threshold are logged together with their execution counters
+		void log_slow_query(const char *name, const greylock::intersection_query &iq,
+				const greylock::search_result &result, long duration_usec) {
+			long threshold = server()->slow_query_usec();
+			if (threshold <= 0 || duration_usec < threshold)
 				return;
-			}
 
-			for (auto it = request.MemberBegin(), jse_end = request.MemberEnd(); it != jse_end; ++it) {
-				if (!it->value.IsObject()) {
-					send_error(swarm::http_response::bad_request, -EINVAL,
-							"search: mailbox query '%s' must contain object",
-								it->name.GetString());
-					return;
-				}
+			greylock::JsonValue ret;
+			pack_explain(ret, ret.GetAllocator(), result);
 
-				greylock::mailbox_query q(server()->db_indexes().options(), it->value);
-				if (q.parse_error) {
-					send_error(swarm::http_response::bad_request, q.parse_error.code(),
-							"search: could not parse mailbox query: %s",
-								q.parse_error.message().c_str());
-					return;
-				}
+			ILOG_WARNING("%s: slow query: %s, duration: %ld ms, explain: %s",
+					name, iq.to_string().c_str(), duration_usec / 1000, ret.ToString().c_str());
+		}
+	};
 
-				q.mbox.assign(it->name.GetString(), it->name.GetStringLength());
+	struct on_search : public on_search_base {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) req;
 
-				iq.se.emplace_back(std::move(q));
-			}
+			greylock::usec_timer search_tm;
+
+			rapidjson::Document doc;
+			greylock::intersection_query iq;
+			if (!parse_request("search", buffer, doc, iq))
+				return;
 
 			greylock::search_result result;
-			greylock::intersector<greylock::database> inter(server()->db_docs(), server()->db_indexes());
+			greylock::intersector<search_database> inter(server()->search_docs(), server()->search_indexes());
 			result = inter.intersect(iq, std::bind(&on_search::check_result, this, std::ref(iq), std::placeholders::_1));
 
-			send_search_result(result);
+			greylock::usec_timer send_tm;
+			send_search_result(iq, result);
+
+			server()->observe_search(result.timings, send_tm.elapsed());
+			server()->observe_request("search", search_tm.elapsed());
+			log_slow_query("search", iq, result, search_tm.elapsed());
 
 			ILOG_INFO("search: query: %s, next_document_id: %s -> %s, indexes: %ld/%ld, completed: %d, duration: %d ms",
 					iq.to_string().c_str(),
 					iq.next_document_id.to_string().c_str(), result.next_document_id.to_string().c_str(),
 					result.docs.size(), iq.max_number,
-					result.completed, search_tm.elapsed());
+					result.completed, search_tm.elapsed() / 1000);
 		}
 
 		void pack_string_array(rapidjson::Value &parent, rapidjson::Document::AllocatorType &allocator,
@@ -311,9 +585,57 @@ public:
 			parent.AddMember(name, arr, allocator);
 		}
 
-		void send_search_result(const greylock::search_result &result) {
-			greylock::JsonValue ret;
-			auto &allocator = ret.GetAllocator();
+		void pack_aggregations(rapidjson::Value &parent, rapidjson::Document::AllocatorType &allocator,
+				const greylock::search_result &result) {
+			rapidjson::Value aggregations(rapidjson::kObjectType);
+
+			rapidjson::Value histogram(rapidjson::kArrayType);
+			for (const auto &p: result.histogram) {
+				rapidjson::Value bucket(rapidjson::kObjectType);
+				bucket.AddMember("tsec", p.first, allocator);
+				bucket.AddMember("count", (uint64_t)p.second, allocator);
+				histogram.PushBack(bucket, allocator);
+			}
+			aggregations.AddMember("histogram", histogram, allocator);
+
+			rapidjson::Value facets(rapidjson::kObjectType);
+			for (const auto &attr: result.facets) {
+				rapidjson::Value tokens(rapidjson::kArrayType);
+				for (const auto &p: attr.second) {
+					rapidjson::Value token(rapidjson::kObjectType);
+					rapidjson::Value tv(p.first.c_str(), p.first.size(), allocator);
+					token.AddMember("token", tv, allocator);
+					token.AddMember("count", (uint64_t)p.second, allocator);
+					tokens.PushBack(token, allocator);
+				}
+
+				rapidjson::Value name(attr.first.c_str(), attr.first.size(), allocator);
+				facets.AddMember(name, tokens, allocator);
+			}
+			aggregations.AddMember("facets", facets, allocator);
+
+			// attributes whose facets have been computed over the most frequent tokens only
+			rapidjson::Value truncated(rapidjson::kArrayType);
+			for (const auto &attr: result.truncated_facets) {
+				rapidjson::Value name(attr.c_str(), attr.size(), allocator);
+				truncated.PushBack(name, allocator);
+			}
+			aggregations.AddMember("truncated_facets", truncated, allocator);
+
+			parent.AddMember("aggregations", aggregations, allocator);
+		}
+
+		// @iq.projection specifies which document fields are sent to client,
+		// it can be smaller than what has been read from the database (for example to check exact phrase match)
+		void pack_search_result(rapidjson::Value &ret, rapidjson::Document::AllocatorType &allocator,
+				const greylock::intersection_query &iq, const greylock::search_result &result) {
+			int projection = iq.projection;
+
+			std::set<std::string> token_names;
+			if (!iq.snippets.empty()) {
+				token_names = iq.token_names();
+			}
+			greylock::snippet_generator snippets(iq.snippets, token_names);
 
 			rapidjson::Value ids(rapidjson::kArrayType);
 			for (auto it = result.docs.begin(), end = result.docs.end(); it != end; ++it) {
@@ -321,27 +643,37 @@ public:
 
 				const greylock::document &doc = it->doc;
 
-				rapidjson::Value idv(doc.id.c_str(), doc.id.size(), allocator);
-				key.AddMember("id", idv, allocator);
-
 				std::string id_str = doc.indexed_id.to_string();
 				rapidjson::Value indv(id_str.c_str(), id_str.size(), allocator);
 				key.AddMember("indexed_id", indv, allocator);
 
-				rapidjson::Value av(doc.author.c_str(), doc.author.size(), allocator);
-				key.AddMember("author", av, allocator);
+				if (projection != greylock::document::projection_ids) {
+					rapidjson::Value idv(doc.id.c_str(), doc.id.size(), allocator);
+					key.AddMember("id", idv, allocator);
 
-				rapidjson::Value cv(rapidjson::kObjectType);
+					rapidjson::Value av(doc.author.c_str(), doc.author.size(), allocator);
+					key.AddMember("author", av, allocator);
 
-				rapidjson::Value csv(doc.ctx.content.c_str(), doc.ctx.content.size(), allocator);
-				cv.AddMember("content", csv, allocator);
+					rapidjson::Value cv(rapidjson::kObjectType);
 
-				rapidjson::Value tsv(doc.ctx.title.c_str(), doc.ctx.title.size(), allocator);
-				cv.AddMember("title", tsv, allocator);
+					if (projection == greylock::document::projection_full) {
+						rapidjson::Value csv(doc.ctx.content.c_str(), doc.ctx.content.size(), allocator);
+						cv.AddMember("content", csv, allocator);
+					}
+
+					rapidjson::Value tsv(doc.ctx.title.c_str(), doc.ctx.title.size(), allocator);
+					cv.AddMember("title", tsv, allocator);
+
+					if (projection == greylock::document::projection_full) {
+						pack_string_array(cv, allocator, "links", doc.ctx.links);
+						pack_string_array(cv, allocator, "images", doc.ctx.images);
+					}
 
-				pack_string_array(cv, allocator, "links", doc.ctx.links);
-				pack_string_array(cv, allocator, "images", doc.ctx.images);
-				key.AddMember("content", cv, allocator);
+					if (!iq.snippets.empty()) {
+						pack_string_array(cv, allocator, "snippets", snippets.generate(doc.ctx.content));
+					}
+					key.AddMember("content", cv, allocator);
+				}
 
 				key.AddMember("relevance", it->relevance, allocator);
 
@@ -358,10 +690,24 @@ public:
 			ret.AddMember("ids", ids, allocator);
 			ret.AddMember("completed", result.completed, allocator);
 
+			if (!iq.aggregation.empty()) {
+				ret.AddMember("count", (uint64_t)result.count, allocator);
+				pack_aggregations(ret, allocator, result);
+			}
+
 			std::string next_id_str = result.next_document_id.to_string();
 			rapidjson::Value nidv(next_id_str.c_str(), next_id_str.size(), allocator);
 			ret.AddMember("next_document_id", nidv, allocator);
 
+			if (iq.explain) {
+				pack_explain(ret, allocator, result);
+			}
+		}
+
+		void send_search_result(const greylock::intersection_query &iq, const greylock::search_result &result) {
+			greylock::JsonValue ret;
+			pack_search_result(ret, ret.GetAllocator(), iq, result);
+
 			std::string data = ret.ToString();
 
 			thevoid::http_response reply;
@@ -373,206 +719,322 @@ public:
 		}
 	};
 
-	struct on_index : public simple_request_stream_error<http_server> {
-		greylock::error_info process_one_document(greylock::document &doc) {
-			doc.generate_token_keys(server()->db_indexes().options());
-
-			rocksdb::WriteBatch docs_batch, indexes_batch;
-
-			std::string doc_serialized = serialize(doc);
-			rocksdb::Slice doc_value(doc_serialized);
+	// Executes array of search queries concurrently: {"queries": [search request, ...]}.
+	// Token shard lists, posting lists and documents are read once per batch and shared among all queries,
+	// results are returned in the same order as queries: {"results": [search reply, ...]}.
+	struct on_search_batch : public on_search {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) req;
 
-			greylock::document_for_index did;
-			did.indexed_id = doc.indexed_id;
-			std::string sdid = serialize(did);
+			greylock::usec_timer search_tm;
 
-			size_t indexes = 0;
-			for (const auto &attr: doc.idx.attributes) {
-				for (const auto &t: attr.tokens) {
-					indexes_batch.Merge(rocksdb::Slice(t.key), rocksdb::Slice(sdid));
+			rapidjson::Document doc;
+			if (!parse_document("search_batch", buffer, doc))
+				return;
 
-					greylock::disk_token dt(t.shards);
-					std::string dts = serialize(dt);
+			const auto &jqueries = greylock::get_array(doc, "queries");
+			if (!jqueries.IsArray()) {
+				send_error(swarm::http_response::bad_request, -EINVAL,
+						"search_batch: document must contain 'queries' array");
+				return;
+			}
 
-					indexes_batch.Merge(rocksdb::Slice(t.shard_key), rocksdb::Slice(dts));
+			std::vector<greylock::intersection_query> queries;
+			queries.reserve(jqueries.Size());
+			for (auto it = jqueries.Begin(), end = jqueries.End(); it != end; ++it) {
+				if (!it->IsObject()) {
+					send_error(swarm::http_response::bad_request, -EINVAL,
+							"search_batch: query %ld must be object", queries.size());
+					return;
+				}
 
-					indexes++;
+				greylock::intersection_query iq;
+				auto err = parse_query(*it, iq);
+				if (err) {
+					send_error(swarm::http_response::bad_request, err.code(),
+							"search_batch: query %ld: %s", queries.size(), err.message().c_str());
+					return;
 				}
+
+				queries.emplace_back(std::move(iq));
 			}
 
-			// we must have a copy, since otherwise batch will cache stall pointer to rvalue
-			std::string dkey = doc.indexed_id.to_string();
-			docs_batch.Put(server()->db_docs().cfhandle(greylock::options::documents_column), rocksdb::Slice(dkey), doc_value);
+			greylock::read_cache<search_database> docs_cache(server()->search_docs(), server()->batch_cache_size() / 2);
+			greylock::read_cache<search_database> indexes_cache(server()->search_indexes(), server()->batch_cache_size() / 2);
 
-			std::string doc_indexed_id_serialized = serialize(doc.indexed_id);
-			docs_batch.Put(server()->db_docs().cfhandle(greylock::options::document_ids_column),
-					rocksdb::Slice(doc.id), rocksdb::Slice(doc_indexed_id_serialized));
+			std::set<std::string> shard_keys;
+			for (const auto &iq: queries) {
+				auto keys = iq.shard_keys(indexes_cache.options());
+				shard_keys.insert(keys.begin(), keys.end());
+			}
+			indexes_cache.prefetch_shards(std::vector<std::string>(shard_keys.begin(), shard_keys.end()));
 
+			std::vector<greylock::search_result> results(queries.size());
 
-			auto err = server()->db_docs().write(&docs_batch);
-			if (err) {
-				return greylock::create_error(err.code(), "could not write docs batch, mbox: %s, id: %s, error: %s",
-					doc.mbox.c_str(), doc.id.c_str(), err.message().c_str());
-			}
+			// calling thread always executes queries, additional threads are taken from the budget
+			// shared by all concurrent batches, they are returned even if query throws
+			struct threads_guard {
+				http_server *server;
+				size_t num;
 
-			err = server()->db_indexes().write(&indexes_batch);
-			if (err) {
-				return greylock::create_error(err.code(), "could not write indexes batch, mbox: %s, id: %s, error: %s",
-					doc.mbox.c_str(), doc.id.c_str(), err.message().c_str());
-			}
+				~threads_guard() {
+					server->release_batch_threads(num);
+				}
+			} extra{server(), server()->acquire_batch_threads(queries.empty() ? 0 : queries.size() - 1)};
+			size_t num_threads = extra.num + 1;
 
-			ILOG_INFO("index: successfully indexed document: mbox: %s, id: %s, "
-					"indexed_id: %s, indexes: %ld, serialized_doc_size: %ld",
-					doc.mbox.c_str(), doc.id.c_str(),
-					doc.indexed_id.to_string().c_str(), indexes, doc_value.size());
-			return greylock::error_info();
-		}
+			greylock::parallel_for(queries.size(), num_threads, [&] (size_t idx) {
+					greylock::intersector<greylock::read_cache<search_database>> inter(docs_cache, indexes_cache);
 
-		template <typename T>
-		std::vector<T> get_numeric_vector(const rapidjson::Value &data, const char *name) {
-			std::vector<T> ret;
-			const auto &arr = greylock::get_array(data, name);
-			if (!arr.IsArray())
-				return ret;
+					results[idx] = inter.intersect(queries[idx],
+							std::bind(&on_search_batch::check_result, this,
+								std::cref(queries[idx]), std::placeholders::_1));
+				});
 
-			for (auto it = arr.Begin(), end = arr.End(); it != end; it++) {
-				if (it->IsNumber())
-					ret.push_back((T)it->GetDouble());
+			greylock::usec_timer send_tm;
+			greylock::JsonValue ret;
+			auto &allocator = ret.GetAllocator();
+
+			rapidjson::Value jresults(rapidjson::kArrayType);
+			for (size_t i = 0; i < queries.size(); ++i) {
+				rapidjson::Value jres(rapidjson::kObjectType);
+				pack_search_result(jres, allocator, queries[i], results[i]);
+				jresults.PushBack(jres, allocator);
 			}
+			ret.AddMember("results", jresults, allocator);
 
-			return ret;
-		}
+			std::string data = ret.ToString();
 
-		std::vector<std::string> get_string_vector(const rapidjson::Value &ctx, const char *name) {
-			std::vector<std::string> ret;
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
 
-			const auto &a = greylock::get_array(ctx, name);
-			if (!a.IsArray())
-				return ret;
+			// serialization time of the whole reply is accounted to every query
+			long send_time = send_tm.elapsed();
+			for (size_t i = 0; i < results.size(); ++i) {
+				const auto &t = results[i].timings;
 
-			for (auto it = a.Begin(), end = a.End(); it != end; ++it) {
-				if (it->IsString())
-					ret.push_back(std::string(it->GetString(), it->GetStringLength()));
+				server()->observe_search(t, send_time);
+				log_slow_query("search_batch", queries[i], results[i],
+						t.shard_lookup + t.postings + t.intersection + t.documents);
 			}
+			server()->observe_request("search_batch", search_tm.elapsed());
 
-			return ret;
+			ILOG_INFO("search_batch: queries: %ld, shard keys: %ld, threads: %ld, cached: %.2f MB, duration: %d ms",
+					queries.size(), shard_keys.size(), num_threads,
+					(docs_cache.size() + indexes_cache.size()) / (1024. * 1024.), search_tm.elapsed() / 1000);
 		}
-		greylock::error_info parse_content(const rapidjson::Value &ctx, greylock::document &doc) {
-			doc.ctx.content = greylock::get_string(ctx, "content", "");
-			doc.ctx.title = greylock::get_string(ctx, "title", "");
-			doc.ctx.links = get_string_vector(ctx, "links");
-			doc.ctx.images = get_string_vector(ctx, "images");
+	};
 
-			return greylock::error_info();
-		}
+	// Counts documents matching the query, request has the same format as search request.
+	// Exact count runs intersection without reading documents (unless exact phrase match has to be checked),
+	// if "estimate" is set, counter is estimated from per-shard document counters, posting lists are not read,
+	// shards indexed by older versions do not have counters, such queries are counted exactly ("estimated": false).
+	struct on_count : public on_search_base {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) req;
 
-		greylock::error_info parse_docs(const std::string &mbox, const rapidjson::Value &docs) {
-			greylock::error_info err = greylock::create_error(-ENOENT,
-					"parse_docs: mbox: %s: could not parse document, there are no valid index entries", mbox.c_str());
+			greylock::usec_timer count_tm;
 
-			for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
-				if (!it->IsObject()) {
-					return greylock::create_error(-EINVAL, "docs entries must be objects");
-				}
+			rapidjson::Document doc;
+			greylock::intersection_query iq;
+			if (!parse_request("count", buffer, doc, iq))
+				return;
 
-				const char *id = greylock::get_string(*it, "id");
-				const char *author = greylock::get_string(*it, "author");
-				if (!id) {
-					return greylock::create_error(-EINVAL, "id must be string");
-				}
+			iq.projection = greylock::document::projection_ids;
+			iq.snippets = greylock::snippet_query();
+			iq.count_only = true;
 
-				struct timespec ts;
-				clock_gettime(CLOCK_REALTIME, &ts);
+			bool estimate = greylock::get_bool(doc, "estimate", false);
 
-				long tsec, tnsec;
-				const rapidjson::Value &timestamp = greylock::get_object(*it, "timestamp");
-				if (timestamp.IsObject()) {
-					tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
-					tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
-				} else {
-					tsec = ts.tv_sec;
-					tnsec = ts.tv_nsec;
-				}
+			greylock::search_result result;
+			greylock::intersector<search_database> inter(server()->search_docs(), server()->search_indexes());
+			if (estimate) {
+				result = inter.estimate(iq,
+						std::bind(&on_count::check_result, this, std::ref(iq), std::placeholders::_1));
+			} else {
+				result = inter.intersect(iq,
+						std::bind(&on_count::check_result, this, std::ref(iq), std::placeholders::_1));
+			}
 
+			greylock::JsonValue ret;
+			auto &allocator = ret.GetAllocator();
 
-				greylock::document doc;
-				doc.mbox = mbox;
-				doc.assign_id(id, std::hash<std::string>{}(id), tsec, tnsec);
+			ret.AddMember("count", (uint64_t)result.count, allocator);
+			ret.AddMember("estimated", result.estimated, allocator);
+			if (iq.explain) {
+				pack_explain(ret, allocator, result);
+			}
 
-				if (author) {
-					doc.author.assign(author);
-				}
+			std::string data = ret.ToString();
 
-				const rapidjson::Value &ctx = greylock::get_object(*it, "content");
-				if (ctx.IsObject()) {
-					err = parse_content(ctx, doc);
-					if (err)
-						return err;
-				}
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
 
-				const rapidjson::Value &idxs = greylock::get_object(*it, "index");
-				if (!idxs.IsObject()) {
-					return greylock::create_error(-EINVAL, "docs/index must be array");
-				}
+			this->send_reply(std::move(reply), std::move(data));
 
-				doc.idx = greylock::indexes::get_indexes(server()->db_indexes().options(), idxs);
+			server()->observe_search(result.timings, -1);
+			server()->observe_request("count", count_tm.elapsed());
+			log_slow_query("count", iq, result, count_tm.elapsed());
 
-				err = process_one_document(doc);
-				if (err)
-					return err;
+			ILOG_INFO("count: query: %s, count: %ld, estimated: %d, duration: %d ms",
+					iq.to_string().c_str(), result.count, result.estimated, count_tm.elapsed() / 1000);
+		}
+	};
+
+	struct on_index : public simple_request_stream_error<http_server> {
+		// parses request body @data and puts all documents into @batch, it runs in ingestion pipeline thread
+		virtual greylock::error_info prepare(const std::string &data, greylock::index_batch &batch) {
+			auto err = greylock::document_parser::parse_index_request(server()->db_indexes().options(),
+					data, batch, &m_mbox, &m_num_docs);
+			if (err)
+				return err;
+
+			m_tokens = batch.tokens();
+			m_docs_size = batch.docs_size();
+			m_prepared = true;
+			return greylock::error_info();
+		}
+
+		// it runs in ingestion pipeline thread when request has reached requested acknowledgement level
+		virtual void complete(const greylock::error_info &err, const greylock::ingest_pipeline::result &) {
+			if (err) {
+				// request has been parsed, write has failed
+				int status = m_prepared ? swarm::http_response::internal_server_error : swarm::http_response::bad_request;
+				send_error(status, err.code(), "index: %s", err.message().c_str());
+				return;
 			}
 
-			return err;
+			ILOG_INFO("index: mailbox: %s, keys: %ld, indexes: %ld, serialized_docs_size: %ld, ack: %d: "
+					"insertion completed, index duration: %ld ms",
+					m_mbox.c_str(), m_num_docs, m_tokens, m_docs_size, m_ack, m_index_tm.elapsed() / 1000);
+
+			server()->observe_request("index", m_index_tm.elapsed());
+
+			if (m_ack == greylock::ingest_pipeline::ack_accepted) {
+				this->send_reply(thevoid::http_response::accepted);
+			} else {
+				this->send_reply(thevoid::http_response::ok);
+			}
 		}
 
+		// acknowledgement level is selected by 'ack' URL parameter: accepted, memtable (default) or fsync
 		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
-			(void) req;
-			ribosome::timer index_tm;
+			m_ack = greylock::ingest_pipeline::ack_memtable;
+			if (auto ack = req.url().query().item_value("ack")) {
+				m_ack = greylock::ingest_pipeline::ack_from_string(*ack);
+				if (m_ack < 0) {
+					send_error(swarm::http_response::bad_request, -EINVAL,
+							"index: invalid ack '%s', must be one of: accepted, memtable, fsync", ack->c_str());
+					return;
+				}
+			}
 
 			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
-			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)),
+			auto data = std::make_shared<std::string>(boost::asio::buffer_cast<const char*>(buffer),
 					boost::asio::buffer_size(buffer));
 
+			// request stream must be alive until reply has been sent from the pipeline thread
+			auto self = std::static_pointer_cast<on_index>(this->shared_from_this());
+
+			auto err = server()->pipeline().push(m_ack,
+					[self, data] (greylock::index_batch &batch) -> greylock::error_info {
+						return self->prepare(*data, batch);
+					},
+					[self] (const greylock::error_info &err, const greylock::ingest_pipeline::result &res) {
+						self->complete(err, res);
+					});
+			if (err) {
+				send_error(swarm::http_response::service_unavailable, err.code(), "index: %s", err.message().c_str());
+				return;
+			}
+		}
+
+	protected:
+		greylock::usec_timer m_index_tm;
+		int m_ack = greylock::ingest_pipeline::ack_memtable;
+		bool m_prepared = false;
+
+		std::string m_mbox;
+		size_t m_num_docs = 0;
+		size_t m_tokens = 0;
+		size_t m_docs_size = 0;
+	};
+
+	// removes documents: { "ids": ["document id", ...] }
+	// uses the same ingestion pipeline and acknowledgement levels as indexing handler
+	struct on_delete : public on_index {
+		virtual greylock::error_info prepare(const std::string &data, greylock::index_batch &batch) {
 			rapidjson::Document doc;
 			doc.Parse<0>(data.c_str());
 
 			if (doc.HasParseError()) {
-				send_error(swarm::http_response::bad_request, -EINVAL,
-						"index: could not parse document: %s, error offset: %d",
+				return greylock::create_error(-EINVAL, "could not parse document: %s, error offset: %d",
 						doc.GetParseError(), doc.GetErrorOffset());
-				return;
 			}
 
 			if (!doc.IsObject()) {
-				send_error(swarm::http_response::bad_request, -EINVAL, "index: document must be object, its type: %d",
-						doc.GetType());
-				return;
+				return greylock::create_error(-EINVAL, "document must be object, its type: %d", doc.GetType());
 			}
 
-			const char *mbox = greylock::get_string(doc, "mailbox");
-			if (!mbox) {
-				send_error(swarm::http_response::bad_request, -ENOENT, "index: 'mailbox' must be a string");
-				this->send_reply(swarm::http_response::bad_request);
-				return;
+			const rapidjson::Value &ids = greylock::get_array(doc, "ids");
+			if (!ids.IsArray()) {
+				return greylock::create_error(-ENOENT, "'ids' must be array");
 			}
+			m_num_docs = ids.Size();
 
-			const rapidjson::Value &docs = greylock::get_array(doc, "docs");
-			if (!docs.IsArray()) {
-				send_error(swarm::http_response::bad_request, -ENOENT, "index: mailbox: %s, 'docs' must be array", mbox);
-				return;
+			for (auto it = ids.Begin(), id_end = ids.End(); it != id_end; ++it) {
+				if (!it->IsString()) {
+					return greylock::create_error(-EINVAL, "'ids' entries must be strings");
+				}
+
+				std::string id(it->GetString(), it->GetStringLength());
+				auto err = batch.remove(id);
+				if (err) {
+					return greylock::create_error(err.code(), "could not remove document %s: %s",
+							id.c_str(), err.message().c_str());
+				}
 			}
 
-			greylock::error_info err = parse_docs(mbox, docs);
+			m_prepared = true;
+			return greylock::error_info();
+		}
+
+		// removed and missing documents are known only after removals have been resolved by the writer,
+		// they are not reported for requests acknowledged before write
+		virtual void complete(const greylock::error_info &err, const greylock::ingest_pipeline::result &res) {
 			if (err) {
-				send_error(swarm::http_response::bad_request, err.code(),
-						"index: mailbox: %s, keys: %d: insertion error: %s",
-					mbox, docs.Size(), err.message());
+				int status = m_prepared ? swarm::http_response::internal_server_error : swarm::http_response::bad_request;
+				send_error(status, err.code(), "delete: %s", err.message().c_str());
 				return;
 			}
 
-			ILOG_INFO("index: mailbox: %s, keys: %d: insertion completed, index duration: %d ms",
-					mbox, docs.Size(), index_tm.elapsed());
-			this->send_reply(thevoid::http_response::ok);
+			ILOG_INFO("delete: ids: %ld, removed: %ld, missing: %ld, ack: %d: removal completed, duration: %ld ms",
+					m_num_docs, res.removed, res.missing, m_ack, m_index_tm.elapsed() / 1000);
+
+			server()->observe_request("delete", m_index_tm.elapsed());
+
+			greylock::JsonValue ret;
+			ret.AddMember("ids", (uint64_t)m_num_docs, ret.GetAllocator());
+			if (m_ack != greylock::ingest_pipeline::ack_accepted) {
+				ret.AddMember("removed", (uint64_t)res.removed, ret.GetAllocator());
+				ret.AddMember("missing", (uint64_t)res.missing, ret.GetAllocator());
+			}
+
+			std::string data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(m_ack == greylock::ingest_pipeline::ack_accepted ?
+					thevoid::http_response::accepted : thevoid::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
 		}
 	};
 
@@ -582,10 +1044,225 @@ public:
 	greylock::database &db_indexes() {
 		return m_db_indexes;
 	}
+	// searches read frozen shards from mapped segments when they are configured
+	search_database &search_docs() {
+		return *m_search_docs;
+	}
+	search_database &search_indexes() {
+		return *m_search_indexes;
+	}
+	greylock::ingest_pipeline &pipeline() {
+		return *m_pipeline;
+	}
+	greylock::metrics &metrics() {
+		return m_metrics;
+	}
+
+	void observe_request(const char *endpoint, long usec) {
+		m_metrics.histogram("greylock_request_duration_seconds",
+				std::string("endpoint=\"") + endpoint + "\"").observe(usec);
+	}
+
+	// @send_usec is time spent serializing and sending reply, negative if reply does not contain documents
+	void observe_search(const greylock::search_timings &t, long send_usec) {
+		static const char *name = "greylock_search_stage_duration_seconds";
+
+		m_metrics.histogram(name, "stage=\"shard_lookup\"").observe(t.shard_lookup);
+		m_metrics.histogram(name, "stage=\"postings\"").observe(t.postings);
+		m_metrics.histogram(name, "stage=\"intersection\"").observe(t.intersection);
+		m_metrics.histogram(name, "stage=\"documents\"").observe(t.documents);
+		if (send_usec >= 0)
+			m_metrics.histogram(name, "stage=\"serialization\"").observe(send_usec);
+	}
+
+	long retention_days() const {
+		return m_retention_days;
+	}
+
+	// 0 disables slow query log
+	long slow_query_usec() const {
+		return m_slow_query_ms * 1000;
+	}
+
+	// returns at most @num threads taken from the budget shared by all search batches
+	size_t acquire_batch_threads(size_t num) {
+		std::lock_guard<std::mutex> guard(m_batch_threads_lock);
+		num = std::min(num, m_batch_threads_free);
+		m_batch_threads_free -= num;
+		return num;
+	}
+
+	void release_batch_threads(size_t num) {
+		std::lock_guard<std::mutex> guard(m_batch_threads_lock);
+		m_batch_threads_free += num;
+	}
+
+	// maximum size of documents and posting lists cached by a single search batch
+	size_t batch_cache_size() const {
+		return m_batch_cache_size;
+	}
+
+	// Starts background compaction of @column split into chunks of @chunk_size bytes, @threads chunks are
+	// compacted concurrently. Only one such compaction can run at a time.
+	// If @rate is positive, compaction rate limit is changed while this compaction runs,
+	// configured limit is restored when it completes.
+	greylock::error_info start_compaction(const std::string &db_name, greylock::database &db, int column,
+			uint64_t chunk_size, int threads, int64_t rate, size_t *chunks) {
+		std::lock_guard<std::mutex> guard(m_compaction_lock);
+
+		if (m_compaction_running) {
+			return greylock::create_error(-EBUSY, "compaction is already running");
+		}
+		if (m_compaction.joinable()) {
+			m_compaction.join();
+		}
+
+		if (rate > 0) {
+			auto err = db.set_compaction_rate(rate);
+			if (err)
+				return err;
+		}
+
+		auto ranges = db.compaction_ranges(column, chunk_size);
+		*chunks = ranges.size();
+
+		m_compaction_running = true;
+		m_compaction = std::thread([this, db_name, &db, column, threads, rate, ranges] () {
+				std::string cname = db.options().column_name(column);
+				ribosome::timer tm;
+				std::atomic_size_t completed(0);
+
+				greylock::parallel_for(ranges.size(), threads, [&] (size_t idx) {
+						if (m_compaction_stop)
+							return;
+
+						const auto &r = ranges[idx];
+						ribosome::timer ctm;
+
+						auto err = db.compact_range(column, r.first, r.second);
+						if (err) {
+							ILOG_ERROR("compaction: db: %s, column: %s, chunk: %ld: %s [%d]",
+									db_name.c_str(), cname.c_str(), idx, err.message().c_str(), err.code());
+							return;
+						}
+
+						ILOG_INFO("compaction: db: %s, column: %s, chunks: %ld/%ld, duration: %ld ms",
+								db_name.c_str(), cname.c_str(), ++completed, ranges.size(), ctm.elapsed());
+					});
+
+				ILOG_INFO("compaction: db: %s, column: %s, compacted chunks: %ld/%ld, duration: %ld ms",
+						db_name.c_str(), cname.c_str(), (size_t)completed, ranges.size(), tm.elapsed());
+
+				if (rate > 0) {
+					auto err = db.set_compaction_rate(db.options().compaction_rate_limit);
+					if (err) {
+						ILOG_ERROR("compaction: db: %s, could not restore compaction rate %ld: %s [%d]",
+								db_name.c_str(), db.options().compaction_rate_limit,
+								err.message().c_str(), err.code());
+					}
+				}
+				m_compaction_running = false;
+			});
+
+		return greylock::error_info();
+	}
+
+	// drops all data older than @days days from both databases, @shard is set to the oldest kept shard number
+	greylock::error_info expire(long days, size_t *shard) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		long expire_before = ts.tv_sec - days * 3600 * 24;
+		if (expire_before < 0) {
+			expire_before = 0;
+		}
+		*shard = expire_before / m_db_indexes.options().tokens_shard_size;
+
+		// posting lists are dropped first, they must not reference expired documents
+		auto err = m_db_indexes.expire_shards(*shard);
+		if (err)
+			return err;
+
+		return m_db_docs.expire_shards(*shard);
+	}
 
 private:
+	// pipeline completion callbacks update metrics, thus it is destroyed last
+	greylock::metrics m_metrics;
+
 	greylock::database m_db_docs, m_db_indexes;
 
+	std::unique_ptr<search_database> m_search_docs, m_search_indexes;
+
+	// must be destroyed before databases, since it flushes queued requests
+	std::unique_ptr<greylock::ingest_pipeline> m_pipeline;
+
+	long m_slow_query_ms = 0;
+
+	// number of threads executing search batches in addition to the http threads
+	size_t m_batch_threads = 8;
+	size_t m_batch_cache_size = 256 * 1024 * 1024;
+	std::mutex m_batch_threads_lock;
+	size_t m_batch_threads_free = 0;
+
+	std::mutex m_compaction_lock;
+	std::thread m_compaction;
+	std::atomic_bool m_compaction_running{false};
+	std::atomic_bool m_compaction_stop{false};
+
+	long m_retention_days = 0;
+	long m_retention_check_interval = 3600;
+	ribosome::expiration m_retention_timer;
+
+	void retention_init(const rapidjson::Value &config) {
+		const auto &rconf = greylock::get_object(config, "retention");
+		if (!rconf.IsObject())
+			return;
+
+		m_retention_days = greylock::get_int64(rconf, "days", 0);
+		m_retention_check_interval = greylock::get_int64(rconf, "check_interval", m_retention_check_interval);
+
+		if (m_retention_days > 0 && m_retention_check_interval > 0) {
+			retention_callback();
+		}
+	}
+
+	void retention_callback() {
+		ribosome::timer tm;
+		size_t shard;
+
+		auto err = expire(m_retention_days, &shard);
+		if (err) {
+			ILOG_ERROR("retention: days: %ld: could not expire shards: %s [%d]",
+					m_retention_days, err.message().c_str(), err.code());
+		} else {
+			ILOG_INFO("retention: days: %ld, expired shard: %ld, duration: %ld ms",
+					m_retention_days, shard, tm.elapsed());
+		}
+
+		auto expires_at = std::chrono::system_clock::now() + std::chrono::seconds(m_retention_check_interval);
+		m_retention_timer.insert(expires_at, std::bind(&http_server::retention_callback, this));
+	}
+
+	void pipeline_init(const rapidjson::Value &config) {
+		greylock::pipeline_options opts;
+
+		const auto &iconf = greylock::get_object(config, "ingest");
+		if (iconf.IsObject()) {
+			opts.parse_threads = greylock::get_int64(iconf, "parse_threads", opts.parse_threads);
+			opts.write_threads = greylock::get_int64(iconf, "write_threads", opts.write_threads);
+			opts.queue_size = greylock::get_int64(iconf, "queue_size", opts.queue_size);
+			opts.group_commit_size = greylock::get_int64(iconf, "group_commit_size", opts.group_commit_size);
+		}
+
+		opts.write_error_handler = [this] (const greylock::error_info &err, size_t requests) {
+			ILOG_ERROR("ingest: write of %ld accepted requests has failed: %s [%d]",
+					requests, err.message().c_str(), err.code());
+		};
+
+		m_pipeline.reset(new greylock::ingest_pipeline(m_db_docs, m_db_indexes, opts));
+	}
+
 	bool rocksdb_init(const rapidjson::Value &config) {
 		const auto &rdbconf = greylock::get_object(config, "rocksdb.docs");
 		if (!rdbconf.IsObject()) {
@@ -605,6 +1282,25 @@ private:
 		if (!rocksdb_config_parse(riconf, &m_db_indexes))
 			return false;
 
+		std::shared_ptr<greylock::segment_set> segments;
+		const char *segments_path = greylock::get_string(riconf, "segments");
+		if (segments_path) {
+			segments = std::make_shared<greylock::segment_set>();
+
+			auto err = segments->open(segments_path);
+			if (err) {
+				ILOG_ERROR("could not open segments: %s [%d]", err.message().c_str(), err.code());
+				return false;
+			}
+
+			for (const auto &seg: segments->segments()) {
+				ILOG_INFO("segment: %s, shards: [%ld, %ld), keys: %ld",
+						seg->path().c_str(), seg->shard_start(), seg->shard_end(), seg->num_keys());
+			}
+		}
+
+		m_search_docs.reset(new search_database(m_db_docs, NULL));
+		m_search_indexes.reset(new search_database(m_db_indexes, segments));
 		return true;
 	}
 
@@ -617,7 +1313,20 @@ private:
 		bool ro = greylock::get_bool(config, "read_only", false);
 		bool bulk = greylock::get_bool(config, "bulk_upload", false);
 
-		auto err = db->open(path, ro, bulk);
+		greylock::options opts = db->options();
+		opts.documents_dict_size = greylock::get_int64(config, "documents_dict_size", opts.documents_dict_size);
+		opts.documents_dict_train_size = greylock::get_int64(config, "documents_dict_train_size",
+				opts.documents_dict_train_size);
+		opts.compaction_rate_limit = greylock::get_int64(config, "compaction_rate_mb", 0) * 1024 * 1024;
+		opts.max_subcompactions = greylock::get_int64(config, "max_subcompactions", opts.max_subcompactions);
+
+		auto err = db->set_options(opts);
+		if (err) {
+			ILOG_ERROR("could not set database options: %s [%d]", err.message().c_str(), err.code());
+			return false;
+		}
+
+		err = db->open(path, ro, bulk);
 		if (err) {
 			ILOG_ERROR("could not open database: %s [%d]", err.message().c_str(), err.code());
 			return false;